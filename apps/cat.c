@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/select.h>
+#include "ncp.h"
+
+/* Copy standard input to a connection and the connection to standard
+   output, both at once.  NCP connections can't be half closed, so at
+   the end of input the connection is closed once the data is out, or
+   after waiting a while for more from the other end.  A listener
+   waits for the other end to close, unless told otherwise. */
+
+#define BUFFER    65536
+#define READ_MAX  255           // Octets asked for in one NCP read.
+#define WRITE_MAX 198           // Octets the NCP takes in one write.
+
+static int connection = -1;
+static int reading, writing, closing;
+static int in_eof, ncp_eof;
+static uint8_t to_ncp[BUFFER], to_out[BUFFER];
+static int to_ncp_length, to_out_length;
+static long sent, received;
+static int linger = -1;         // Seconds to wait for data after input ends.
+static double quiet;            // Last data from the connection.
+
+static void fatal (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void replies (int listening)
+{
+  struct ncp_reply r;
+  int n;
+
+  while ((n = ncp_reply (&r)) == 1) {
+    switch (r.type) {
+    case NCP_REPLY_OPEN:
+      if (r.error != 0)
+        fatal ("Open refused.");
+      connection = r.connection;
+      break;
+    case NCP_REPLY_LISTEN:
+      if (r.error != 0)
+        fatal ("NCP listen error.");
+      if (connection != -1) {
+        // Only one at a time.
+        ncp_send_close (r.connection);
+        break;
+      }
+      fprintf (stderr, "Connection from host %s on socket %d.\n",
+               ncp_host_name (r.host), listening);
+      connection = r.connection;
+      break;
+    case NCP_REPLY_READ:
+      if (r.connection != connection)
+        break;
+      reading = 0;
+      quiet = now ();
+      if (r.length == 0)
+        ncp_eof = 1;
+      memcpy (to_out + to_out_length, r.data, r.length);
+      to_out_length += r.length;
+      received += r.length;
+      break;
+    case NCP_REPLY_WRITE:
+      if (r.connection != connection)
+        break;
+      writing = 0;
+      if (r.length == 0)
+        fatal ("NCP write error.");
+      to_ncp_length -= r.length;
+      memmove (to_ncp, to_ncp + r.length, to_ncp_length);
+      sent += r.length;
+      break;
+    case NCP_REPLY_CLOSE:
+      if (r.connection == connection)
+        closing = 2;
+      break;
+    }
+  }
+  if (n == -1)
+    fatal ("NCP reply error.");
+}
+
+// Start NCP requests for what there is room or data for.
+static void pump (void)
+{
+  int n;
+
+  if (closing)
+    return;
+  if ((ncp_eof && !writing) ||
+      (in_eof && to_ncp_length == 0 && !writing && linger >= 0 &&
+       now () - quiet >= linger)) {
+    if (ncp_send_close (connection) == -1)
+      fatal ("NCP close error.");
+    closing = 1;
+    return;
+  }
+  if (!reading && !ncp_eof && BUFFER - to_out_length >= READ_MAX) {
+    if (ncp_send_read (connection, READ_MAX) == -1)
+      fatal ("NCP read error.");
+    reading = 1;
+  }
+  if (!writing && to_ncp_length > 0) {
+    n = to_ncp_length > WRITE_MAX ? WRITE_MAX : to_ncp_length;
+    if (ncp_send_write (connection, to_ncp, n) == -1)
+      fatal ("NCP write error.");
+    writing = 1;
+  }
+}
+
+static void loop (int listening)
+{
+  struct timeval tv, *timeout;
+  fd_set rfds, wfds;
+  ssize_t n;
+
+  // Done when closed and everything received has been written out.
+  while (closing != 2 || to_out_length > 0) {
+    FD_ZERO (&rfds);
+    FD_ZERO (&wfds);
+    FD_SET (ncp_fd (), &rfds);
+    if (!in_eof && to_ncp_length < BUFFER && connection != -1)
+      FD_SET (0, &rfds);
+    if (to_out_length > 0)
+      FD_SET (1, &wfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    timeout = in_eof && linger > 0 ? &tv : NULL;
+    if (select (ncp_fd () + 1, &rfds, &wfds, NULL, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      fatal ("Select error.");
+    }
+
+    if (FD_ISSET (ncp_fd (), &rfds))
+      replies (listening);
+    if (FD_ISSET (0, &rfds)) {
+      n = read (0, to_ncp + to_ncp_length, BUFFER - to_ncp_length);
+      if (n <= 0) {
+        in_eof = 1;
+        quiet = now ();
+      } else
+        to_ncp_length += n;
+    }
+    if (FD_ISSET (1, &wfds)) {
+      n = write (1, to_out, to_out_length);
+      if (n <= 0)
+        fatal ("Write error.");
+      to_out_length -= n;
+      memmove (to_out, to_out + n, to_out_length);
+    }
+    if (connection != -1)
+      pump ();
+  }
+}
+
+static void usage (const char *argv0)
+{
+  fprintf (stderr, "Usage: %s [-q] [-w seconds] host socket\n"
+           "or %s [-q] [-w seconds] -l socket\n", argv0, argv0);
+}
+
+int main (int argc, char **argv)
+{
+  int opt, host = -1, sock = -1, listening = -1, verbose = 1;
+  double start, t;
+
+  while ((opt = getopt (argc, argv, "l:qw:")) != -1) {
+    switch (opt) {
+    case 'l':
+      listening = atoi (optarg);
+      break;
+    case 'q':
+      verbose = 0;
+      break;
+    case 'w':
+      linger = atoi (optarg);
+      break;
+    default:
+      usage (argv[0]);
+      exit (1);
+    }
+  }
+
+  if (listening == -1 && argc - optind == 2) {
+    host = ncp_host (argv[optind++]);
+    sock = atoi (argv[optind++]);
+  }
+
+  if (argc != optind || (listening == -1 && host == -1)) {
+    usage (argv[0]);
+    exit (1);
+  }
+  if (listening == -1 && linger == -1)
+    linger = 0;
+
+  if (ncp_init (NULL) == -1) {
+    fprintf (stderr, "NCP initialization error: %s.\n", strerror (errno));
+    if (errno == ECONNREFUSED)
+      fprintf (stderr, "Is the NCP server started?\n");
+    else if (errno == EFAULT)
+      fprintf (stderr, "Is the NCP environment variable set?\n");
+    exit (1);
+  }
+
+  signal (SIGPIPE, SIG_IGN);
+  if (listening != -1) {
+    if (ncp_send_listen (listening, 8) == -1)
+      fatal ("NCP listen error.");
+  } else if (ncp_send_open (host, sock, 8) == -1)
+    fatal ("NCP open error.");
+
+  start = now ();
+  loop (listening);
+
+  if (verbose) {
+    t = now () - start;
+    fprintf (stderr, "Sent %ld, received %ld octets in %.2f s, "
+             "%.0f octets/s.\n", sent, received, t,
+             t > 0 ? (sent + received) / t : 0);
+  }
+  return 0;
+}
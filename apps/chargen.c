@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/select.h>
+#include "ncp.h"
+
+/* Character generator, for testing throughput and data integrity.
+   The sending side writes a repeating pattern as fast as allowed,
+   and the receiving side checks that it arrives intact.  The client
+   and server can each take either role. */
+
+#define CHARGEN_SOCKET   19
+
+#define LINE        72          // Characters per line, as in RFC 864.
+#define PERIOD_MAX  (95 * (LINE + 2))
+#define WRITE_MAX   198
+#define READ_MAX    255
+#define CONNECTIONS 64
+
+static unsigned char pattern[PERIOD_MAX + 1000];
+static int period;
+static int byte_size = 8;
+static int write_size = WRITE_MAX;
+static long count;              // Octets to send, or 0 for no limit.
+static long rate;               // Octets per second, or 0 for no limit.
+static int verify;
+
+/* Lay out one period of the pattern, and enough more that any write
+   can be taken from a single place in it. */
+static int make_pattern (const char *name)
+{
+  int i, j;
+  if (strcmp (name, "lines") == 0) {
+    // Each line starts one character further along, as in RFC 864.
+    period = 95 * (LINE + 2);
+    for (i = 0; i < 95; i++) {
+      for (j = 0; j < LINE; j++)
+        pattern[i * (LINE + 2) + j] = ' ' + (i + j) % 95;
+      pattern[i * (LINE + 2) + LINE] = 015;
+      pattern[i * (LINE + 2) + LINE + 1] = 012;
+    }
+  } else if (strcmp (name, "octets") == 0) {
+    period = 256;
+    for (i = 0; i < period; i++)
+      pattern[i] = i;
+  } else if (strcmp (name, "zero") == 0) {
+    period = 1;
+    pattern[0] = 0;
+  } else
+    return -1;
+  for (i = period; i < sizeof pattern; i++)
+    pattern[i] = pattern[i % period];
+  return 0;
+}
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// How much may be sent at this time, given the rate limit.
+static int allowed (long offset, double start, int n)
+{
+  double due;
+  if (count > 0 && n > count - offset)
+    n = count - offset;
+  if (rate == 0)
+    return n;
+  due = (now () - start) * rate - offset;
+  if (due < n)
+    n = due < 0 ? 0 : due;
+  return n;
+}
+
+// Returns the offset of the first wrong octet, or -1.
+static long check (const unsigned char *data, int n, long offset)
+{
+  const unsigned char *expected = pattern + offset % period;
+  int i;
+  if (memcmp (data, expected, n) == 0)
+    return -1;
+  for (i = 0; data[i] == expected[i]; i++)
+    ;
+  return offset + i;
+}
+
+static void report (const char *what, long octets, double start)
+{
+  double t = now () - start;
+  fprintf (stderr, "%s %ld octets in %.2f s, %.0f octets/s.\n",
+           what, octets, t, t > 0 ? octets / t : 0);
+}
+
+static void send_pattern (int connection)
+{
+  double start = now ();
+  long offset = 0;
+  int n;
+
+  while (count == 0 || offset < count) {
+    n = allowed (offset, start, write_size);
+    if (n == 0) {
+      usleep (10000);
+      continue;
+    }
+    if (ncp_write (connection, pattern + offset % period, &n) == -1) {
+      fprintf (stderr, "NCP write error.\n");
+      exit (1);
+    }
+    if (n == 0)
+      break;
+    offset += n;
+  }
+  report ("Sent", offset, start);
+}
+
+static void check_pattern (int connection)
+{
+  unsigned char data[READ_MAX];
+  double start = now ();
+  long offset = 0, bad;
+  int n;
+
+  for (;;) {
+    n = sizeof data;
+    if (ncp_read (connection, data, &n) == -1) {
+      fprintf (stderr, "NCP read error.\n");
+      exit (1);
+    }
+    if (n == 0)
+      break;
+    bad = check (data, n, offset);
+    if (bad != -1) {
+      fprintf (stderr, "Pattern differs at octet %ld.\n", bad);
+      exit (1);
+    }
+    offset += n;
+  }
+  report ("Received", offset, start);
+}
+
+static void chargen_client (int host, int sock)
+{
+  int connection, size;
+
+  size = byte_size;
+  switch (ncp_open (host, sock, &size, &connection)) {
+  case 0:
+    break;
+  case -1:
+  default:
+    fprintf (stderr, "NCP open error.\n");
+    exit (1);
+  case -2:
+    fprintf (stderr, "Open refused.\n");
+    exit (1);
+  }
+
+  if (verify)
+    check_pattern (connection);
+  else
+    send_pattern (connection);
+
+  if (ncp_close (connection) == -1) {
+    fprintf (stderr, "NCP close error.\n");
+    exit (1);
+  }
+}
+
+/* The server keeps listening, and serves any number of connections at
+   once from one loop of asynchronous NCP requests. */
+static struct chargen
+{
+  int connection;               // -1 if the slot is free.
+  int busy;                     // A request is outstanding.
+  long offset;
+  double start;
+} chargen[CONNECTIONS];
+
+static struct chargen *find_chargen (int connection)
+{
+  int i;
+  for (i = 0; i < CONNECTIONS; i++) {
+    if (chargen[i].connection == connection)
+      return &chargen[i];
+  }
+  return NULL;
+}
+
+static void end_chargen (struct chargen *c)
+{
+  fprintf (stderr, "Connection %d: ", c->connection);
+  report (verify ? "received" : "sent", c->offset, c->start);
+  if (ncp_send_close (c->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+  c->connection = -1;
+}
+
+static void chargen_reply (struct ncp_reply *r, int sock)
+{
+  struct chargen *c;
+  long bad;
+
+  if (r->type == NCP_REPLY_LISTEN) {
+    if (r->error != 0) {
+      fprintf (stderr, "NCP listen error.\n");
+      exit (1);
+    }
+    fprintf (stderr, "Connection from host %s on socket %d.\n",
+             ncp_host_name (r->host), sock);
+    c = find_chargen (-1);
+    if (c == NULL) {
+      ncp_send_close (r->connection);
+      return;
+    }
+    c->connection = r->connection;
+    c->busy = 0;
+    c->offset = 0;
+    c->start = now ();
+    return;
+  }
+
+  c = find_chargen (r->connection);
+  if (c == NULL)
+    return;
+  c->busy = 0;
+  switch (r->type) {
+  case NCP_REPLY_READ:
+    if (r->length == 0) {
+      end_chargen (c);
+      break;
+    }
+    bad = check (r->data, r->length, c->offset);
+    if (bad != -1) {
+      fprintf (stderr, "Connection %d: pattern differs at octet %ld.\n",
+               c->connection, bad);
+      end_chargen (c);
+      break;
+    }
+    c->offset += r->length;
+    break;
+  case NCP_REPLY_WRITE:
+    c->offset += r->length;
+    if (r->length == 0 || (count > 0 && c->offset >= count))
+      end_chargen (c);
+    break;
+  }
+}
+
+// Start the next request on a connection.  Returns nonzero if the
+// rate limit held it back.
+static int chargen_pump (struct chargen *c)
+{
+  int n;
+  if (c->busy)
+    return 0;
+  if (verify) {
+    if (ncp_send_read (c->connection, READ_MAX) == -1)
+      fprintf (stderr, "NCP read error.\n");
+  } else {
+    n = allowed (c->offset, c->start,
+                 write_size > WRITE_MAX ? WRITE_MAX : write_size);
+    if (n == 0)
+      return 1;
+    if (ncp_send_write (c->connection, pattern + c->offset % period, n) == -1)
+      fprintf (stderr, "NCP write error.\n");
+  }
+  c->busy = 1;
+  return 0;
+}
+
+static void chargen_server (int sock)
+{
+  struct ncp_reply r;
+  struct timeval tv, *timeout;
+  fd_set rfds;
+  int i, n, held = 0;
+
+  for (i = 0; i < CONNECTIONS; i++)
+    chargen[i].connection = -1;
+  if (ncp_send_listen (sock, byte_size) == -1) {
+    fprintf (stderr, "NCP listen error.\n");
+    exit (1);
+  }
+
+  for (;;) {
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    // Check back soon on connections held by the rate limit.
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+    timeout = held ? &tv : NULL;
+    if (select (ncp_fd () + 1, &rfds, NULL, NULL, timeout) > 0) {
+      while ((n = ncp_reply (&r)) == 1)
+        chargen_reply (&r, sock);
+      if (n == -1) {
+        fprintf (stderr, "NCP reply error.\n");
+        exit (1);
+      }
+    }
+    held = 0;
+    for (i = 0; i < CONNECTIONS; i++) {
+      if (chargen[i].connection != -1)
+        held |= chargen_pump (&chargen[i]);
+    }
+  }
+}
+
+static void usage (const char *argv0)
+{
+  fprintf (stderr, "Usage: %s -c [-v] [options] host\n"
+           "or %s -s [-v] [options]\n"
+           "Options: -p socket, -b byte size, -w write size,\n"
+           "-n octets, -r octets/s, -P lines|octets|zero\n",
+           argv0, argv0);
+}
+
+int main (int argc, char **argv)
+{
+  int opt, client = 1, server = 0;
+  int host = -1;
+  int sock = -1;
+  const char *name = "lines";
+
+  while ((opt = getopt (argc, argv, "b:cn:p:P:r:svw:")) != -1) {
+    switch (opt) {
+    case 'b':
+      byte_size = atoi (optarg);
+      break;
+    case 'c':
+      client = 1;
+      server = 0;
+      break;
+    case 'n':
+      count = atol (optarg);
+      break;
+    case 'p':
+      sock = atoi (optarg);
+      break;
+    case 'P':
+      name = optarg;
+      break;
+    case 'r':
+      rate = atol (optarg);
+      break;
+    case 's':
+      client = 0;
+      server = 1;
+      break;
+    case 'v':
+      // Receive and check the pattern instead of sending it.
+      verify = 1;
+      break;
+    case 'w':
+      write_size = atoi (optarg);
+      if (write_size < 1 || write_size > 1000) {
+        fprintf (stderr, "Write size must be 1 to 1000.\n");
+        exit (1);
+      }
+      break;
+    default:
+      usage (argv[0]);
+      exit (1);
+    }
+  }
+
+  if (client && optind < argc)
+    host = ncp_host (argv[optind++]);
+
+  if (argc != optind || (client && host == -1)) {
+    usage (argv[0]);
+    exit (1);
+  }
+
+  if (make_pattern (name) == -1) {
+    fprintf (stderr, "Unknown pattern %s.\n", name);
+    exit (1);
+  }
+
+  if (sock == -1)
+    sock = CHARGEN_SOCKET;
+
+  if (ncp_init (NULL) == -1) {
+    fprintf (stderr, "NCP initialization error: %s.\n", strerror (errno));
+    if (errno == ECONNREFUSED)
+      fprintf (stderr, "Is the NCP server started?\n");
+    else if (errno == EFAULT)
+      fprintf (stderr, "Is the NCP environment variable set?\n");
+    exit (1);
+  }
+
+  if (client)
+    chargen_client (host, sock);
+  else if (server)
+    chargen_server (sock);
+
+  return 0;
+}
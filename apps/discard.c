@@ -4,35 +4,160 @@
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <sys/select.h>
 #include "ncp.h"
 
 #define DISCARD_SOCKET   9
 
+/* The server keeps listening, and reads from any number of
+   connections at once.  Every interval seconds it reports the rate
+   on each connection and in total.  A connection with nothing sent
+   for IDLE seconds is closed. */
+#define CONNECTIONS 64
+#define READ_MAX    255
+#define IDLE        300         // Seconds to wait for data.
+
+static struct discard
+{
+  int connection;               // -1 if the slot is free.
+  int host;
+  long octets, reported;
+  double start, active;
+} discard[CONNECTIONS];
+
+static int interval = 10;
+static long total;
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct discard *find_discard (int connection)
+{
+  int i;
+  for (i = 0; i < CONNECTIONS; i++) {
+    if (discard[i].connection == connection)
+      return &discard[i];
+  }
+  return NULL;
+}
+
+static void end_discard (struct discard *d)
+{
+  double t = now () - d->start;
+  fprintf (stderr, "Connection %d from host %s closed: "
+           "%ld octets in %.1f s, %.0f octets/s.\n",
+           d->connection, ncp_host_name (d->host), d->octets, t, d->octets / t);
+  if (ncp_send_close (d->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+  d->connection = -1;
+}
+
+static void report (double t)
+{
+  struct discard *d;
+  int i, n = 0;
+  for (i = 0; i < CONNECTIONS; i++) {
+    d = &discard[i];
+    if (d->connection == -1)
+      continue;
+    fprintf (stderr, "Connection %d from host %s: %.0f octets/s.\n",
+             d->connection, ncp_host_name (d->host), (d->octets - d->reported) / t);
+    d->reported = d->octets;
+    n++;
+  }
+  if (n > 0 || total > 0)
+    fprintf (stderr, "Total %d connections: %.0f octets/s.\n", n, total / t);
+  total = 0;
+}
+
+static void discard_reply (struct ncp_reply *r, int sock)
+{
+  struct discard *d;
+
+  if (r->type == NCP_REPLY_LISTEN) {
+    if (r->error != 0) {
+      fprintf (stderr, "NCP listen error.\n");
+      exit (1);
+    }
+    fprintf (stderr, "Connection from host %s on socket %d.\n",
+             ncp_host_name (r->host), sock);
+    d = find_discard (-1);
+    if (d == NULL) {
+      ncp_send_close (r->connection);
+      return;
+    }
+    d->connection = r->connection;
+    d->host = r->host;
+    d->octets = d->reported = 0;
+    d->start = d->active = now ();
+    if (ncp_send_read (d->connection, READ_MAX) == -1)
+      fprintf (stderr, "NCP read error.\n");
+    return;
+  }
+
+  d = find_discard (r->connection);
+  if (d == NULL || r->type != NCP_REPLY_READ)
+    return;
+  if (r->length == 0) {
+    end_discard (d);
+    return;
+  }
+  d->octets += r->length;
+  d->active = now ();
+  total += r->length;
+  if (ncp_send_read (d->connection, READ_MAX) == -1)
+    fprintf (stderr, "NCP read error.\n");
+}
+
 static void discard_server (int sock)
 {
-  int host, connection, size;
-  char buffer[1000];
+  struct ncp_reply r;
+  struct timeval tv;
+  double last, t;
+  fd_set rfds;
+  int i, n;
 
-  size = 8;
-  if (ncp_listen (sock, &size, &host, &connection) == -1) {
+  for (i = 0; i < CONNECTIONS; i++)
+    discard[i].connection = -1;
+  if (ncp_send_listen (sock, 8) == -1) {
     fprintf (stderr, "NCP listen error.\n");
     exit (1);
   }
-  fprintf (stderr, "Connection from host %03o on socket %d.\n", host, sock);
 
+  last = now ();
   for (;;) {
-    size = sizeof buffer;
-    if (ncp_read (connection, buffer, &size) == -1)
-      fprintf (stderr, "NCP read error.\n");
-    if (size <= 0)
-      return;
-    fprintf (stderr, "Read %d octets.\n", size);
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (select (ncp_fd () + 1, &rfds, NULL, NULL, &tv) > 0) {
+      while ((n = ncp_reply (&r)) == 1)
+        discard_reply (&r, sock);
+      if (n == -1) {
+        fprintf (stderr, "NCP reply error.\n");
+        exit (1);
+      }
+    }
+    t = now () - last;
+    if (interval > 0 && t >= interval) {
+      report (t);
+      last += t;
+    }
+    for (i = 0; i < CONNECTIONS; i++) {
+      if (discard[i].connection != -1 && now () - discard[i].active >= IDLE)
+        end_discard (&discard[i]);
+    }
   }
 }
 
 static void usage (const char *argv0)
 {
-  fprintf (stderr, "Usage: %s [-p socket]\n", argv0);
+  fprintf (stderr, "Usage: %s [-p socket] [-i seconds]\n", argv0);
 }
 
 int main (int argc, char **argv)
@@ -40,8 +165,12 @@ int main (int argc, char **argv)
   int opt = 0;
   int sock = -1;
 
-  while ((opt = getopt (argc, argv, "p:")) != -1) {
+  while ((opt = getopt (argc, argv, "i:p:")) != -1) {
     switch (opt) {
+    case 'i':
+      // Seconds between rate reports, or 0 for none.
+      interval = atoi (optarg);
+      break;
     case 'p':
       sock = atoi (optarg);
       break;
@@ -1,20 +1,25 @@
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <sys/select.h>
 #include "ncp.h"
 
 #define ECHO_SOCKET   7
 
+/* The client sends standard input a block at a time, and reads the
+   whole block back before sending the next. */
 static void echo_client (int host, int sock)
 {
-  int connection, n, byte_size;
+  int connection, n, byte_size, echoed;
   char buffer[1000], *ptr;
   ssize_t size;
 
-  size = 8;
+  byte_size = 8;
   switch (ncp_open (host, sock, &byte_size, &connection)) {
   case 0:
     break;
@@ -33,25 +38,30 @@ static void echo_client (int host, int sock)
       fprintf (stderr, "Read error.\n");
     if (size <= 0)
       goto end;
-    for (ptr = buffer; size > 0; ptr += n, size -= n) {
+    for (ptr = buffer, echoed = 0; size > 0; ptr += n, size -= n) {
       n = size;
       if (ncp_write (connection, ptr, &n) == -1)
-        fprintf (stderr, "NCP read error.\n");
+        fprintf (stderr, "NCP write error.\n");
       if (n <= 0)
         goto end;
+      echoed += n;
     }
 
-    n = sizeof buffer;
-    if (ncp_read (connection, buffer, &n) == -1)
-      fprintf (stderr, "NCP read error.\n");
-    if (n <= 0)
-      goto end;
-    for (ptr = buffer; n > 0; n -= size) {
-      size = write (1, ptr, n);
-      if (size < 0)
-        fprintf (stderr, "Write error.\n");
-      if (size <= 0)
+    // The echo may come back in several pieces.
+    while (echoed > 0) {
+      n = sizeof buffer;
+      if (ncp_read (connection, buffer, &n) == -1)
+        fprintf (stderr, "NCP read error.\n");
+      if (n <= 0)
         goto end;
+      echoed -= n;
+      for (ptr = buffer; n > 0; ptr += size, n -= size) {
+        size = write (1, ptr, n);
+        if (size < 0)
+          fprintf (stderr, "Write error.\n");
+        if (size <= 0)
+          goto end;
+      }
     }
   }
 
@@ -62,30 +72,144 @@ static void echo_client (int host, int sock)
   }
 }
 
+/* The server keeps listening, and echoes on any number of connections
+   at once from one loop of asynchronous NCP requests.  A connection
+   with nothing sent for IDLE seconds is closed. */
+#define CONNECTIONS 64
+#define BUFFER      2048
+#define READ_MAX    255
+#define WRITE_MAX   198
+#define IDLE        300         // Seconds to wait for data.
+
+static struct echo
+{
+  int connection;               // -1 if the slot is free.
+  int reading, writing, eof;
+  time_t active;
+  int length;
+  char buffer[BUFFER];
+} echo[CONNECTIONS];
+
+static struct echo *find_echo (int connection)
+{
+  int i;
+  for (i = 0; i < CONNECTIONS; i++) {
+    if (echo[i].connection == connection)
+      return &echo[i];
+  }
+  return NULL;
+}
+
+static void end_echo (struct echo *e)
+{
+  fprintf (stderr, "Connection %d closed.\n", e->connection);
+  if (ncp_send_close (e->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+  e->connection = -1;
+}
+
+static void echo_reply (struct ncp_reply *r, int sock)
+{
+  struct echo *e;
+
+  if (r->type == NCP_REPLY_LISTEN) {
+    if (r->error != 0) {
+      fprintf (stderr, "NCP listen error.\n");
+      exit (1);
+    }
+    fprintf (stderr, "Connection from host %s on socket %d.\n",
+             ncp_host_name (r->host), sock);
+    e = find_echo (-1);
+    if (e == NULL) {
+      ncp_send_close (r->connection);
+      return;
+    }
+    memset (e, 0, offsetof (struct echo, buffer));
+    e->connection = r->connection;
+    e->active = time (NULL);
+    return;
+  }
+
+  e = find_echo (r->connection);
+  if (e == NULL)
+    return;
+  switch (r->type) {
+  case NCP_REPLY_READ:
+    e->reading = 0;
+    e->active = time (NULL);
+    if (r->length == 0)
+      e->eof = 1;
+    memcpy (e->buffer + e->length, r->data, r->length);
+    e->length += r->length;
+    break;
+  case NCP_REPLY_WRITE:
+    e->writing = 0;
+    if (r->length == 0) {
+      end_echo (e);
+      return;
+    }
+    e->length -= r->length;
+    memmove (e->buffer, e->buffer + r->length, e->length);
+    break;
+  }
+}
+
+static void echo_pump (struct echo *e)
+{
+  int n;
+  if (e->eof && e->length == 0 && !e->writing) {
+    end_echo (e);
+    return;
+  }
+  if (e->length == 0 && time (NULL) - e->active >= IDLE) {
+    fprintf (stderr, "Connection %d idle.\n", e->connection);
+    end_echo (e);
+    return;
+  }
+  if (!e->reading && !e->eof && BUFFER - e->length >= READ_MAX) {
+    if (ncp_send_read (e->connection, READ_MAX) == -1)
+      fprintf (stderr, "NCP read error.\n");
+    e->reading = 1;
+  }
+  if (!e->writing && e->length > 0) {
+    n = e->length > WRITE_MAX ? WRITE_MAX : e->length;
+    if (ncp_send_write (e->connection, e->buffer, n) == -1)
+      fprintf (stderr, "NCP write error.\n");
+    e->writing = 1;
+  }
+}
+
 static void echo_server (int sock)
 {
-  int host, connection, size, n;
-  char buffer[1000], *ptr;
+  struct ncp_reply r;
+  struct timeval tv;
+  fd_set rfds;
+  int i, n;
 
-  size = 8;
-  if (ncp_listen (sock, &size, &host, &connection) == -1) {
+  for (i = 0; i < CONNECTIONS; i++)
+    echo[i].connection = -1;
+  if (ncp_send_listen (sock, 8) == -1) {
     fprintf (stderr, "NCP listen error.\n");
     exit (1);
   }
-  fprintf (stderr, "Connection from host %03o on socket %d.\n", host, sock);
 
   for (;;) {
-    size = sizeof buffer;
-    if (ncp_read (connection, buffer, &size) == -1)
-      fprintf (stderr, "NCP read error.\n");
-    if (size <= 0)
-      return;
-    for (ptr = buffer; size > 0; ptr += n, size -= n) {
-      n = size;
-      if (ncp_write (connection, ptr, &n) == -1)
-        fprintf (stderr, "NCP read error.\n");
-      if (n <= 0)
-        return;
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    // Wake up now and then to drop idle connections.
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (select (ncp_fd () + 1, &rfds, NULL, NULL, &tv) > 0) {
+      while ((n = ncp_reply (&r)) == 1)
+        echo_reply (&r, sock);
+      if (n == -1) {
+        fprintf (stderr, "NCP reply error.\n");
+        exit (1);
+      }
+    }
+    for (i = 0; i < CONNECTIONS; i++) {
+      if (echo[i].connection != -1)
+        echo_pump (&echo[i]);
     }
   }
 }
@@ -121,10 +245,10 @@ int main (int argc, char **argv)
     }
   }
 
-  if (client)
-    host = atoi (argv[optind++]);
+  if (client && optind < argc)
+    host = ncp_host (argv[optind++]);
 
-  if (argc != optind || (client && server)) {
+  if (argc != optind || (client && server) || (client && host == -1)) {
     usage(argv[0]);
     exit (1);
   }
@@ -3,20 +3,198 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/select.h>
 #include "ncp.h"
 
+/* NAME/FINGER client, RFC 742.  The answer is read until the server
+   closes the connection.  With one host it goes to standard output as
+   it arrives.  With -p, all the hosts are asked at once and each answer
+   is printed whole as soon as it's complete. */
+
+#define FINGER_SOCKET 0117
+#define HOSTS         256
+#define ANSWER_MAX    65536
+#define READ_MAX      255
+#define WRITE_MAX     198     // Octets the NCP takes in one write.
+
+static struct query
+{
+  int host;
+  int connection;               // -1 until open.
+  int done, failed;
+  int sent;                     // Octets of the command written.
+  int length;
+  char *answer;                 // Collected answer, with -p.
+} query[HOSTS];
+
+static int queries, remaining;
+static int parallel;
+static char command[1000];
+static int command_length;
+
+static void print_answer (struct query *q)
+{
+  printf ("Finger host %s.\n", ncp_host_name (q->host));
+  fwrite (q->answer, 1, q->length, stdout);
+  fflush (stdout);
+}
+
+static void finish (struct query *q, const char *error)
+{
+  if (q->done)
+    return;
+  if (q->connection != -1 && ncp_send_close (q->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+  q->done = 1;
+  remaining--;
+  if (error != NULL) {
+    q->failed = 1;
+    fprintf (stderr, "Host %s: %s\n", ncp_host_name (q->host), error);
+  }
+  if (parallel)
+    print_answer (q);
+}
+
+// Write the next part of the command.
+static void send_command (struct query *q)
+{
+  int n = command_length - q->sent;
+  if (n > WRITE_MAX)
+    n = WRITE_MAX;
+  if (ncp_send_write (q->connection, command + q->sent, n) == -1)
+    finish (q, "NCP write error.");
+}
+
+static struct query *find_query (struct ncp_reply *r)
+{
+  int i;
+  for (i = 0; i < queries; i++) {
+    if (query[i].done)
+      continue;
+    if (r->type == NCP_REPLY_OPEN) {
+      if (query[i].host == r->host && query[i].connection == -1)
+        return &query[i];
+    } else if (query[i].connection == r->connection)
+      return &query[i];
+  }
+  return NULL;
+}
+
+static void reply (struct ncp_reply *r)
+{
+  struct query *q = find_query (r);
+  int n;
+
+  if (q == NULL)
+    return;
+  switch (r->type) {
+  case NCP_REPLY_OPEN:
+    if (r->error != 0) {
+      finish (q, "Open refused.");
+      break;
+    }
+    q->connection = r->connection;
+    send_command (q);
+    // Read at once, for a server which answers before taking it all.
+    if (!q->done && ncp_send_read (q->connection, READ_MAX) == -1)
+      finish (q, "NCP read error.");
+    break;
+  case NCP_REPLY_WRITE:
+    // The server may close once it has its answer out; the read
+    // sees that.
+    if (r->length == 0)
+      break;
+    q->sent += r->length;
+    if (q->sent < command_length)
+      send_command (q);
+    break;
+  case NCP_REPLY_READ:
+    if (r->length == 0) {
+      finish (q, NULL);
+      break;
+    }
+    if (!parallel) {
+      fwrite (r->data, 1, r->length, stdout);
+      fflush (stdout);
+    } else {
+      n = r->length;
+      if (n > ANSWER_MAX - q->length)
+        n = ANSWER_MAX - q->length;
+      memcpy (q->answer + q->length, r->data, n);
+      q->length += n;
+    }
+    if (ncp_send_read (q->connection, READ_MAX) == -1)
+      finish (q, "NCP read error.");
+    break;
+  }
+}
+
+static void usage (const char *argv0)
+{
+  fprintf (stderr, "Usage: %s [-t seconds] host [user(s)]\n"
+           "or %s -p [-t seconds] [-u user(s)] host...\n", argv0, argv0);
+}
+
 int main (int argc, char **argv)
 {
-  char command[1000];
-  char reply[1000];
-  int host, connection, size;
+  const char *user = "";
+  struct ncp_reply r;
+  struct timeval tv;
+  time_t deadline;
+  int i, n, opt, timeout = 30;
+  fd_set rfds;
 
-  if (argc < 2 || argc > 3) {
-    fprintf (stderr, "Usage: %s host [user(s)]\n", argv[0]);
-    exit (1);
+  while ((opt = getopt (argc, argv, "pt:u:")) != -1) {
+    switch (opt) {
+    case 'p':
+      parallel = 1;
+      break;
+    case 't':
+      timeout = atoi (optarg);
+      break;
+    case 'u':
+      user = optarg;
+      break;
+    default:
+      usage (argv[0]);
+      exit (1);
+    }
   }
 
-  host = atoi (argv[1]);
+  if (parallel) {
+    if (optind == argc || argc - optind > HOSTS) {
+      usage (argv[0]);
+      exit (1);
+    }
+    for (; optind < argc; optind++) {
+      query[queries].host = ncp_host (argv[optind]);
+      if (query[queries].host == -1) {
+        fprintf (stderr, "Bad host %s.\n", argv[optind]);
+        exit (1);
+      }
+      query[queries].answer = malloc (ANSWER_MAX);
+      if (query[queries].answer == NULL) {
+        fprintf (stderr, "Out of memory.\n");
+        exit (1);
+      }
+      queries++;
+    }
+  } else {
+    if (argc - optind < 1 || argc - optind > 2) {
+      usage (argv[0]);
+      exit (1);
+    }
+    query[0].host = ncp_host (argv[optind]);
+    if (query[0].host == -1) {
+      fprintf (stderr, "Bad host %s.\n", argv[optind]);
+      exit (1);
+    }
+    if (argc - optind == 2)
+      user = argv[optind + 1];
+    queries = 1;
+  }
 
   if (ncp_init (NULL) == -1) {
     fprintf (stderr, "NCP initialization error: %s.\n", strerror (errno));
@@ -27,39 +205,48 @@ int main (int argc, char **argv)
     exit (1);
   }
 
-  printf ("Finger host %03o.\n", host);
-
-  size = 8;
-  switch (ncp_open (host, 0117, &size, &connection)) {
-  case 0:
-    break;
-  case -1:
-  default:
-    fprintf (stderr, "NCP open error.\n");
-    exit (1);
-  case -2:
-    fprintf (stderr, "Open refused.\n");
-    exit (1);
+  if (!parallel) {
+    printf ("Finger host %s.\n", ncp_host_name (query[0].host));
+    fflush (stdout);
   }
 
-  size = snprintf (command, sizeof command, "%s\r\n",
-                   argc == 3 ? argv[2] : "");
-  if (ncp_write (connection, command, &size) == -1) {
-    fprintf (stderr, "NCP write error.\n");
-    exit (1);
+  command_length = snprintf (command, sizeof command, "%s\r\n", user);
+  if (command_length > sizeof command - 1) {
+    // Cut short, but still end the line.
+    command_length = sizeof command - 1;
+    memcpy (command + command_length - 2, "\r\n", 2);
   }
-
-  size = sizeof reply;
-  if (ncp_read (connection, reply, &size) == -1) {
-    fprintf (stderr, "NCP read error.\n");
-    exit (1);
+  for (i = 0; i < queries; i++) {
+    query[i].connection = -1;
+    if (ncp_send_open (query[i].host, FINGER_SOCKET, 8) == -1) {
+      fprintf (stderr, "NCP open error.\n");
+      exit (1);
+    }
   }
+  remaining = queries;
 
-  write (1, reply, size);
-
-  if (ncp_close (connection) == -1) {
-    fprintf (stderr, "NCP close error.\n");
-    exit (1);
+  deadline = time (NULL) + timeout;
+  while (remaining > 0) {
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    tv.tv_sec = deadline - time (NULL);
+    tv.tv_usec = 0;
+    if (tv.tv_sec <= 0)
+      break;
+    if (select (ncp_fd () + 1, &rfds, NULL, NULL, &tv) <= 0)
+      continue;
+    while ((n = ncp_reply (&r)) == 1)
+      reply (&r);
+    if (n == -1) {
+      fprintf (stderr, "NCP reply error.\n");
+      exit (1);
+    }
   }
 
+  n = 0;
+  for (i = 0; i < queries; i++) {
+    finish (&query[i], "Timed out.");
+    n |= query[i].failed;
+  }
+  return n;
 }
@@ -1,55 +1,430 @@
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <pwd.h>
+#include <utmpx.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/select.h>
 #include "ncp.h"
 
-int main (int argc, char **argv)
+/* NAME/FINGER server, RFC 742.  It keeps listening and answers any
+   number of queries at once.  Answers come from the first source
+   which has one, and are cached for a few seconds, since monitors
+   tend to ask the same thing over and over.  The -e program runs
+   alongside the other queries, and is killed if it takes more than
+   RUN_MAX seconds. */
+
+#define FINGER_SOCKET 0117
+#define CONNECTIONS   64
+#define CACHE         32
+#define QUERY_MAX     200
+#define ANSWER_MAX    8192
+#define READ_MAX      255
+#define WRITE_MAX     198
+#define IDLE          30        // Seconds to wait for a query.
+#define RUN_MAX       10        // Seconds the -e program may take.
+
+static struct finger
 {
-  char command[1000];
-  char reply[1000];
-  int host, connection, size;
+  int connection;               // -1 if the slot is free.
+  int reading, writing;
+  time_t start;
+  int pipe;                     // Output of the -e program, or -1.
+  pid_t pid;
+  time_t deadline;
+  const char *key;              // The query, for the cache.
+  int query_length;
+  char query[QUERY_MAX + 1];
+  int answer_length, sent;
+  char answer[ANSWER_MAX];
+} finger[CONNECTIONS];
 
-  if (argc != 1) {
-    fprintf (stderr, "Usage: %s\n", argv[0]);
-    exit (1);
+static struct cache
+{
+  time_t time;
+  char query[QUERY_MAX + 1];
+  int length;
+  char answer[ANSWER_MAX];
+} cache[CACHE];
+
+static int ttl = 5;             // Seconds to keep an answer.
+static const char *directory;   // Plan files, for -d.
+static const char *program;     // Program to run, for -e.
+
+static void fatal (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+// Append text to an answer, with LF turned into CRLF.
+static int add (char *answer, int length, const char *text, int n)
+{
+  for (; n > 0 && length < ANSWER_MAX - 1; text++, n--) {
+    if (*text == '\n')
+      answer[length++] = '\r';
+    answer[length++] = *text;
   }
+  return length;
+}
 
-  if (ncp_init (NULL) == -1) {
-    fprintf (stderr, "NCP initialization error: %s.\n", strerror (errno));
-    if (errno == ECONNREFUSED)
-      fprintf (stderr, "Is the NCP server started?\n");
-    else if (errno == EFAULT)
-      fprintf (stderr, "Is the NCP environment variable set?\n");
-    exit (1);
+/* Sources of answers.  Each fills in the answer and returns its
+   length, or -1 if it has nothing for this query. */
+
+// A file named after the user in the -d directory.
+static int plan_file (const char *query, char *answer)
+{
+  char name[QUERY_MAX + 100], text[1024];
+  int fd, n, length = 0;
+
+  if (directory == NULL || *query == 0 || strchr (query, '/') != NULL ||
+      *query == '.')
+    return -1;
+  snprintf (name, sizeof name, "%s/%s", directory, query);
+  fd = open (name, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  while ((n = read (fd, text, sizeof text)) > 0)
+    length = add (answer, length, text, n);
+  close (fd);
+  return length;
+}
+
+// Logged in users, or the password entry of one.
+static int local_users (const char *query, char *answer)
+{
+  struct passwd *pw;
+  struct utmpx *ut;
+  char text[200];
+  int n, length = 0, on = 0;
+
+  setutxent ();
+  while ((ut = getutxent ()) != NULL) {
+    if (ut->ut_type != USER_PROCESS)
+      continue;
+    if (*query && strncmp (ut->ut_user, query, sizeof ut->ut_user) != 0)
+      continue;
+    n = snprintf (text, sizeof text, "%-12.*s %-12.*s %.*s\n",
+                  (int)sizeof ut->ut_user, ut->ut_user,
+                  (int)sizeof ut->ut_line, ut->ut_line,
+                  (int)sizeof ut->ut_host, ut->ut_host);
+    length = add (answer, length, text, n);
+    on++;
   }
+  endutxent ();
 
-  size = 8;
-  if (ncp_listen (0117, &size, &host, &connection) == -1) {
-    fprintf (stderr, "NCP listen error.\n");
-    exit (1);
+  if (*query == 0) {
+    if (on == 0)
+      length = add (answer, length, "No one logged in.\n", 18);
+    return length;
+  }
+  pw = getpwnam (query);
+  if (pw == NULL) {
+    n = snprintf (text, sizeof text, "No such user %s.\n", query);
+    return add (answer, 0, text, n);
+  }
+  pw->pw_gecos[strcspn (pw->pw_gecos, ",")] = 0;
+  n = snprintf (text, sizeof text, "Login: %s  Name: %s\n%s\n",
+                pw->pw_name, pw->pw_gecos,
+                on ? "" : "Not logged in.");
+  return add (answer, length, text, n);
+}
+
+// A fresh answer from the cache, or NULL.
+static struct cache *cache_find (const char *query)
+{
+  time_t now = time (NULL);
+  int i;
+
+  for (i = 0; i < CACHE; i++) {
+    if (cache[i].time != 0 && now - cache[i].time < ttl &&
+        strcmp (cache[i].query, query) == 0)
+      return &cache[i];
+  }
+  return NULL;
+}
+
+// Remember an answer in place of the oldest.
+static void cache_store (const char *query, const char *answer, int length)
+{
+  struct cache *c = &cache[0];
+  int i;
+
+  if (ttl <= 0)
+    return;
+  for (i = 1; i < CACHE; i++) {
+    if (cache[i].time < c->time)
+      c = &cache[i];
   }
+  strcpy (c->query, query);
+  memcpy (c->answer, answer, length);
+  c->length = length;
+  c->time = time (NULL);
+}
+
+static void end_finger (struct finger *f)
+{
+  if (ncp_send_close (f->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+  f->connection = -1;
+}
+
+// Start the -e program, given the query as its argument.
+static int start_program (struct finger *f, const char *query)
+{
+  int fds[2];
 
-  size = sizeof command;
-  if (ncp_read (connection, command, &size) == -1) {
-    fprintf (stderr, "NCP read error.\n");
+  // Don't let a query pass as an option.
+  if (program == NULL || *query == '-' || pipe (fds) == -1)
+    return -1;
+  f->pid = fork ();
+  if (f->pid == -1) {
+    close (fds[0]);
+    close (fds[1]);
+    return -1;
+  }
+  if (f->pid == 0) {
+    dup2 (fds[1], 1);
+    close (fds[0]);
+    close (fds[1]);
+    close (ncp_fd ());
+    execlp (program, program, query, NULL);
     exit (1);
   }
-  command[size] = 0;
+  close (fds[1]);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  f->pipe = fds[0];
+  f->deadline = time (NULL) + RUN_MAX;
+  f->key = query;
+  return 0;
+}
+
+/* The program has finished, or is out of time.  Only a complete
+   answer is cached. */
+static void end_program (struct finger *f, int complete)
+{
+  close (f->pipe);
+  f->pipe = -1;
+  if (complete)
+    cache_store (f->key, f->answer, f->answer_length);
+  else {
+    fprintf (stderr, "Program for %s killed.\n", f->key);
+    kill (f->pid, SIGKILL);
+  }
+  f->sent = 0;
+  if (f->answer_length == 0)
+    end_finger (f);
+}
+
+static void program_output (struct finger *f)
+{
+  char text[1024];
+  int n = read (f->pipe, text, sizeof text);
+  if (n > 0)
+    f->answer_length = add (f->answer, f->answer_length, text, n);
+  else if (n == 0 || errno != EAGAIN)
+    end_program (f, 1);
+}
+
+// The query is complete; skip the /W flag and blanks around it.
+static void query (struct finger *f)
+{
+  struct cache *c;
+  char *q = f->query, *end;
+  int n;
+
+  q += strspn (q, " ");
+  if (strncmp (q, "/W", 2) == 0 || strncmp (q, "/w", 2) == 0)
+    q += 2;
+  q += strspn (q, " ");
+  end = q + strcspn (q, " \r\n");
+  *end = 0;
+
+  c = cache_find (q);
+  if (c != NULL) {
+    memcpy (f->answer, c->answer, c->length);
+    n = c->length;
+  } else if ((n = plan_file (q, f->answer)) >= 0)
+    cache_store (q, f->answer, n);
+  else if (start_program (f, q) == 0) {
+    f->answer_length = 0;
+    return;
+  } else {
+    n = local_users (q, f->answer);
+    cache_store (q, f->answer, n);
+  }
+  f->answer_length = n;
+  f->sent = 0;
+  if (f->answer_length == 0)
+    end_finger (f);
+}
+
+static void finger_reply (struct ncp_reply *r)
+{
+  struct finger *f;
+  int i, n;
+
+  if (r->type == NCP_REPLY_LISTEN) {
+    if (r->error != 0)
+      fatal ("NCP listen error.");
+    for (i = 0; i < CONNECTIONS; i++) {
+      if (finger[i].connection == -1)
+        break;
+    }
+    if (i == CONNECTIONS) {
+      ncp_send_close (r->connection);
+      return;
+    }
+    f = &finger[i];
+    f->connection = r->connection;
+    f->reading = f->writing = 0;
+    f->start = time (NULL);
+    f->query_length = f->answer_length = 0;
+    f->pipe = -1;
+    return;
+  }
+
+  for (i = 0; i < CONNECTIONS; i++) {
+    if (finger[i].connection == r->connection)
+      break;
+  }
+  if (i == CONNECTIONS)
+    return;
+  f = &finger[i];
+  switch (r->type) {
+  case NCP_REPLY_READ:
+    f->reading = 0;
+    n = r->length;
+    if (n > QUERY_MAX - f->query_length)
+      n = QUERY_MAX - f->query_length;
+    memcpy (f->query + f->query_length, r->data, n);
+    f->query_length += n;
+    f->query[f->query_length] = 0;
+    if (r->length == 0 || strchr (f->query, '\n') != NULL ||
+        f->query_length == QUERY_MAX)
+      query (f);
+    break;
+  case NCP_REPLY_WRITE:
+    f->writing = 0;
+    f->sent += r->length;
+    if (r->length == 0 || f->sent == f->answer_length)
+      end_finger (f);
+    break;
+  }
+}
+
+static void pump (struct finger *f)
+{
+  int n;
+  if (f->pipe != -1) {
+    if (time (NULL) >= f->deadline)
+      end_program (f, 0);
+  } else if (f->answer_length == 0) {
+    if (time (NULL) - f->start >= IDLE)
+      end_finger (f);
+    else if (!f->reading) {
+      if (ncp_send_read (f->connection, READ_MAX) == -1)
+        fatal ("NCP read error.");
+      f->reading = 1;
+    }
+  } else if (!f->writing) {
+    n = f->answer_length - f->sent;
+    if (n > WRITE_MAX)
+      n = WRITE_MAX;
+    if (ncp_send_write (f->connection, f->answer + f->sent, n) == -1)
+      fatal ("NCP write error.");
+    f->writing = 1;
+  }
+}
+
+static void usage (const char *argv0)
+{
+  fprintf (stderr, "Usage: %s [-d directory] [-e program] [-t seconds]\n",
+           argv0);
+}
+
+int main (int argc, char **argv)
+{
+  struct ncp_reply r;
+  struct timeval tv;
+  fd_set rfds;
+  int i, n, opt, max;
 
-  snprintf (reply, sizeof reply - 1,
-            "Sample response from Finger server.\r\n"
-            "Data from client was: \"%s\".\r\n", command);
-  size = strlen (reply);
-  if (ncp_write (connection, reply, &size) == -1) {
-    fprintf (stderr, "NCP write error.\n");
+  while ((opt = getopt (argc, argv, "d:e:t:")) != -1) {
+    switch (opt) {
+    case 'd':
+      directory = optarg;
+      break;
+    case 'e':
+      program = optarg;
+      break;
+    case 't':
+      ttl = atoi (optarg);
+      break;
+    default:
+      usage (argv[0]);
+      exit (1);
+    }
+  }
+
+  if (argc != optind) {
+    usage (argv[0]);
     exit (1);
   }
 
-  if (ncp_close (connection) == -1) {
-    fprintf (stderr, "NCP close error.\n");
+  if (ncp_init (NULL) == -1) {
+    fprintf (stderr, "NCP initialization error: %s.\n", strerror (errno));
+    if (errno == ECONNREFUSED)
+      fprintf (stderr, "Is the NCP server started?\n");
+    else if (errno == EFAULT)
+      fprintf (stderr, "Is the NCP environment variable set?\n");
     exit (1);
   }
 
+  for (i = 0; i < CONNECTIONS; i++)
+    finger[i].connection = finger[i].pipe = -1;
+  if (ncp_send_listen (FINGER_SOCKET, 8) == -1)
+    fatal ("NCP listen error.");
+
+  for (;;) {
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    max = ncp_fd ();
+    for (i = 0; i < CONNECTIONS; i++) {
+      if (finger[i].connection != -1 && finger[i].pipe != -1) {
+        FD_SET (finger[i].pipe, &rfds);
+        if (finger[i].pipe > max)
+          max = finger[i].pipe;
+      }
+    }
+    // Wake up now and then to drop connections which never ask.
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (select (max + 1, &rfds, NULL, NULL, &tv) > 0) {
+      for (i = 0; i < CONNECTIONS; i++) {
+        if (finger[i].connection != -1 && finger[i].pipe != -1 &&
+            FD_ISSET (finger[i].pipe, &rfds))
+          program_output (&finger[i]);
+      }
+      if (FD_ISSET (ncp_fd (), &rfds)) {
+        while ((n = ncp_reply (&r)) == 1)
+          finger_reply (&r);
+        if (n == -1)
+          fatal ("NCP reply error.");
+      }
+    }
+    while (waitpid (-1, NULL, WNOHANG) > 0)
+      ;
+    for (i = 0; i < CONNECTIONS; i++) {
+      if (finger[i].connection != -1)
+        pump (&finger[i]);
+    }
+  }
 }
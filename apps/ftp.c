@@ -0,0 +1,980 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#ifdef __linux__
+#include <shadow.h>
+#include <crypt.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include "ncp.h"
+
+/* File transfer per RFC 454.  Commands and replies go over a TELNET
+   connection made by ICP to the server socket.  For each transfer the
+   user listens on a data socket named by SOCK, and the server opens
+   the data connection to it.  Files are mapped into memory on the
+   sending side and passed to the NCP in place.  Transfers are in
+   stream mode with file structure.
+
+   The server takes a local user name and password, checked against
+   the password file, and runs the session as that user if started as
+   root.  Anonymous login is only allowed with -A.  Files are named
+   relative to the -C directory, and the server refuses to change
+   anything unless started with -w. */
+
+#define FTP_SOCKET  3
+#define READ_MAX    255         // Octets asked for in one NCP read.
+#define WRITE_MAX   198         // Octets the NCP takes in one write.
+#define BUFFER      65536       // Received data is written out this much at once.
+
+static int control = -1;
+static uint8_t input[1024];     // Control connection input.
+static int input_length;
+static int ascii;               // TYPE A: CRLF ends lines on the net.
+
+static void fatal (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void rate (char *text, int size, long octets, double start)
+{
+  double t = now () - start;
+  snprintf (text, size, "%ld octets in %.2f s, %.0f octets/s",
+            octets, t, t > 0 ? octets / t : 0);
+}
+
+// Convert local text to the net, LF to CRLF.  Out must have room for
+// twice n.
+static int to_net (const uint8_t *in, int n, uint8_t *out)
+{
+  uint8_t *start = out;
+  const uint8_t *end = in + n, *ptr;
+  while (in < end) {
+    ptr = memchr (in, 012, end - in);
+    if (ptr == NULL)
+      ptr = end;
+    memcpy (out, in, ptr - in);
+    out += ptr - in;
+    in = ptr;
+    if (in < end) {
+      *out++ = 015;
+      *out++ = *in++;
+    }
+  }
+  return out - start;
+}
+
+// Convert text from the net, CRLF to LF.  A CR at the end of one
+// chunk is held in *cr until the next.
+static int from_net (const uint8_t *in, int n, uint8_t *out, int *cr)
+{
+  uint8_t *start = out;
+  const uint8_t *end = in + n;
+  for (; in < end; in++) {
+    if (*cr && *in != 012)
+      *out++ = 015;
+    *cr = *in == 015;
+    if (!*cr)
+      *out++ = *in;
+  }
+  return out - start;
+}
+
+static int write_all (int fd, const uint8_t *data, int n)
+{
+  ssize_t m;
+  while (n > 0) {
+    m = write (fd, data, n);
+    if (m <= 0)
+      return -1;
+    data += m;
+    n -= m;
+  }
+  return 0;
+}
+
+static int ncp_write_all (int connection, const uint8_t *data, long n)
+{
+  int m;
+  while (n > 0) {
+    m = n > WRITE_MAX ? WRITE_MAX : n;
+    if (ncp_write (connection, (void *)data, &m) == -1 || m == 0)
+      return -1;
+    data += m;
+    n -= m;
+  }
+  return 0;
+}
+
+// Take a complete line from the control input, without the CRLF.
+static int take_line (char *line, int size)
+{
+  uint8_t *eol = memchr (input, 012, input_length);
+  int n;
+  if (eol == NULL) {
+    if (input_length < sizeof input)
+      return -1;
+    // Too long, take what there is.
+    eol = input + input_length - 1;
+  }
+  n = eol - input;
+  if (n > 0 && input[n - 1] == 015)
+    n--;
+  if (n > size - 1)
+    n = size - 1;
+  memcpy (line, input, n);
+  line[n] = 0;
+  input_length -= eol + 1 - input;
+  memmove (input, eol + 1, input_length);
+  return 0;
+}
+
+// Room for more control input.
+static int room (void)
+{
+  int n = sizeof input - input_length;
+  return n > READ_MAX ? READ_MAX : n;
+}
+
+static int get_line (char *line, int size)
+{
+  int n;
+  while (take_line (line, size) == -1) {
+    n = room ();
+    if (ncp_read (control, input + input_length, &n) == -1 || n == 0)
+      return -1;
+    input_length += n;
+  }
+  return 0;
+}
+
+static int put_line (const char *format, ...)
+{
+  char line[1000];
+  va_list ap;
+  int n;
+  va_start (ap, format);
+  n = vsnprintf (line, sizeof line - 2, format, ap);
+  va_end (ap);
+  if (n > sizeof line - 3)
+    n = sizeof line - 3;
+  line[n++] = 015;
+  line[n++] = 012;
+  return ncp_write_all (control, (uint8_t *)line, n);
+}
+
+/* Server. */
+
+static int byte_size = 8;
+static int data_host;           // The control connection's host.
+static unsigned data_socket;
+static char rename_from[1000];
+static int anonymous;           // Anonymous login allowed, -A.
+static int writable;            // Changes allowed, -w.
+static char user_name[100];
+static int logged_in;
+
+static void reply (int code, const char *format, ...)
+{
+  char text[1000];
+  va_list ap;
+  va_start (ap, format);
+  vsnprintf (text, sizeof text, format, ap);
+  va_end (ap);
+  put_line ("%03d %s", code, text);
+}
+
+static int open_data (void)
+{
+  int connection, size = byte_size;
+  if (data_socket == 0) {
+    reply (504, "No data socket, send SOCK first.");
+    return -1;
+  }
+  if (ncp_open (data_host, data_socket, &size, &connection) != 0) {
+    reply (454, "FTP: Cannot connect to your data socket.");
+    return -1;
+  }
+  return connection;
+}
+
+static int send_file (int connection, const uint8_t *data, long n)
+{
+  uint8_t buffer[WRITE_MAX];
+  int m;
+  if (!ascii)
+    return ncp_write_all (connection, data, n);
+  for (; n > 0; data += m, n -= m) {
+    m = n > WRITE_MAX / 2 ? WRITE_MAX / 2 : n;
+    if (ncp_write_all (connection, buffer, to_net (data, m, buffer)) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static void file_error (const char *name)
+{
+  if (errno == ENOENT)
+    reply (450, "FTP: File not found: %s.", name);
+  else if (errno == EACCES || errno == EPERM)
+    reply (451, "FTP: File access denied to you: %s.", name);
+  else if (errno == ENOSPC)
+    reply (453, "FTP: Insufficient storage space.");
+  else
+    reply (455, "FTP: %s: %s.", name, strerror (errno));
+}
+
+static void retrieve (const char *name)
+{
+  struct stat st;
+  uint8_t *map = NULL;
+  char text[100];
+  double start;
+  int fd, connection, error;
+
+  fd = open (name, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st) == -1) {
+    file_error (name);
+    if (fd != -1)
+      close (fd);
+    return;
+  }
+  if (!S_ISREG (st.st_mode)) {
+    reply (455, "FTP: Not a plain file: %s.", name);
+    close (fd);
+    return;
+  }
+  if (st.st_size > 0) {
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      file_error (name);
+      close (fd);
+      return;
+    }
+    madvise (map, st.st_size, MADV_SEQUENTIAL);
+  }
+  close (fd);
+
+  connection = open_data ();
+  if (connection != -1) {
+    reply (250, "FTP file transfer started correctly.");
+    start = now ();
+    error = send_file (connection, map, st.st_size);
+    ncp_close (connection);
+    rate (text, sizeof text, st.st_size, start);
+    if (error)
+      reply (452, "FTP: File transfer incomplete, data connection closed.");
+    else
+      reply (252, "FTP transfer completed correctly, %s.", text);
+    fprintf (stderr, "Sent %s, %s.\n", name, text);
+  }
+  if (map != NULL)
+    munmap (map, st.st_size);
+}
+
+static void store (const char *name, int flags)
+{
+  uint8_t data[READ_MAX], buffer[BUFFER];
+  int fd, connection, n, length = 0, cr = 0, error = 0;
+  long octets = 0;
+  char text[100];
+  double start;
+
+  fd = open (name, O_WRONLY | O_CREAT | flags, 0666);
+  if (fd == -1) {
+    file_error (name);
+    return;
+  }
+  connection = open_data ();
+  if (connection == -1) {
+    close (fd);
+    return;
+  }
+  reply (250, "FTP file transfer started correctly.");
+  start = now ();
+  for (;;) {
+    n = sizeof data;
+    if (ncp_read (connection, data, &n) == -1 || n == 0)
+      break;
+    octets += n;
+    if (ascii)
+      length += from_net (data, n, buffer + length, &cr);
+    else {
+      memcpy (buffer + length, data, n);
+      length += n;
+    }
+    if (length > BUFFER - READ_MAX) {
+      if (!error && write_all (fd, buffer, length) == -1)
+        error = errno;
+      length = 0;
+    }
+  }
+  if (!error && write_all (fd, buffer, length) == -1)
+    error = errno;
+  if (close (fd) == -1 && !error)
+    error = errno;
+  ncp_close (connection);
+  rate (text, sizeof text, octets, start);
+  if (error) {
+    errno = error;
+    file_error (name);
+  } else
+    reply (252, "FTP transfer completed correctly, %s.", text);
+  fprintf (stderr, "Received %s, %s.\n", name, text);
+}
+
+static void list (const char *name, int full)
+{
+  uint8_t data[WRITE_MAX / 2], buffer[WRITE_MAX];
+  int fds[2], connection, n, error = 0;
+  pid_t pid;
+
+  connection = open_data ();
+  if (connection == -1)
+    return;
+  reply (250, "FTP file transfer started correctly.");
+  if (pipe (fds) == -1)
+    fatal ("Pipe error.");
+  pid = fork ();
+  if (pid == 0) {
+    dup2 (fds[1], 1);
+    dup2 (fds[1], 2);
+    close (fds[0]);
+    close (fds[1]);
+    execlp ("ls", "ls", full ? "-l" : "-1", "--", *name ? name : ".", NULL);
+    exit (1);
+  }
+  close (fds[1]);
+  while ((n = read (fds[0], data, sizeof data)) > 0) {
+    if (!error && ncp_write_all (connection, buffer,
+                                 to_net (data, n, buffer)) == -1)
+      error = 1;
+  }
+  close (fds[0]);
+  waitpid (pid, NULL, 0);
+  ncp_close (connection);
+  if (error)
+    reply (452, "FTP: File transfer incomplete, data connection closed.");
+  else
+    reply (252, "FTP transfer completed correctly.");
+}
+
+// Check a password, and become the user if we are root.
+static int login (const char *name, const char *password)
+{
+  struct passwd *pw = getpwnam (name);
+  const char *hash, *try;
+#ifdef __linux__
+  struct spwd *sp;
+#endif
+
+  if (pw == NULL)
+    return -1;
+#ifdef __linux__
+  sp = getspnam (name);
+  hash = sp != NULL ? sp->sp_pwdp : pw->pw_passwd;
+#else
+  // Elsewhere crypt is in unistd.h, and there are no shadow passwords.
+  hash = pw->pw_passwd;
+#endif
+  // Locked, or no password at all.
+  if (*hash == 0 || *hash == '!' || *hash == '*')
+    return -1;
+  try = crypt (password, hash);
+  if (try == NULL || strcmp (try, hash) != 0)
+    return -1;
+  if (getuid () == 0 &&
+      (setgid (pw->pw_gid) == -1 || initgroups (name, pw->pw_gid) == -1 ||
+       setuid (pw->pw_uid) == -1))
+    return -1;
+  return 0;
+}
+
+// Names must stay in the server's directory.
+static int bad_name (const char *name)
+{
+  const char *p;
+  if (*name == '/')
+    return 1;
+  for (p = name; p != NULL; p = strchr (p, '/')) {
+    if (*p == '/')
+      p++;
+    if (strncmp (p, "..", 2) == 0 && (p[2] == 0 || p[2] == '/'))
+      return 1;
+  }
+  return 0;
+}
+
+static void parameter (const char *arg, const char *valid)
+{
+  if (strlen (arg) != 1 || strchr (valid, toupper (*arg)) == NULL)
+    reply (506, "Requested action not implemented by the server.");
+  else
+    reply (200, "Last command received correctly.");
+}
+
+static void sock (const char *arg)
+{
+  char host[20];
+  unsigned socket;
+  // Either <socket> or <host>,<socket>, and only the user's own host.
+  if (sscanf (arg, "%19[^,],%u", host, &socket) == 2) {
+    if (ncp_host (host) != data_host) {
+      reply (504, "FTP: Data connections go only to your own host.");
+      return;
+    }
+  } else if (sscanf (arg, "%u", &socket) != 1) {
+    reply (501, "Syntax of last command is incorrect.");
+    return;
+  }
+  if ((socket & 1) == 0) {
+    reply (503, "The data socket must be odd.");
+    return;
+  }
+  data_socket = socket;
+  reply (200, "Last command received correctly.");
+}
+
+// Returns zero when the session is over.
+static int command (char *verb, const char *arg)
+{
+  char *p;
+  for (p = verb; *p; p++)
+    *p = toupper (*p);
+
+  if (strcmp (verb, "BYE") == 0) {
+    reply (231, "User is \"logged out\".  Service terminated.");
+    return 0;
+  } else if (strcmp (verb, "NOOP") == 0 || strcmp (verb, "ALLO") == 0 ||
+           strcmp (verb, "ACCT") == 0)
+    reply (200, "Last command received correctly.");
+  else if (strcmp (verb, "ABOR") == 0)
+    reply (202, "Abort request ignored, no activity in progress.");
+  else if (strcmp (verb, "REIN") == 0) {
+    ascii = 1;
+    byte_size = 8;
+    data_socket = 0;
+    logged_in = 0;
+    reply (233, "User is \"logged out\".  Parameters reinitialized.");
+  } else if (strcmp (verb, "TYPE") == 0) {
+    parameter (arg, "AI");
+    if (strlen (arg) == 1 && strchr ("AI", toupper (*arg)) != NULL)
+      ascii = toupper (*arg) == 'A';
+  } else if (strcmp (verb, "MODE") == 0)
+    parameter (arg, "S");
+  else if (strcmp (verb, "STRU") == 0)
+    parameter (arg, "F");
+  else if (strcmp (verb, "FORM") == 0)
+    parameter (arg, "UP");
+  else if (*arg == 0 && strcmp (verb, "LIST") != 0 &&
+           strcmp (verb, "NLST") != 0)
+    reply (502, "Last command incomplete, parameters missing.");
+  else if (strcmp (verb, "USER") == 0) {
+    if (logged_in)
+      reply (505, "Last command conflicts illegally with previous command(s).");
+    else if (anonymous &&
+             (strcmp (arg, "anonymous") == 0 || strcmp (arg, "ftp") == 0)) {
+      logged_in = 1;
+      reply (230, "User is \"logged in\".  May proceed.");
+    } else {
+      snprintf (user_name, sizeof user_name, "%s", arg);
+      reply (330, "Enter password.");
+    }
+  } else if (strcmp (verb, "PASS") == 0) {
+    if (logged_in || *user_name == 0)
+      reply (505, "Last command conflicts illegally with previous command(s).");
+    else if (login (user_name, arg) == -1) {
+      fprintf (stderr, "Login as %s refused.\n", user_name);
+      reply (430, "Login attempt rejected.");
+    } else {
+      logged_in = 1;
+      reply (230, "User is \"logged in\".  May proceed.");
+    }
+    *user_name = 0;
+  } else if (!logged_in)
+    reply (530, "FTP: Not logged in.");
+  else if (strcmp (verb, "BYTE") == 0) {
+    if (atoi (arg) < 1 || atoi (arg) > 255)
+      reply (501, "Syntax of last command is incorrect.");
+    else {
+      byte_size = atoi (arg);
+      reply (200, "Last command received correctly.");
+    }
+  } else if (strcmp (verb, "SOCK") == 0)
+    sock (arg);
+  else if (bad_name (arg))
+    reply (451, "FTP: File access denied to you: %s.", arg);
+  else if (strcmp (verb, "LIST") == 0)
+    list (arg, 1);
+  else if (strcmp (verb, "NLST") == 0)
+    list (arg, 0);
+  else if (strcmp (verb, "RETR") == 0)
+    retrieve (arg);
+  else if (!writable && (strcmp (verb, "STOR") == 0 ||
+                         strcmp (verb, "APPE") == 0 ||
+                         strcmp (verb, "DELE") == 0 ||
+                         strcmp (verb, "RNFR") == 0 ||
+                         strcmp (verb, "RNTO") == 0))
+    reply (451, "FTP: This server is read-only.");
+  else if (strcmp (verb, "STOR") == 0)
+    store (arg, O_TRUNC);
+  else if (strcmp (verb, "APPE") == 0)
+    store (arg, O_APPEND);
+  else if (strcmp (verb, "DELE") == 0) {
+    if (unlink (arg) == -1)
+      file_error (arg);
+    else
+      reply (254, "Delete completed.");
+  } else if (strcmp (verb, "RNFR") == 0) {
+    snprintf (rename_from, sizeof rename_from, "%s", arg);
+    reply (200, "Last command received correctly.");
+  } else if (strcmp (verb, "RNTO") == 0) {
+    if (*rename_from == 0)
+      reply (505, "Last command conflicts illegally with previous command(s).");
+    else if (rename (rename_from, arg) == -1)
+      file_error (rename_from);
+    else
+      reply (253, "Rename completed.");
+    *rename_from = 0;
+  } else
+    reply (500, "Last command line completely unrecognized.");
+  return 1;
+}
+
+static void session (int host, int connection)
+{
+  char line[1000], *arg;
+
+  control = connection;
+  data_host = host;
+  ascii = 1;
+  reply (300, "NCP FTP server ready.");
+  while (get_line (line, sizeof line) != -1) {
+    arg = line + strcspn (line, " ");
+    if (*arg)
+      *arg++ = 0;
+    arg += strspn (arg, " ");
+    if (!command (line, arg))
+      break;
+  }
+  ncp_close (control);
+}
+
+/* The server keeps listening, and forks a process for each session. */
+static void ftp_server (int sock)
+{
+  struct ncp_reply r;
+  fd_set rfds;
+  int n;
+
+  signal (SIGCHLD, SIG_IGN);
+  fprintf (stderr, "Listening to socket %d.\n", sock);
+  if (ncp_send_listen (sock, 8) == -1)
+    fatal ("NCP listen error.");
+
+  for (;;) {
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    if (select (ncp_fd () + 1, &rfds, NULL, NULL, NULL) == -1)
+      continue;
+    while ((n = ncp_reply (&r)) == 1) {
+      if (r.type != NCP_REPLY_LISTEN)
+        continue;
+      if (r.error != 0)
+        fatal ("NCP listen error.");
+      fprintf (stderr, "Connection from host %s.\n", ncp_host_name (r.host));
+      if (fork () == 0) {
+        // The session takes its own NCP client socket.
+        close (ncp_fd ());
+        signal (SIGCHLD, SIG_DFL);
+        if (ncp_init (NULL) == -1)
+          fatal ("NCP initialization error.");
+        session (r.host, r.connection);
+        exit (0);
+      }
+    }
+    if (n == -1)
+      fatal ("NCP reply error.");
+  }
+}
+
+/* User. */
+
+// Print server replies until one which isn't just information.
+static int get_reply (void)
+{
+  char line[1000];
+  int code;
+  do {
+    if (get_line (line, sizeof line) == -1)
+      fatal ("Server closed the connection.");
+    fprintf (stderr, "%s\n", line);
+    code = isdigit (line[0]) ? atoi (line) : 0;
+  } while (code < 200);
+  return code;
+}
+
+static void expect (int code)
+{
+  if (get_reply () != code)
+    exit (1);
+}
+
+/* Make the server open the data connection to us, and run the
+   transfer with asynchronous NCP requests so the TELNET replies can
+   come at any time.  Receive into fd, or send size octets from data. */
+static int transfer (const char *verb, const char *arg, unsigned socket,
+                     int fd, const uint8_t *data, long size)
+{
+  uint8_t chunk[WRITE_MAX], buffer[BUFFER];
+  int chunk_length = 0, length = 0, cr = 0;
+  int connection = -1, closed = 0, writing = 0, reading = 0;
+  int control_writing, code = 0;
+  long sent = 0, octets = 0;
+  const uint8_t *next = NULL;
+  struct ncp_reply r;
+  char line[1000], text[100];
+  double start = now ();
+  fd_set rfds;
+  int n;
+
+  if (put_line ("SOCK %u", socket) == -1)
+    fatal ("NCP write error.");
+  expect (200);
+  if (ncp_send_listen (socket, 8) == -1)
+    fatal ("NCP listen error.");
+  n = snprintf (line, sizeof line, "%s %s\r\n", verb, arg);
+  if (ncp_send_write (control, line, n) == -1 ||
+      ncp_send_read (control, room ()) == -1)
+    fatal ("NCP request error.");
+  control_writing = reading = 1;
+
+  while (code == 0 || control_writing || (connection != -1 && !closed)) {
+    // Send the next piece, or close when done or the server gave up.
+    if (connection != -1 && fd == -1 && !writing && !closed) {
+      if (code >= 400)
+        chunk_length = 0, sent = size;
+      if (chunk_length == 0 && sent < size) {
+        n = size - sent;
+        if (ascii) {
+          if (n > WRITE_MAX / 2)
+            n = WRITE_MAX / 2;
+          chunk_length = to_net (data + sent, n, chunk);
+          next = chunk;
+        } else {
+          if (n > WRITE_MAX)
+            n = WRITE_MAX;
+          chunk_length = n;
+          next = data + sent;
+        }
+        sent += n;
+      }
+      if (chunk_length > 0) {
+        if (ncp_send_write (connection, next, chunk_length) == -1)
+          fatal ("NCP write error.");
+        writing = 1;
+      } else if (ncp_send_close (connection) == -1)
+        fatal ("NCP close error.");
+      else
+        writing = 1;
+    }
+
+    FD_ZERO (&rfds);
+    FD_SET (ncp_fd (), &rfds);
+    if (select (ncp_fd () + 1, &rfds, NULL, NULL, NULL) == -1)
+      continue;
+    while ((n = ncp_reply (&r)) == 1) {
+      if (r.type == NCP_REPLY_LISTEN) {
+        if (r.error != 0)
+          fatal ("NCP listen error.");
+        connection = r.connection;
+        if (fd != -1) {
+          if (ncp_send_read (connection, READ_MAX) == -1)
+            fatal ("NCP read error.");
+        }
+      } else if (r.connection == control) {
+        if (r.type == NCP_REPLY_WRITE)
+          control_writing = 0;
+        if (r.type != NCP_REPLY_READ)
+          continue;
+        if (r.length == 0)
+          fatal ("Server closed the connection.");
+        memcpy (input + input_length, r.data, r.length);
+        input_length += r.length;
+        while (code == 0 && take_line (line, sizeof line) == 0) {
+          fprintf (stderr, "%s\n", line);
+          if (isdigit (line[0]) && atoi (line) >= 252)
+            code = atoi (line);
+        }
+        if (code == 0 && ncp_send_read (control, room ()) == -1)
+          fatal ("NCP read error.");
+      } else if (r.connection == connection) {
+        switch (r.type) {
+        case NCP_REPLY_READ:
+          if (r.length == 0) {
+            if (ncp_send_close (connection) == -1)
+              fatal ("NCP close error.");
+            break;
+          }
+          octets += r.length;
+          if (ascii)
+            length += from_net (r.data, r.length, buffer + length, &cr);
+          else {
+            memcpy (buffer + length, r.data, r.length);
+            length += r.length;
+          }
+          if (length > BUFFER - READ_MAX) {
+            if (write_all (fd, buffer, length) == -1)
+              fatal ("Write error.");
+            length = 0;
+          }
+          if (ncp_send_read (connection, READ_MAX) == -1)
+            fatal ("NCP read error.");
+          break;
+        case NCP_REPLY_WRITE:
+          writing = 0;
+          if (r.length == 0)
+            fatal ("NCP write error.");
+          octets += r.length;
+          next += r.length;
+          chunk_length -= r.length;
+          break;
+        case NCP_REPLY_CLOSE:
+          closed = 1;
+          break;
+        }
+      }
+    }
+    if (n == -1)
+      fatal ("NCP reply error.");
+  }
+
+  if (fd != -1 && write_all (fd, buffer, length) == -1)
+    fatal ("Write error.");
+  if (code != 252)
+    return -1;
+  rate (text, sizeof text, octets, start);
+  fprintf (stderr, "%s %s, %s.\n", fd != -1 ? "Received" : "Sent", arg, text);
+  return 0;
+}
+
+static int get (const char *verb, const char *remote, const char *local,
+                unsigned socket)
+{
+  int fd = 1, result;
+  if (strcmp (local, "-") != 0) {
+    fd = open (local, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+      fprintf (stderr, "%s: %s.\n", local, strerror (errno));
+      return -1;
+    }
+  }
+  result = transfer (verb, remote, socket, fd, NULL, 0);
+  if (fd != 1 && close (fd) == -1)
+    return -1;
+  return result;
+}
+
+static int put (const char *verb, const char *local, const char *remote,
+                unsigned socket)
+{
+  struct stat st;
+  uint8_t *map = NULL;
+  int fd, result;
+
+  fd = open (local, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st) == -1) {
+    fprintf (stderr, "%s: %s.\n", local, strerror (errno));
+    return -1;
+  }
+  if (st.st_size > 0) {
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf (stderr, "%s: %s.\n", local, strerror (errno));
+      return -1;
+    }
+    madvise (map, st.st_size, MADV_SEQUENTIAL);
+  }
+  close (fd);
+  result = transfer (verb, remote, socket, -1, map, st.st_size);
+  if (map != NULL)
+    munmap (map, st.st_size);
+  return result;
+}
+
+static const char *base (const char *name)
+{
+  const char *p = strrchr (name, '/');
+  return p == NULL ? name : p + 1;
+}
+
+static void usage (const char *argv0)
+{
+  fprintf (stderr, "Usage: %s [-a] [-p socket] [-d data socket] [-u user] "
+           "host command\n"
+           "Commands: get remote [local], put local [remote],\n"
+           "append local remote, ls [path], dir [path],\n"
+           "delete path, rename from to\n"
+           "or %s -s [-A] [-w] [-p socket] [-C directory]\n", argv0, argv0);
+}
+
+static void ftp_client (int host, int sock, unsigned socket,
+                        const char *user, int argc, char **argv)
+{
+  const char *op = argv[0], *a1 = argc > 1 ? argv[1] : "";
+  const char *a2 = argc > 2 ? argv[2] : "";
+  int size = 8, result = -1;
+
+  switch (ncp_open (host, sock, &size, &control)) {
+  case 0:
+    break;
+  case -1:
+  default:
+    fatal ("NCP open error.");
+  case -2:
+    fatal ("Open refused.");
+  }
+
+  expect (300);
+  put_line ("USER %s", user);
+  switch (get_reply ()) {
+  case 230:
+    break;
+  case 330:
+    put_line ("PASS %s", getpass ("Password: "));
+    expect (230);
+    break;
+  default:
+    exit (1);
+  }
+  put_line ("TYPE %c", ascii ? 'A' : 'I');
+  expect (200);
+
+  if (strcmp (op, "get") == 0 && argc >= 2)
+    result = get ("RETR", a1, argc > 2 ? a2 : base (a1), socket);
+  else if (strcmp (op, "put") == 0 && argc >= 2)
+    result = put ("STOR", a1, argc > 2 ? a2 : base (a1), socket);
+  else if (strcmp (op, "append") == 0 && argc == 3)
+    result = put ("APPE", a1, a2, socket);
+  else if (strcmp (op, "ls") == 0)
+    result = get ("NLST", a1, "-", socket);
+  else if (strcmp (op, "dir") == 0)
+    result = get ("LIST", a1, "-", socket);
+  else if (strcmp (op, "delete") == 0 && argc == 2) {
+    put_line ("DELE %s", a1);
+    result = get_reply () == 254 ? 0 : -1;
+  } else if (strcmp (op, "rename") == 0 && argc == 3) {
+    put_line ("RNFR %s", a1);
+    if (get_reply () == 200) {
+      put_line ("RNTO %s", a2);
+      result = get_reply () == 253 ? 0 : -1;
+    }
+  } else
+    fprintf (stderr, "Unknown command %s.\n", op);
+
+  put_line ("BYE");
+  get_reply ();
+  if (ncp_close (control) == -1)
+    fatal ("NCP close error.");
+  if (result == -1)
+    exit (1);
+}
+
+int main (int argc, char **argv)
+{
+  const char *user = getenv ("USER"), *directory = NULL;
+  int opt, server = 0, host = -1, sock = FTP_SOCKET;
+  unsigned socket = 0;
+
+  while ((opt = getopt (argc, argv, "AaC:d:p:su:w")) != -1) {
+    switch (opt) {
+    case 'A':
+      anonymous = 1;
+      break;
+    case 'a':
+      ascii = 1;
+      break;
+    case 'C':
+      directory = optarg;
+      break;
+    case 'd':
+      socket = strtoul (optarg, NULL, 0);
+      if ((socket & 1) == 0)
+        fatal ("Data socket must be odd.");
+      break;
+    case 'p':
+      sock = atoi (optarg);
+      break;
+    case 's':
+      server = 1;
+      break;
+    case 'u':
+      user = optarg;
+      break;
+    case 'w':
+      writable = 1;
+      break;
+    default:
+      usage (argv[0]);
+      exit (1);
+    }
+  }
+
+  if ((server && argc != optind) || (!server && argc - optind < 2)) {
+    usage (argv[0]);
+    exit (1);
+  }
+
+  if (directory != NULL && chdir (directory) == -1) {
+    fprintf (stderr, "%s: %s.\n", directory, strerror (errno));
+    exit (1);
+  }
+
+  if (ncp_init (NULL) == -1) {
+    fprintf (stderr, "NCP initialization error: %s.\n", strerror (errno));
+    if (errno == ECONNREFUSED)
+      fprintf (stderr, "Is the NCP server started?\n");
+    else if (errno == EFAULT)
+      fprintf (stderr, "Is the NCP environment variable set?\n");
+    exit (1);
+  }
+
+  if (server)
+    ftp_server (sock);
+  else {
+    host = ncp_host (argv[optind++]);
+    if (host == -1) {
+      usage (argv[0]);
+      exit (1);
+    }
+    // A data socket of our own, unless given.
+    if (socket == 0)
+      socket = 0100000 + 2 * getpid () + 1;
+    ftp_client (host, sock, socket, user != NULL ? user : "anonymous",
+                argc - optind, argv + optind);
+  }
+
+  return 0;
+}
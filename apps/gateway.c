@@ -1,216 +1,417 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "ncp.h"
 #include "inet.h"
 
-static pid_t reader_pid = 0;
-static pid_t writer_pid = 0;
+/* A single process relays any number of sessions between TCP and
+   NCP.  The NCP requests are asynchronous, so one event loop waits
+   for the NCP replies and the TCP sockets together. */
 
-static int reader (int connection)
-{
-  unsigned char data[200], *ptr;
-  ssize_t n;
-  int fds[2];
-  int size;
+#define SESSIONS  64
+#define BUFFER    8192
+#define READ_MAX  255   // Octets asked for in one NCP read.
+#define WRITE_MAX 198   // Octets the NCP takes in one write.
+#define LINGER    5     // Seconds to wait for NCP data after TCP is done.
+#define CONNECT_MAX 30  // Seconds to wait for a TCP connection, with -N.
+#define POOL_MAX  16
 
-  if (pipe (fds) == -1)
-    exit (1);
+static struct session
+{
+  int fd;                       // TCP socket, or -1 if the slot is free.
+  int connection;               // NCP connection, or -1 while opening.
+  int reading, writing;         // NCP requests outstanding.
+  int tcp_eof, ncp_eof;         // That side has no more to send.
+  int connecting;               // TCP connection not yet made, with -N.
+  time_t quiet;                 // Last activity after TCP EOF, or start
+                                // of connecting.
+  int to_ncp_length, to_tcp_length;
+  uint8_t to_ncp[BUFFER], to_tcp[BUFFER];
+} session[SESSIONS];
+
+static int listener = -1;       // TCP listening socket, with -T.
+static int remote_host;
+static unsigned ncp_socket;
+static int listen_socket = -1;  // NCP socket, with -N.
+static struct sockaddr_storage tcp_addr;
+static socklen_t tcp_addr_len;
+
+/* With -T, a pool of connections to the NCP host is kept open ahead
+   of time, so a new TCP client can start right away. */
+static int pool[POOL_MAX];
+static int pool_size, pooled, opening;
+
+static void fatal (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
 
-  reader_pid = fork();
-  if (reader_pid) {
-    close (fds[1]);
-    return fds[0];
+static struct session *new_session (int fd, int connection)
+{
+  int i, one = 1;
+  for (i = 0; i < SESSIONS; i++) {
+    if (session[i].fd == -1)
+      break;
   }
-  close (fds[0]);
-
-  if (ncp_init (NULL) == -1)
-    exit (1);
+  if (i == SESSIONS)
+    return NULL;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  memset (&session[i], 0, offsetof (struct session, to_ncp));
+  session[i].fd = fd;
+  session[i].connection = connection;
+  return &session[i];
+}
 
-  for (;;) {
-    size = sizeof data;
-    if (ncp_read (connection, data, &size) == -1) {
-      fprintf (stderr, "NCP read error.\n");
-      exit (1);
-    }
-    if (size == 0)
-      exit (0);
-    for (ptr = data; size > 0; ptr += n, size -= n) {
-      n = write (fds[1], data, size);
-      if (n <= 0)
-        exit (-n);
-    }
+static int free_session (void)
+{
+  int i;
+  for (i = 0; i < SESSIONS; i++) {
+    if (session[i].fd == -1)
+      return 1;
   }
+  return 0;
 }
 
-static int writer (int connection)
+static void end_session (struct session *s)
 {
-  unsigned char data[200], *ptr;
-  ssize_t n, m;
-  int fds[2];
-  int size;
-
-  if (pipe (fds) == -1)
-    exit (1);
+  fprintf (stderr, "Session on connection %d ended.\n", s->connection);
+  close (s->fd);
+  s->fd = -1;
+  if (s->connection != -1 && ncp_send_close (s->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+}
 
-  writer_pid = fork();
-  if (writer_pid) {
-    close (fds[0]);
-    return fds[1];
+static struct session *find_connection (int connection)
+{
+  int i;
+  for (i = 0; i < SESSIONS; i++) {
+    if (session[i].fd != -1 && session[i].connection == connection)
+      return &session[i];
   }
-  close (fds[1]);
+  return NULL;
+}
 
-  int flags = fcntl (fds[0], F_GETFL);
-  fcntl (fds[0], F_SETFL, flags | O_NONBLOCK);
+static void open_ncp (void)
+{
+  if (ncp_send_open (remote_host, ncp_socket, 8) == -1)
+    fatal ("NCP open error.");
+  opening++;
+}
 
-  if (ncp_init (NULL) == -1)
-    exit (1);
+// Open more connections until the waiting sessions and the pool are
+// covered.
+static void fill_pool (void)
+{
+  int i, waiting = 0;
+  for (i = 0; i < SESSIONS; i++) {
+    if (session[i].fd != -1 && session[i].connection == -1)
+      waiting++;
+  }
+  while (opening < waiting + pool_size - pooled)
+    open_ncp ();
+}
 
-  for (;;) {
-    n = read (fds[0], data, 200);
-    if (n == 0)
-      exit (0);
-    if (n < 0)
-      continue;
-    ptr = data;
-    for (ptr = data, m = n; m > 0; ptr += size, m -= size) {
-      size = m;
-      if (ncp_write (connection, ptr, &size) == -1) {
-        fprintf (stderr, "NCP write error.\n");
-        exit (1);
-      }
-      if (size == 0)
-        exit (0);
-    }
+static void opened (struct ncp_reply *r)
+{
+  struct session *s = find_connection (-1);
+  opening--;
+  if (r->error != 0) {
+    fprintf (stderr, "Open refused.\n");
+    if (s != NULL)
+      end_session (s);
+    return;
   }
+  if (s == NULL) {
+    if (pooled < pool_size)
+      pool[pooled++] = r->connection;
+    else
+      // The TCP side went away while opening.
+      ncp_send_close (r->connection);
+    return;
+  }
+  fprintf (stderr, "Connection %d open to host %s.\n",
+           r->connection, ncp_host_name (r->host));
+  s->connection = r->connection;
 }
 
-static int copy (int from, int to)
+/* The NCP keeps listening once asked, and sends a reply for each new
+   connection.  The TCP connection is made in the event loop, so a
+   slow target doesn't hold up the other sessions. */
+static void listened (struct ncp_reply *r)
 {
-  unsigned char data[200], *ptr;
-  ssize_t n = read (from, data, sizeof data), m;
-  if (n <= 0)
-    return n;
-  for (ptr = data; n > 0; ptr += m, n -= m) {
-    m = write (to, data, n);
-    if (m <= 0)
-      return m;
+  struct session *s = NULL;
+  int fd;
+  if (r->error != 0)
+    fatal ("NCP listen error.");
+  fprintf (stderr, "Connection from host %s on socket %d.\n",
+           ncp_host_name (r->host), listen_socket);
+  fd = inet_start ((struct sockaddr *)&tcp_addr, tcp_addr_len);
+  if (fd != -1)
+    s = new_session (fd, r->connection);
+  if (s != NULL) {
+    s->connecting = 1;
+    s->quiet = time (NULL);
+  } else {
+    fprintf (stderr, "No TCP connection for host %s.\n",
+             ncp_host_name (r->host));
+    if (fd != -1)
+      close (fd);
+    ncp_send_close (r->connection);
   }
-  return 1;
 }
 
-static void transport (int fd, int connection)
+static void read_reply (struct ncp_reply *r)
 {
-  int reader_fd = reader (connection);
-  int writer_fd = writer (connection);
+  struct session *s = find_connection (r->connection);
+  if (s == NULL)
+    return;
+  s->reading = 0;
+  s->quiet = time (NULL);
+  if (r->length == 0)
+    s->ncp_eof = 1;
+  memcpy (s->to_tcp + s->to_tcp_length, r->data, r->length);
+  s->to_tcp_length += r->length;
+}
 
-  for (;;) {
-    fd_set rfds;
-    int n;
-    FD_ZERO (&rfds);
-    FD_SET (fd, &rfds);
-    FD_SET (reader_fd, &rfds);
-    n = select (33, &rfds, NULL, NULL, NULL);
-    if (n <= 0)
-      goto end;
-
-    if (FD_ISSET (fd, &rfds)) {
-      if (copy (fd, writer_fd) <= 0)
-        goto end;
-    }
-    if (FD_ISSET (reader_fd, &rfds)) {
-      if (copy (reader_fd, fd) <= 0)
-        goto end;
-    }
+static void write_reply (struct ncp_reply *r)
+{
+  struct session *s = find_connection (r->connection);
+  if (s == NULL)
+    return;
+  s->writing = 0;
+  if (r->length == 0) {
+    fprintf (stderr, "NCP write error.\n");
+    end_session (s);
+    return;
   }
+  s->to_ncp_length -= r->length;
+  memmove (s->to_ncp, s->to_ncp + r->length, s->to_ncp_length);
+}
 
- end:
-  kill (reader_pid, SIGTERM);
-  kill (writer_pid, SIGTERM);
+static void replies (void)
+{
+  struct ncp_reply r;
+  int n;
+  while ((n = ncp_reply (&r)) == 1) {
+    switch (r.type) {
+    case NCP_REPLY_OPEN:   opened (&r); break;
+    case NCP_REPLY_LISTEN: listened (&r); break;
+    case NCP_REPLY_READ:   read_reply (&r); break;
+    case NCP_REPLY_WRITE:  write_reply (&r); break;
+    }
+  }
+  if (n == -1)
+    fatal ("NCP reply error.");
 }
 
-static void tcp_to_ncp (const char *port, const char *host, const char *sock)
+static void accept_tcp (void)
 {
+  struct session *s;
   char *foreign_host;
-  int connection, foreign_port;
-  int fd, s, size;
+  int fd, foreign_port;
 
-  s = inet_server (port);
-  fd = inet_accept (s, &foreign_host, &foreign_port);
+  fd = inet_accept (listener, &foreign_host, &foreign_port);
+  if (fd == -1)
+    return;
   fprintf (stderr, "Connection from host %s on port %d.\n",
            foreign_host, foreign_port);
+  s = new_session (fd, -1);
+  if (s == NULL) {
+    close (fd);
+    return;
+  }
+  if (pooled > 0) {
+    s->connection = pool[--pooled];
+    fprintf (stderr, "Pooled connection %d to host %s.\n",
+             s->connection, ncp_host_name (remote_host));
+  }
+  fill_pool ();
+}
 
-  int ncp_host = atoi (host);
-  int ncp_sock = atoi (sock);
+static void tcp_connected (struct session *s)
+{
+  socklen_t len = sizeof (int);
+  int error = 0;
+  getsockopt (s->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+  if (error != 0) {
+    fprintf (stderr, "TCP connect error: %s.\n", strerror (error));
+    end_session (s);
+    return;
+  }
+  s->connecting = 0;
+}
 
-  size = 8;
-  switch (ncp_open (ncp_host, ncp_sock, &size, &connection)) {
-  case 0:
-    break;
-  case -1:
-  default:
-    fprintf (stderr, "NCP open error.\n");
-    exit (1);
-  case -2:
-    fprintf (stderr, "Open refused.\n");
-    exit (1);
+static void tcp_read (struct session *s)
+{
+  ssize_t n = read (s->fd, s->to_ncp + s->to_ncp_length,
+                    BUFFER - s->to_ncp_length);
+  if (n > 0)
+    s->to_ncp_length += n;
+  else if (n == 0) {
+    /* NCP connections can't be half closed.  Keep sending the other
+       way until NCP is done too, or has been quiet for a while. */
+    s->tcp_eof = 1;
+    s->quiet = time (NULL);
   }
+  else if (errno != EAGAIN && errno != EWOULDBLOCK)
+    end_session (s);
+}
 
-  transport (fd, connection);
+static void tcp_write (struct session *s)
+{
+  ssize_t n = write (s->fd, s->to_tcp, s->to_tcp_length);
+  if (n > 0) {
+    s->to_tcp_length -= n;
+    memmove (s->to_tcp, s->to_tcp + n, s->to_tcp_length);
+  } else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    end_session (s);
+}
 
-  if (ncp_close (connection) == -1) {
-    fprintf (stderr, "NCP close error.\n");
-    exit (1);
+// Start NCP requests for what the session has room or data for.
+static void pump (struct session *s)
+{
+  int n;
+
+  if (s->connection == -1)
+    return;
+  if (s->connecting) {
+    if (time (NULL) - s->quiet >= CONNECT_MAX) {
+      fprintf (stderr, "TCP connect timed out.\n");
+      end_session (s);
+    }
+    return;
+  }
+  if (s->ncp_eof && s->to_tcp_length == 0 && !s->writing) {
+    end_session (s);
+    return;
+  }
+  if (s->tcp_eof && s->to_ncp_length == 0 && s->to_tcp_length == 0 &&
+      !s->writing && time (NULL) - s->quiet >= LINGER) {
+    end_session (s);
+    return;
+  }
+  if (!s->reading && !s->ncp_eof && BUFFER - s->to_tcp_length >= READ_MAX) {
+    if (ncp_send_read (s->connection, READ_MAX) == -1)
+      fatal ("NCP read error.");
+    s->reading = 1;
+  }
+  if (!s->writing && s->to_ncp_length > 0) {
+    n = s->to_ncp_length;
+    if (n > WRITE_MAX)
+      n = WRITE_MAX;
+    if (ncp_send_write (s->connection, s->to_ncp, n) == -1)
+      fatal ("NCP write error.");
+    s->writing = 1;
   }
 }
 
-static void ncp_to_tcp (int sock, const char *host, const char *port)
+static void loop (void)
 {
-  int fd, ncp_host, connection, size;
+  fd_set rfds, wfds;
+  struct timeval tv, *timeout;
+  struct session *s;
+  int i, n;
 
-  size = 8;
-  if (ncp_listen (sock, &size, &ncp_host, &connection) == -1) {
-    fprintf (stderr, "NCP listen error.\n");
-    exit (1);
-  }
-  fprintf (stderr, "Connection from host %03o on socket %d.\n", ncp_host, sock);
+  for (;;) {
+    FD_ZERO (&rfds);
+    FD_ZERO (&wfds);
+    FD_SET (ncp_fd (), &rfds);
+    timeout = NULL;
+    if (listener != -1 && free_session ())
+      FD_SET (listener, &rfds);
+    for (i = 0; i < SESSIONS; i++) {
+      s = &session[i];
+      if (s->fd == -1)
+        continue;
+      if (s->connecting) {
+        FD_SET (s->fd, &wfds);
+        timeout = &tv;
+        continue;
+      }
+      if (!s->tcp_eof && s->to_ncp_length < BUFFER)
+        FD_SET (s->fd, &rfds);
+      if (s->to_tcp_length > 0)
+        FD_SET (s->fd, &wfds);
+      if (s->tcp_eof)
+        timeout = &tv;
+    }
 
-  fd = inet_connect (host, port);
-  transport (fd, connection);
+    // Wake up now and then to end lingering sessions.
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    n = select (FD_SETSIZE, &rfds, &wfds, NULL, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      fatal ("Select error.");
+    }
 
-  if (ncp_close (connection) == -1) {
-    fprintf (stderr, "NCP close error.\n");
-    exit (1);
+    if (FD_ISSET (ncp_fd (), &rfds))
+      replies ();
+    for (i = 0; i < SESSIONS; i++) {
+      s = &session[i];
+      if (s->fd != -1 && s->connecting) {
+        if (FD_ISSET (s->fd, &wfds))
+          tcp_connected (s);
+        if (s->fd != -1)
+          pump (s);
+        continue;
+      }
+      if (s->fd != -1 && FD_ISSET (s->fd, &rfds))
+        tcp_read (s);
+      if (s->fd != -1 && FD_ISSET (s->fd, &wfds))
+        tcp_write (s);
+      if (s->fd != -1)
+        pump (s);
+    }
+    if (listener != -1 && FD_ISSET (listener, &rfds))
+      accept_tcp ();
   }
 }
 
 static void usage (const char *argv0)
 {
-  fprintf (stderr, "Usage: %s -T<source TCP port> <host> <socket>\n"
+  fprintf (stderr, "Usage: %s [-P<pool>] -T<source TCP port> <host> <socket>\n"
            "or %s -N<source NCP socket> <host> <port>\n", argv0, argv0);
 }
 
 int main (int argc, char **argv)
 {
-  const char *host, *tcp_port = NULL, *number = NULL;
-  int opt, ncp_sock = -1;
+  const char *host, *tcp_source = NULL, *number = NULL;
+  int i, opt;
 
-  while ((opt = getopt (argc, argv, "N:T:")) != -1) {
+  while ((opt = getopt (argc, argv, "N:P:T:")) != -1) {
     switch (opt) {
     case 'N':
-      ncp_sock = atoi (optarg);
-      if ((ncp_sock & 1) == 0) {
+      listen_socket = atoi (optarg);
+      if ((listen_socket & 1) == 0) {
         fprintf (stderr, "Socket must be odd.\n");
         exit (1);
       }
       break;
+    case 'P':
+      pool_size = atoi (optarg);
+      if (pool_size < 0 || pool_size > POOL_MAX) {
+        fprintf (stderr, "Pool size must be 0 to %d.\n", POOL_MAX);
+        exit (1);
+      }
+      break;
     case 'T':
-      tcp_port = optarg;
+      tcp_source = optarg;
       break;
     default:
       usage (argv[0]);
@@ -221,8 +422,8 @@ int main (int argc, char **argv)
   host = argv[optind++];
   number = argv[optind++];
 
-  if (argc != optind || (tcp_port != NULL && ncp_sock != -1) ||
-      (tcp_port == NULL && ncp_sock == -1)) {
+  if (argc != optind || (tcp_source != NULL && listen_socket != -1) ||
+      (tcp_source == NULL && listen_socket == -1)) {
     usage (argv[0]);
     exit (1);
   }
@@ -236,10 +437,25 @@ int main (int argc, char **argv)
     exit (1);
   }
 
-  if (tcp_port != NULL)
-    tcp_to_ncp (tcp_port, host, number);
-  else if (ncp_sock != -1)
-    ncp_to_tcp (ncp_sock, host, number);
+  signal (SIGPIPE, SIG_IGN);
+  for (i = 0; i < SESSIONS; i++)
+    session[i].fd = -1;
+
+  if (tcp_source != NULL) {
+    remote_host = ncp_host (host);
+    if (remote_host == -1)
+      fatal ("Bad NCP host.");
+    ncp_socket = atoi (number);
+    listener = inet_server (tcp_source);
+    fill_pool ();
+  } else {
+    // Look the target up once, not for every connection.
+    if (inet_resolve (host, number, &tcp_addr, &tcp_addr_len) == -1)
+      fatal ("Can't find TCP host.");
+    if (ncp_send_listen (listen_socket, 8) == -1)
+      fatal ("NCP listen error.");
+  }
 
+  loop ();
   return 0;
 }
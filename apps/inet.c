@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -30,7 +32,7 @@ int do_the_thing (const char *host, const char *port,
   hints.ai_flags = AI_PASSIVE;
 
   if (getaddrinfo (host, port, &hints, &addr) != 0)
-    fatal ("calling getaddrinfo", errno);
+    return -1;
 
   for (rp = addr; rp != NULL; rp = rp->ai_next) {
     fd = socket (rp->ai_family, rp->ai_socktype, 0);
@@ -43,8 +45,9 @@ int do_the_thing (const char *host, const char *port,
     if (the_thing (fd, rp->ai_addr, rp->ai_addrlen) == 0)
       goto ok;
     fprintf (stderr, "Thing: %s\n", strerror (errno));
+    close (fd);
   }
-  fatal ("do the thing to socket", 0);
+  fd = -1;
 
  ok:
   freeaddrinfo (addr);
@@ -54,7 +57,9 @@ int do_the_thing (const char *host, const char *port,
 int inet_server (const char *port)
 {
   int fd = do_the_thing (NULL, port, bind);
-  if (listen (fd, 1) < 0)
+  if (fd == -1)
+    fatal ("do the thing to socket", 0);
+  if (listen (fd, 16) < 0)
     fatal ("binding socket", errno);
   return fd;
 }
@@ -65,7 +70,7 @@ int inet_accept (int s, char **host, int *port)
   socklen_t len = sizeof addr;
   int fd = accept (s, &addr, &len);
   if (fd < 0)
-    fatal ("calling accept", errno);
+    return -1;
   if (addr.sa_family == AF_INET) {
     struct sockaddr_in *x = (struct sockaddr_in *)&addr;
     *host = inet_ntoa (x->sin_addr);
@@ -77,7 +82,41 @@ int inet_accept (int s, char **host, int *port)
   return fd;
 }
 
+/* Returns -1 if no connection could be made. */
 int inet_connect (const char *host, const char *port)
 {
   return do_the_thing (host, port, connect);
 }
+
+/* Look up an address for inet_start.  Returns -1 if there is none. */
+int inet_resolve (const char *host, const char *port,
+                  struct sockaddr_storage *addr, socklen_t *len)
+{
+  struct addrinfo hints;
+  struct addrinfo *ai;
+
+  memset (&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (host, port, &hints, &ai) != 0)
+    return -1;
+  memcpy (addr, ai->ai_addr, ai->ai_addrlen);
+  *len = ai->ai_addrlen;
+  freeaddrinfo (ai);
+  return 0;
+}
+
+/* Start a connection without waiting for it.  The socket turns
+   writable when it's done, and SO_ERROR tells how it went. */
+int inet_start (const struct sockaddr *addr, socklen_t len)
+{
+  int fd = socket (addr->sa_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  if (connect (fd, addr, len) == -1 && errno != EINPROGRESS) {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
@@ -1,3 +1,6 @@
 int inet_server (const char *port);
 int inet_accept (int s, char **host, int *port);
 int inet_connect (const char *host, const char *port);
+int inet_resolve (const char *host, const char *port,
+                  struct sockaddr_storage *addr, socklen_t *len);
+int inet_start (const struct sockaddr *addr, socklen_t len);
@@ -45,7 +45,9 @@ static void args (int argc, char **argv)
   if (optind == argc)
     usage (argv[0]);
 
-  host = atoi (argv[optind]);
+  host = ncp_host (argv[optind]);
+  if (host == -1)
+    usage (argv[0]);
   optind++;
 
   if (optind < argc)
@@ -76,7 +78,7 @@ int main (int argc, char **argv)
     exit (1);
   }
 
-  printf ("NCP PING host %03o\n", host);
+  printf ("NCP PING host %s\n", ncp_host_name (host));
 
   while (count != 0) {
     gettimeofday (&start, NULL);
@@ -101,7 +103,8 @@ int main (int argc, char **argv)
     }
     gettimeofday (&stop, NULL);
     ms = difference (&start, &stop);
-    printf ("Reply from host %03o: seq=%u time=%ums\n", host, reply, ms);
+    printf ("Reply from host %s: seq=%u time=%ums\n",
+            ncp_host_name (host), reply, ms);
     count--;
     if (count != 0)
       nanosleep (&interval, NULL);
@@ -55,6 +55,7 @@
 
 static pid_t reader_pid = 0;
 static pid_t writer_pid = 0;
+static int coalesce = 0;
 
 static const unsigned char old_client_options[] = {
   OECHO, NUL
@@ -83,10 +84,63 @@ static const unsigned char bin_options[] = {
   NUL
 };
 
-static void option (int fd)
+/* Input is decoded a chunk at a time.  The state carries a command
+   or CR sequence split between chunks, and the output is collected to
+   go out in one write per chunk.  What a non-blocking descriptor
+   doesn't take stays in the buffer for the next flush. */
+#define STATE_DATA    0
+#define STATE_IAC     1
+#define STATE_OPTION  2
+#define STATE_CR      3
+
+struct telnet
+{
+  int state;
+  int fd;
+  size_t length;
+  unsigned char out[1024];
+};
+
+static void flush (struct telnet *t)
+{
+  size_t done = 0;
+  ssize_t n;
+  while (done < t->length) {
+    n = write (t->fd, t->out + done, t->length - done);
+    if (n > 0)
+      done += n;
+    else if (n == -1 && errno == EINTR)
+      continue;
+    else if (n == -1 && errno == EAGAIN)
+      break;
+    else
+      done = t->length;         // Nobody to write to.
+  }
+  t->length -= done;
+  memmove (t->out, t->out + done, t->length);
+}
+
+static void put (struct telnet *t, const void *data, size_t n)
+{
+  size_t m;
+  while (n > 0) {
+    if (t->length == sizeof t->out) {
+      flush (t);
+      if (t->length == sizeof t->out)
+        return;
+    }
+    m = sizeof t->out - t->length;
+    if (m > n)
+      m = n;
+    memcpy (t->out + t->length, data, m);
+    t->length += m;
+    data = (const unsigned char *)data + m;
+    n -= m;
+  }
+}
+
+static void option (unsigned char c)
 {
-  unsigned char c;
-  read (fd, &c, 1);
   switch (c) {
   case OPT_BINARY:
     break;
@@ -115,23 +169,18 @@ static void option (int fd)
   }
 }
 
-static void special (unsigned char c, int rfd, int wfd)
+static void special (struct telnet *t, unsigned char c)
 {
+  t->state = STATE_DATA;
   switch (c) {
   case IAC:
-    write (wfd, &c, 1);
+    put (t, &c, 1);
     return;
   case DONT:
-    option (rfd);
-    return;
   case DO:
-    option (rfd);
-    return;
   case WONT:
-    option (rfd);
-    return;
   case WILL:
-    option (rfd);
+    t->state = STATE_OPTION;
     return;
   case SB:
     return;
@@ -140,7 +189,7 @@ static void special (unsigned char c, int rfd, int wfd)
   case EL:
     return;
   case EC:
-    write (wfd, "\b \b", 3);
+    put (t, "\b \b", 3);
     return;
   case AYT:
     return;
@@ -161,25 +210,37 @@ static void special (unsigned char c, int rfd, int wfd)
   }
 }
 
-static void process_new (unsigned char data, int rfd, int wfd)
+static void process_new (struct telnet *t, const unsigned char *data, size_t n)
 {
-  switch (data) {
-  case NUL:
-    break;
-  case IAC:
-    read (rfd, &data, 1);
-    special (data, rfd, wfd);
-    break;
-  default:
-    write (wfd, &data, 1);
-    break;
+  const unsigned char *end = data + n, *ptr;
+
+  while (data < end) {
+    switch (t->state) {
+    case STATE_DATA:
+      for (ptr = data; ptr < end && *ptr != IAC && *ptr != NUL; ptr++)
+        ;
+      put (t, data, ptr - data);
+      data = ptr;
+      if (data == end)
+        break;
+      if (*data++ == IAC)
+        t->state = STATE_IAC;
+      break;
+    case STATE_IAC:
+      special (t, *data++);
+      break;
+    case STATE_OPTION:
+      option (*data++);
+      t->state = STATE_DATA;
+      break;
+    }
   }
+  flush (t);
 }
 
-static void process_old (unsigned char data, int rfd, int wfd)
+static void old_character (struct telnet *t, unsigned char c)
 {
-  unsigned char crlf[] = { 015, 012 };
-  switch (data) {
+  switch (c) {
   case NUL:
     break;
   case 001: case 002: case 003: case 004: case 005: case 006:
@@ -191,13 +252,8 @@ static void process_old (unsigned char data, int rfd, int wfd)
   case 0177:
     break;
   case 015:
-    read (rfd, &data, 1);
-    if (data == NUL)
-      write (wfd, crlf, 1);
-    else if (data == 012)
-      write (wfd, crlf, 2);
-    else
-      fprintf (stderr, "[CR without LF or NUL]");
+    t->state = STATE_CR;
+    break;
   case OMARK:
     break;
   case OBREAK:
@@ -225,13 +281,42 @@ static void process_old (unsigned char data, int rfd, int wfd)
     fprintf (stderr, "[EBCDIC]"); fflush (stderr);
     break;
   default:
-    write (wfd, &data, 1);
+    put (t, &c, 1);
+  }
+}
+
+static void process_old (struct telnet *t, const unsigned char *data, size_t n)
+{
+  static const unsigned char crlf[] = { 015, 012 };
+  const unsigned char *end = data + n, *ptr;
+
+  while (data < end) {
+    if (t->state == STATE_CR) {
+      t->state = STATE_DATA;
+      if (*data == NUL)
+        put (t, crlf, 1);
+      else if (*data == 012)
+        put (t, crlf, 2);
+      else
+        fprintf (stderr, "[CR without LF or NUL]");
+      data++;
+      continue;
+    }
+    // Printing characters go straight through.
+    for (ptr = data; ptr < end && *ptr >= 040 && *ptr < 0177; ptr++)
+      ;
+    put (t, data, ptr - data);
+    data = ptr;
+    if (data < end)
+      old_character (t, *data++);
   }
+  flush (t);
 }
 
-static void process_bin (unsigned char data, int rfd, int wfd)
+static void process_bin (struct telnet *t, const unsigned char *data, size_t n)
 {
-  write (wfd, &data, 1);
+  put (t, data, n);
+  flush (t);
 }
 
 
@@ -317,14 +402,17 @@ static int writer (int connection)
 }
 
 static void telnet_client (int host, int sock,
-                           void (*process) (unsigned char, int, int),
+                           void (*process) (struct telnet *,
+                                            const unsigned char *, size_t),
                            const unsigned char *options)
 {
+  struct telnet t = { STATE_DATA, 1, 0 };
+  unsigned char data[1024], *ptr;
   int connection, byte_size;
   int reader_fd, writer_fd;
   size_t size;
 
-  printf ("TELNET to host %03o.\n", host);
+  printf ("TELNET to host %s.\n", ncp_host_name (host));
 
   byte_size = 8;
   switch (ncp_open (host, sock, &byte_size, &connection)) {
@@ -339,6 +427,9 @@ static void telnet_client (int host, int sock,
     exit (1);
   }
 
+  if (coalesce > 0 && ncp_coalesce (connection, coalesce) == -1)
+    fprintf (stderr, "NCP coalesce error.\n");
+
   reader_fd = reader (connection);
   writer_fd = writer (connection);
 
@@ -361,21 +452,22 @@ static void telnet_client (int host, int sock,
       break;
 
     if (FD_ISSET (0, &rfds)) {
-      unsigned char data;
-      if (read (0, &data, 1) <= 0)
+      n = read (0, data, sizeof data);
+      if (n <= 0)
         goto end;
-      if (data == 035)
-        goto quit;
-      if (write (writer_fd, &data, 1) <= 0)
+      ptr = memchr (data, 035, n);
+      if (ptr != NULL)
+        n = ptr - data;
+      if (n > 0 && write (writer_fd, data, n) <= 0)
         goto end;
+      if (ptr != NULL)
+        goto quit;
     }
     if (FD_ISSET (reader_fd, &rfds)) {
-      unsigned char data;
-      n = read (reader_fd, &data, 1);
-      if (n == 1)
-        process (data, reader_fd, 1);
+      n = read (reader_fd, data, sizeof data);
       if (n <= 0)
         goto end;
+      process (&t, data, n);
     }
   }
 
@@ -407,106 +499,278 @@ static void telnet_client (int host, int sock,
   fprintf (stderr, "DEBUG: client shutdown complete.\n");
 }
 
-static void telnet_server (int host, int sock,
-                           void (*process) (unsigned char, int, int),
-                           const unsigned char *options)
+/* The server keeps listening and runs every session from one event
+   loop.  A few shells are started ahead of time, so a new session
+   gets one at once. */
+#define SESSIONS  32
+#define SHELLS    8
+#define BUFFER    4096
+#define READ_MAX  255
+#define WRITE_MAX 198
+
+static struct session
 {
-  int connection, size;
-  int reader_fd, writer_fd;
-  char *banner;
-  pid_t shell_pid;
-  int fd;
+  int connection;               // NCP connection, or -1 if the slot is free.
+  int pty;
+  pid_t shell;
+  int reading, writing;
+  struct telnet t;
+  int length;
+  unsigned char to_ncp[BUFFER];
+} session[SESSIONS];
+
+static struct shell
+{
+  int pty;
+  pid_t pid;
+} shell[SHELLS];
+static int shells, spare_shells = 2;
 
-  fprintf (stderr, "Listening to socket %d.\n", sock);
+static void spawn (struct shell *s)
+{
+  char *cmd[] = { "sh", NULL };
+  s->pid = tty_run (cmd, &s->pty);
+  fcntl (s->pty, F_SETFD, FD_CLOEXEC);
+  fcntl (s->pty, F_SETFL, fcntl (s->pty, F_GETFL) | O_NONBLOCK);
+}
 
-  size = 8;
-  if (ncp_listen (sock, &size, &host, &connection) == -1) {
-    fprintf (stderr, "NCP listen error.\n");
-    exit (1);
-  }
+static void fill_shells (void)
+{
+  while (shells < spare_shells)
+    spawn (&shell[shells++]);
+}
 
-  reader_fd = reader (connection);
-  writer_fd = writer (connection);
+static void end_session (struct session *s)
+{
+  fprintf (stderr, "Session on connection %d ended.\n", s->connection);
+  if (ncp_send_close (s->connection) == -1)
+    fprintf (stderr, "NCP close error.\n");
+  close (s->pty);
+  killpg (s->shell, SIGHUP);
+  s->connection = -1;
+}
 
-  size = strlen ((const char *)options);
-  if (write (writer_fd, options, size) == -1) {
-    fprintf (stderr, "write error.\n");
-    exit (1);
+static void child (int sig)
+{
+}
+
+// Reap shells which have exited, and drop spare ones which did.
+static void reap (void)
+{
+  pid_t pid;
+  int i;
+  while ((pid = waitpid (-1, NULL, WNOHANG)) > 0) {
+    for (i = 0; i < shells; i++) {
+      if (shell[i].pid == pid) {
+        close (shell[i].pty);
+        shell[i] = shell[--shells];
+        break;
+      }
+    }
   }
+}
 
-  banner = "Welcome to Unix.\r\n";
-  size = strlen (banner);
-  if (write (writer_fd, banner, size) == -1) {
-    fprintf (stderr, "write error.\n");
+static void queue (struct session *s, const void *data, size_t n)
+{
+  if (n > BUFFER - s->length)
+    n = BUFFER - s->length;
+  memcpy (s->to_ncp + s->length, data, n);
+  s->length += n;
+}
+
+static void new_session (struct ncp_reply *r, const unsigned char *options)
+{
+  static const char banner[] = "Welcome to Unix.\r\n";
+  struct session *s;
+  int i;
+
+  if (r->error != 0) {
+    fprintf (stderr, "NCP listen error.\n");
     exit (1);
   }
+  fprintf (stderr, "Connection %d from host %s.\n",
+           r->connection, ncp_host_name (r->host));
+  for (i = 0; i < SESSIONS; i++) {
+    if (session[i].connection == -1)
+      break;
+  }
+  if (i == SESSIONS) {
+    fprintf (stderr, "Too many sessions.\n");
+    ncp_send_close (r->connection);
+    return;
+  }
 
-  char *cmd[] = { "sh", NULL };
-  shell_pid = tty_run (cmd, &fd);
-
-  int flags = fcntl (fd, F_GETFL);
-  fcntl (fd, F_SETFL, flags | O_NONBLOCK);
-  flags = fcntl (reader_fd, F_GETFL);
-  fcntl (reader_fd, F_SETFL, flags | O_NONBLOCK);
+  s = &session[i];
+  if (shells == 0)
+    spawn (&shell[shells++]);
+  shells--;
+  s->pty = shell[shells].pty;
+  s->shell = shell[shells].pid;
+  s->connection = r->connection;
+  s->reading = s->writing = 0;
+  s->t.state = STATE_DATA;
+  s->t.fd = s->pty;
+  s->t.length = 0;
+  s->length = 0;
+  queue (s, options, strlen ((const char *)options));
+  queue (s, banner, strlen (banner));
+  if (coalesce > 0 && ncp_send_coalesce (s->connection, coalesce) == -1)
+    fprintf (stderr, "NCP coalesce error.\n");
+}
 
-  for (;;) {
-    fd_set rfds;
-    int n = fd > reader_fd ? fd : reader_fd;
-    FD_ZERO (&rfds);
-    FD_SET (fd, &rfds);
-    FD_SET (reader_fd, &rfds);
-    n = select (n + 1, &rfds, NULL, NULL, NULL);
-    if (n <= 0)
-      goto end;
+static struct session *find_session (int connection)
+{
+  int i;
+  for (i = 0; i < SESSIONS; i++) {
+    if (session[i].connection == connection)
+      return &session[i];
+  }
+  return NULL;
+}
 
-    if (FD_ISSET (fd, &rfds)) {
-      unsigned char data[200];
-      ssize_t n = read (fd, data, sizeof data);
-      if (n <= 0)
-        goto end;
-      data[n] = 0;
-      write (writer_fd, data, n);
+static void replies (void (*process) (struct telnet *,
+                                      const unsigned char *, size_t),
+                     const unsigned char *options)
+{
+  struct ncp_reply r;
+  struct session *s;
+  int n;
+
+  while ((n = ncp_reply (&r)) == 1) {
+    if (r.type == NCP_REPLY_LISTEN) {
+      new_session (&r, options);
+      continue;
     }
-    if (FD_ISSET (reader_fd, &rfds)) {
-      unsigned char data;
-      ssize_t n = read (reader_fd, &data, 1);
-      if (n <= 0)
-        goto end;
-      process (data, reader_fd, fd);
+    s = find_session (r.connection);
+    if (s == NULL)
+      continue;
+    switch (r.type) {
+    case NCP_REPLY_READ:
+      s->reading = 0;
+      if (r.length == 0)
+        end_session (s);
+      else
+        process (&s->t, r.data, r.length);
+      break;
+    case NCP_REPLY_WRITE:
+      s->writing = 0;
+      if (r.length == 0) {
+        end_session (s);
+        break;
+      }
+      s->length -= r.length;
+      memmove (s->to_ncp, s->to_ncp + r.length, s->length);
+      break;
     }
   }
+  if (n == -1) {
+    fprintf (stderr, "NCP reply error.\n");
+    exit (1);
+  }
+}
 
- end:
-  fprintf (stderr, "DEBUG: server shutting down.\n");
-
-  fprintf (stderr, "DEBUG: closing pipes to children.\n");
-  close (reader_fd);
-  close (writer_fd);
+/* Start NCP requests for what the session has data for.  No more is
+   read while the pty has output pending; one read's worth always fits
+   in the buffer after it drains. */
+static void pump (struct session *s)
+{
+  int n;
+  if (!s->reading && s->t.length == 0) {
+    if (ncp_send_read (s->connection, READ_MAX) == -1)
+      goto fail;
+    s->reading = 1;
+  }
+  if (!s->writing && s->length > 0) {
+    n = s->length;
+    if (n > WRITE_MAX)
+      n = WRITE_MAX;
+    if (ncp_send_write (s->connection, s->to_ncp, n) == -1)
+      goto fail;
+    s->writing = 1;
+  }
+  return;
+ fail:
+  fprintf (stderr, "NCP request error.\n");
+  exit (1);
+}
 
-  fprintf (stderr, "DEBUG: waiting for reader child (PID %d).\n", reader_pid);
-  waitpid (reader_pid, NULL, 0);
-  fprintf (stderr, "DEBUG: reader child reaped.\n");
+static void telnet_server (int host, int sock,
+                           void (*process) (struct telnet *,
+                                            const unsigned char *, size_t),
+                           const unsigned char *options)
+{
+  unsigned char data[BUFFER];
+  struct session *s;
+  fd_set rfds, wfds;
+  ssize_t m;
+  int i, n;
 
-  fprintf (stderr, "DEBUG: waiting for writer child (PID %d).\n", writer_pid);
-  waitpid (writer_pid, NULL, 0);
-  fprintf (stderr, "DEBUG: writer child reaped.\n");
+  fprintf (stderr, "Listening to socket %d.\n", sock);
 
-  fprintf (stderr, "DEBUG: terminating shell process group (PID %d).\n", shell_pid);
-  killpg (shell_pid, SIGHUP);
-  waitpid (shell_pid, NULL, 0);
-  fprintf (stderr, "DEBUG: shell process reaped.\n");
+  fcntl (ncp_fd (), F_SETFD, FD_CLOEXEC);
+  signal (SIGPIPE, SIG_IGN);
+  signal (SIGCHLD, child);
+  for (i = 0; i < SESSIONS; i++)
+    session[i].connection = -1;
+  fill_shells ();
 
-  if (ncp_close (connection) == -1) {
-    fprintf (stderr, "NCP close error.\n");
+  if (ncp_send_listen (sock, 8) == -1) {
+    fprintf (stderr, "NCP listen error.\n");
     exit (1);
   }
-  fprintf (stderr, "DEBUG: server shutdown complete.\n");
+
+  for (;;) {
+    FD_ZERO (&rfds);
+    FD_ZERO (&wfds);
+    FD_SET (ncp_fd (), &rfds);
+    for (i = 0; i < SESSIONS; i++) {
+      s = &session[i];
+      if (s->connection == -1)
+        continue;
+      if (s->length < BUFFER)
+        FD_SET (s->pty, &rfds);
+      if (s->t.length > 0)
+        FD_SET (s->pty, &wfds);
+    }
+
+    // Shells exiting interrupt the wait, so they are reaped promptly.
+    n = select (FD_SETSIZE, &rfds, &wfds, NULL, NULL);
+    reap ();
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Select error.\n");
+      exit (1);
+    }
+
+    if (FD_ISSET (ncp_fd (), &rfds))
+      replies (process, options);
+    for (i = 0; i < SESSIONS; i++) {
+      s = &session[i];
+      if (s->connection == -1)
+        continue;
+      if (FD_ISSET (s->pty, &wfds))
+        flush (&s->t);
+      if (FD_ISSET (s->pty, &rfds)) {
+        m = read (s->pty, data, BUFFER - s->length);
+        if (m == 0 || (m == -1 && errno != EAGAIN)) {
+          // The shell is gone.
+          end_session (s);
+          continue;
+        }
+        if (m > 0)
+          queue (s, data, m);
+      }
+      pump (s);
+    }
+    fill_shells ();
+  }
 }
 
 static void usage (const char *argv0, int code)
 {
-  fprintf (stderr, "Usage: %s -c[bno] host\n"
-           "or %s -s[bno]\n", argv0, argv0);
+  fprintf (stderr, "Usage: %s -c[bno] [-d ms] host\n"
+           "or %s -s[bno] [-d ms] [-k shells]\n", argv0, argv0);
   if (code >= 0)
     exit (code);
 }
@@ -514,9 +778,9 @@ static void usage (const char *argv0, int code)
 int main (int argc, char **argv)
 {
   void (*telnet) (int, int,
-                  void (*) (unsigned char, int, int),
+                  void (*) (struct telnet *, const unsigned char *, size_t),
                   const unsigned char *) = NULL;
-  void (*process) (unsigned char, int, int) = NULL;
+  void (*process) (struct telnet *, const unsigned char *, size_t) = NULL;
   const unsigned char *client_options = NULL;
   const unsigned char *server_options = NULL;
   const unsigned char *options;
@@ -524,7 +788,7 @@ int main (int argc, char **argv)
   int host = -1;
   int sock = -1;
 
-  while ((opt = getopt (argc, argv, "bcnosp:")) != -1) {
+  while ((opt = getopt (argc, argv, "bcd:k:nosp:")) != -1) {
     switch (opt) {
     case 'b':
       if (process != NULL)
@@ -538,6 +802,16 @@ int main (int argc, char **argv)
         usage (argv[0], 1);
       telnet = telnet_client;
       break;
+    case 'd':
+      // Let the NCP coalesce small writes, delaying them at most this.
+      coalesce = atoi (optarg);
+      break;
+    case 'k':
+      // Shells to keep started for new sessions.
+      spare_shells = atoi (optarg);
+      if (spare_shells < 0 || spare_shells > SHELLS)
+        usage (argv[0], 1);
+      break;
     case 'n':
       if (process != NULL)
         usage (argv[0], 1);
@@ -581,10 +855,10 @@ int main (int argc, char **argv)
   if (server_options == NULL)
     server_options = new_server_options;
 
-  if (telnet == telnet_client)
-    host = atoi (argv[optind++]);
+  if (telnet == telnet_client && optind < argc)
+    host = ncp_host (argv[optind++]);
 
-  if (argc != optind)
+  if (argc != optind || (telnet == telnet_client && host == -1))
     usage(argv[0], 1);
 
   if (ncp_init (NULL) == -1) {
@@ -0,0 +1,35 @@
+/* The NCP protocol engine.  Normally run by ncpd, but an application
+   may link it in together with the IMP interface and run it in its
+   own thread, to skip the trip through the ncpd socket.  All engine_
+   calls must then come from the thread which called engine_init. */
+
+/* Run as ncpd, serving applications on the NCP socket.  Doesn't
+   return. */
+extern void engine_daemon (int argc, char **argv);
+
+/* Set up the engine in the calling thread, with the IMP named by the
+   arguments as for ncpd. */
+extern void engine_init (int argc, char **argv);
+
+/* A message from the IMP, length in words. */
+extern void engine_imp (uint8_t *data, int length);
+
+/* An application request, in the same form as sent to ncpd.  The
+   reply goes to engine_reply along with the client address. */
+extern void engine_request (const void *data, int length,
+                            const struct sockaddr_un *client, socklen_t len);
+extern void (*engine_reply) (const void *data, int length,
+                             const struct sockaddr_un *client, socklen_t len);
+
+/* Add the engine's file descriptors for select.  Then engine_poll
+   takes what is ready in fdset, which may be NULL, runs the timers,
+   and returns the number of milliseconds until it wants to be called
+   again. */
+extern void engine_fd_set (fd_set *fdset);
+extern long engine_poll (fd_set *fdset);
+
+/* Perform a request and run the engine until it's answered.  The
+   reply overwrites the request; size is the space for it.  Returns
+   the reply length, or -1.  Set ncp_transport to this to use the
+   application library without ncpd. */
+extern int engine_transact (void *data, int length, int size);
@@ -0,0 +1,60 @@
+/* Host addresses.  The NCP and its applications use the 24-bit form
+   of the 1822L leader, host << 16 | IMP.  Hosts a 32-bit leader can
+   reach are known by their classic 8-bit number, host * 64 + IMP, so
+   that's how they are read and shown.  Any other is written H/I. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "host.h"
+
+/* Read a host, either a classic number or H/I, both in decimal.
+   Returns the address, or -1 if there is none.  If end isn't NULL,
+   it's set to the first character after the host. */
+int host_parse (const char *text, char **end)
+{
+  const char *start = text;
+  char *p;
+  long h, i;
+
+  h = strtol (text, &p, 10);
+  if (p == text || h < 0)
+    goto bad;
+  if (*p != '/') {
+    if (h > 0377)
+      goto bad;
+    if (end != NULL)
+      *end = p;
+    return (h >> 6) << 16 | (h & 077);
+  }
+  text = p + 1;
+  i = strtol (text, &p, 10);
+  if (p == text || h > 0377 || i < 0 || i > 0xFFFF)
+    goto bad;
+  if (end != NULL)
+    *end = p;
+  return h << 16 | i;
+
+ bad:
+  if (end != NULL)
+    *end = (char *)start;
+  return -1;
+}
+
+/* Show a host, the classic number in octal if it has one.  The text
+   is good for the next few calls from the same thread. */
+const char *host_name (int address)
+{
+  static __thread char name[4][16];
+  static __thread int next;
+  char *text = name[next++ % 4];
+  int h = address >> 16, i = address & 0xFFFF;
+
+  if (address < 0)
+    snprintf (text, sizeof name[0], "%d", address);
+  else if (h <= 3 && i <= 077)
+    snprintf (text, sizeof name[0], "%03o", h << 6 | i);
+  else
+    snprintf (text, sizeof name[0], "%d/%d", h, i);
+  return text;
+}
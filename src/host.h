@@ -0,0 +1,4 @@
+/* Host addresses, host << 16 | IMP, as read and shown to people. */
+
+extern int host_parse (const char *text, char **end);
+extern const char *host_name (int address);
@@ -6,21 +6,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "imp.h"
+#include "io.h"
+#include "host.h"
 
 #define FLAG_LAST    0001
 #define FLAG_READY   0002
 
 static int imp_sock;
+static struct io *imp_io;
 static int port;
 static struct sockaddr_in destination;
 static uint16_t imp_ready = 0;
 static uint16_t imp_flags = 0;
 static uint32_t rx_sequence, tx_sequence;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const char *type_name[] =
 {
@@ -42,6 +47,18 @@ static const char *type_name[] =
   "NEW",      //15
 };
 
+/* Type and host from a leader, short or 1822L. */
+static void leader (const uint8_t *data, int *type, int *host)
+{
+  if ((data[0] & 0x0F) == 15) {
+    *type = data[3] & 0x0F;
+    *host = data[5] << 16 | data[6] << 8 | data[7];
+  } else {
+    *type = data[0] & 0x0F;
+    *host = (data[1] >> 6) << 16 | (data[1] & 077);
+  }
+}
+
 static void fatal (const char *message)
 {
   fprintf (stderr, "Fatal error: %s\n", message);
@@ -100,8 +117,10 @@ static void make_socket (void)
 
 void imp_send_message (uint8_t *data, int length)
 {
-  int r;
-
+  int type, host;
+  // Messages may come from several engine threads; keep the
+  // sequence numbers in the order the messages are sent.
+  pthread_mutex_lock (&tx_lock);
   data[0] = 'H';
   data[1] = '3';
   data[2] = '1';
@@ -115,17 +134,17 @@ void imp_send_message (uint8_t *data, int length)
   data[10] = imp_flags >> 8;
   data[11] = imp_flags | FLAG_LAST;
 
-  r = sendto (imp_sock, data, 2 * length + 10, 0,
-              (struct sockaddr *)&destination, sizeof destination);
-  if (r == -1)
-    fprintf (stderr, "IMP: Send error: %s\n", strerror (errno));
+  io_send (imp_io, data, 2 * length + 10, NULL, 0);
   if (length == 1)
     fprintf (stderr, "IMP: Send #%u: host ready bit.\n", tx_sequence);
-  else
-    fprintf (stderr, "IMP: Send #%u: type %d/%s, destination %03o, %d words.\n",
-             tx_sequence, data[12] & 0x0F, type_name[data[12] & 0x0F],
-             data[13], length - 1);
+  else {
+    leader (data + 12, &type, &host);
+    fprintf (stderr, "IMP: Send #%u: type %d/%s, destination %s, %d words.\n",
+             tx_sequence, type, type_name[type], host_name (host),
+             length - 1);
+  }
   tx_sequence++;
+  pthread_mutex_unlock (&tx_lock);
 }
 
 static void ready_nop (int flag)
@@ -134,22 +153,27 @@ static void ready_nop (int flag)
 
 void (*imp_imp_ready) (int flag) = ready_nop;
 
-static uint8_t message[200];
+static uint8_t message[IO_MAX];
 
-void imp_receive_message (uint8_t *data, int *length)
+/* Take the next message received from the IMP into data, which has
+   room for size octets.  Returns 0 if there are none waiting,
+   otherwise 1 with the message length in words, or zero if it was
+   not valid or didn't fit. */
+int imp_receive_message (uint8_t *data, int size, int *length)
 {
   uint32_t x;
-  int n;
+  int n, type, host, used = 0, too_long = 0;
 
   *length = 0;
 
+  n = io_receive (imp_io, message, sizeof message, NULL, NULL);
+  if (n == -1)
+    return 0;
+
  loop:
-  n = read (imp_sock, message, sizeof message);
-  if (n == 0)
-    return;
-  else if (n == -1) {
-    fprintf (stderr, "IMP: Receive error: %s\n", strerror (errno));
-    return;
+  if (n < 12) {
+    fprintf (stderr, "IMP: Receive error: short message.\n");
+    return 1;
   }
 
   if (message[0] != 'H' ||
@@ -160,7 +184,7 @@ void imp_receive_message (uint8_t *data, int *length)
     fprintf (stderr, "IMP: Receive error: bad magic.\n");
     for (i = 0; i < n; i++)
       fprintf (stderr, "%02X ", message[i]);
-    return;
+    return 1;
   }
 
   x = (message[4] << 24) | (message[5] << 16) | (message[6] << 8) | message[7];
@@ -170,7 +194,7 @@ void imp_receive_message (uint8_t *data, int *length)
   } else if (x < rx_sequence) {
     fprintf (stderr, "IMP: Bad sequence number: %u.\n", x);
     *length = 0;
-    return;
+    return 1;
   } else if (x != rx_sequence) {
     rx_sequence = x;
   }
@@ -178,11 +202,14 @@ void imp_receive_message (uint8_t *data, int *length)
 
   x = message[8] << 8 | message[9];
   *length += x - 1;
-  if (n != 2 * x + 10)
+  if (n != 2 * x + 10) {
     fprintf (stderr, "IMP: Receive bad length.\n");
+    *length = 0;
+    return 1;
+  }
 
   if (*length == 0)
-    return;
+    return 1;
 
   x = (message[10] << 8) | message[11];
   if ((x & FLAG_READY) ^ imp_ready) {
@@ -194,36 +221,60 @@ void imp_receive_message (uint8_t *data, int *length)
     imp_imp_ready (imp_ready);
   }
 
-  memcpy (data, message + 12, n - 12);
-  data += n - 12;
+  // Keep reading to the last fragment of a message too long.
+  if (used + n - 12 > size)
+    too_long = 1;
+  if (!too_long) {
+    memcpy (data + used, message + 12, n - 12);
+    used += n - 12;
+  }
 
   fprintf (stderr, "IMP: Flags are %04X.\n", x);
-  if ((x & FLAG_LAST) == 0)
+  if ((x & FLAG_LAST) == 0) {
+    // The rest of the message follows right behind.
+    io_wait (imp_io);
+    n = io_receive (imp_io, message, sizeof message, NULL, NULL);
+    if (n == -1) {
+      fprintf (stderr, "IMP: Receive error: message cut short.\n");
+      *length = 0;
+      return 1;
+    }
     goto loop;
+  }
+
+  if (too_long) {
+    fprintf (stderr, "IMP: Receive error: message too long.\n");
+    *length = 0;
+    return 1;
+  }
 
-  fprintf (stderr, "IMP: Receive #%u: type %d/%s, source %03o, %d words.\n",
-           rx_sequence - 1, message[12] & 0x0F, type_name[message[12] & 0x0F],
-           message[13], *length);
-  if ((message[12] & 0x0F) != 0)
+  leader (message + 12, &type, &host);
+  fprintf (stderr, "IMP: Receive #%u: type %d/%s, source %s, %d words.\n",
+           rx_sequence - 1, type, type_name[type], host_name (host),
+           *length);
+  if ((message[12] & 0x0F) != 0 && (message[12] & 0x0F) != 15)
     fprintf (stderr, "IMP: flags %02o, link %03o, id %02o, subtype %02o.\n",
              message[12] >> 4, message[14], message[15] >> 4,
              message[15] & 0x0F);
+  return 1;
 }
 
 void imp_fd_set (fd_set *fdset)
 {
-  FD_SET (imp_sock, fdset);
+  FD_SET (io_fd (imp_io), fdset);
 }
 
 int imp_fd_isset (fd_set *fdset)
 {
-  return FD_ISSET (imp_sock, fdset);
+  return io_ready (imp_io, fdset);
 }
 
 void imp_init (int argc, char **argv)
 {
   args (argc, argv);
   make_socket ();
+  imp_io = io_start (imp_sock, (struct sockaddr *)&destination,
+                     sizeof destination);
   rx_sequence = tx_sequence = 0;
   imp_flags = imp_ready = 0;
 }
@@ -0,0 +1,235 @@
+/* Datagram socket I/O in a separate thread.
+
+   Each socket gets a thread which receives datagrams into one ring
+   buffer, and sends datagrams taken from another.  The protocol
+   engine is the other end of both rings.  Since the rings are
+   lock-free, the two sides only meet through a pair of pipes used to
+   wake each other up.  Several engine threads may send through the
+   same socket, so io_send takes a lock; receiving is left to one
+   thread. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "io.h"
+#include "ring.h"
+
+#define IO_SLOTS  64
+
+struct io_msg
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int size;
+  uint8_t data[IO_MAX];
+};
+
+struct io
+{
+  int sock;
+  struct sockaddr_storage to;
+  socklen_t len;
+  struct ring rx, tx;
+  int rx_pipe[2];   // Thread wakes engine: messages received.
+  int tx_pipe[2];   // Engine wakes thread: messages to send.
+  pthread_t thread;
+  pthread_mutex_t lock;   // Serialises producers on the tx ring.
+};
+
+static void fatal (const char *message)
+{
+  fprintf (stderr, "Fatal error: %s\n", message);
+  exit (1);
+}
+
+static void make_pipe (int *fds)
+{
+  if (pipe (fds) == -1)
+    fatal ("pipe");
+  fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+}
+
+static void wake (int fd)
+{
+  uint8_t x = 0;
+  // If the pipe is full, the other side is already due to wake up.
+  if (write (fd, &x, 1) == -1 && errno != EAGAIN)
+    fprintf (stderr, "IO: wake error: %s\n", strerror (errno));
+}
+
+static void drain (int fd)
+{
+  uint8_t x[64];
+  while (read (fd, x, sizeof x) > 0)
+    ;
+}
+
+static void transmit (struct io *io)
+{
+  struct io_msg *m;
+  while ((m = ring_peek (&io->tx)) != NULL) {
+    struct sockaddr *to = (struct sockaddr *)&m->addr;
+    socklen_t len = m->len;
+    if (len == 0) {
+      to = (struct sockaddr *)&io->to;
+      len = io->len;
+    }
+    if (sendto (io->sock, m->data, m->size, 0, to, len) == -1)
+      fprintf (stderr, "IO: Send error: %s.\n", strerror (errno));
+    ring_pop (&io->tx);
+  }
+}
+
+static void receive (struct io *io)
+{
+  struct io_msg *m;
+  ssize_t n;
+  int got = 0;
+  while ((m = ring_slot (&io->rx)) != NULL) {
+    m->len = sizeof m->addr;
+    n = recvfrom (io->sock, m->data, sizeof m->data, MSG_DONTWAIT,
+                  (struct sockaddr *)&m->addr, &m->len);
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf (stderr, "IO: Receive error: %s.\n", strerror (errno));
+      break;
+    }
+    m->size = n;
+    ring_push (&io->rx);
+    got = 1;
+  }
+  if (got)
+    wake (io->rx_pipe[1]);
+}
+
+static void *io_thread (void *arg)
+{
+  struct io *io = arg;
+  int n, max = io->sock > io->tx_pipe[0] ? io->sock : io->tx_pipe[0];
+
+  for (;;) {
+    fd_set rfds;
+    struct timeval tv, *timeout = NULL;
+    FD_ZERO (&rfds);
+    FD_SET (io->tx_pipe[0], &rfds);
+    if (ring_slot (&io->rx) != NULL)
+      FD_SET (io->sock, &rfds);
+    else {
+      // Engine is behind; leave datagrams in the socket for now.
+      tv.tv_sec = 0;
+      tv.tv_usec = 1000;
+      timeout = &tv;
+    }
+    n = select (max + 1, &rfds, NULL, NULL, timeout);
+    if (n == -1) {
+      if (errno != EINTR)
+        fprintf (stderr, "IO: select error: %s.\n", strerror (errno));
+      continue;
+    }
+    if (FD_ISSET (io->tx_pipe[0], &rfds))
+      drain (io->tx_pipe[0]);
+    transmit (io);
+    if (FD_ISSET (io->sock, &rfds))
+      receive (io);
+  }
+
+  return NULL;
+}
+
+struct io *io_start (int sock, struct sockaddr *to, socklen_t len)
+{
+  struct io *io = calloc (1, sizeof (struct io));
+  if (io == NULL)
+    fatal ("io allocation");
+  io->sock = sock;
+  if (to != NULL)
+    memcpy (&io->to, to, len);
+  io->len = len;
+  ring_init (&io->rx, IO_SLOTS, sizeof (struct io_msg));
+  ring_init (&io->tx, IO_SLOTS, sizeof (struct io_msg));
+  make_pipe (io->rx_pipe);
+  make_pipe (io->tx_pipe);
+  pthread_mutex_init (&io->lock, NULL);
+  if (pthread_create (&io->thread, NULL, io_thread, io) != 0)
+    fatal ("pthread_create");
+  return io;
+}
+
+int io_fd (struct io *io)
+{
+  return io->rx_pipe[0];
+}
+
+/* Check if the thread has signalled that messages have arrived.  This
+   clears the signal, so the caller must then io_receive until there
+   are no more messages. */
+int io_ready (struct io *io, fd_set *fdset)
+{
+  if (!FD_ISSET (io->rx_pipe[0], fdset))
+    return 0;
+  drain (io->rx_pipe[0]);
+  return 1;
+}
+
+int io_receive (struct io *io, void *data, int size,
+                struct sockaddr *from, socklen_t *len)
+{
+  struct io_msg *m = ring_peek (&io->rx);
+  if (m == NULL)
+    return -1;
+  if (size > m->size)
+    size = m->size;
+  memcpy (data, m->data, size);
+  if (from != NULL) {
+    if (*len > m->len)
+      *len = m->len;
+    memcpy (from, &m->addr, *len);
+  }
+  ring_pop (&io->rx);
+  return size;
+}
+
+void io_wait (struct io *io)
+{
+  fd_set rfds;
+  while (ring_peek (&io->rx) == NULL) {
+    FD_ZERO (&rfds);
+    FD_SET (io->rx_pipe[0], &rfds);
+    if (select (io->rx_pipe[0] + 1, &rfds, NULL, NULL, NULL) > 0)
+      drain (io->rx_pipe[0]);
+  }
+}
+
+void io_send (struct io *io, const void *data, int size,
+              struct sockaddr *to, socklen_t len)
+{
+  struct io_msg *m;
+  pthread_mutex_lock (&io->lock);
+  while ((m = ring_slot (&io->tx)) == NULL)
+    sched_yield ();
+  if (size > sizeof m->data) {
+    fprintf (stderr, "IO: Message truncated from %d octets.\n", size);
+    size = sizeof m->data;
+  }
+  memcpy (m->data, data, size);
+  m->size = size;
+  m->len = 0;
+  if (to != NULL) {
+    memcpy (&m->addr, to, len);
+    m->len = len;
+  }
+  ring_push (&io->tx);
+  pthread_mutex_unlock (&io->lock);
+  wake (io->tx_pipe[1]);
+}
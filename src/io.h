@@ -0,0 +1,14 @@
+/* Datagram socket I/O in a separate thread. */
+
+#define IO_MAX  8192
+
+struct io;
+
+extern struct io *io_start (int sock, struct sockaddr *to, socklen_t len);
+extern int io_fd (struct io *io);
+extern int io_ready (struct io *io, fd_set *fdset);
+extern int io_receive (struct io *io, void *data, int size,
+                       struct sockaddr *from, socklen_t *len);
+extern void io_wait (struct io *io);
+extern void io_send (struct io *io, const void *data, int size,
+                     struct sockaddr *to, socklen_t len);
@@ -14,10 +14,11 @@
 
 #include "ncp.h"
 #include "wire.h"
+#include "host.h"
 
 static int fd;
 static struct sockaddr_un addr;
-static uint8_t message[1000];
+static uint8_t message[WIRE_METRICS_MAX];
 
 static void cleanup (void)
 {
@@ -63,6 +64,18 @@ int ncp_init (const char *path)
   return 0;
 }
 
+int ncp_host (const char *text)
+{
+  char *end;
+  int host = host_parse (text, &end);
+  return *end == 0 ? host : -1;
+}
+
+const char *ncp_host_name (int host)
+{
+  return host_name (host);
+}
+
 static int size;
 
 static void type (uint8_t x)
@@ -76,15 +89,30 @@ static void add (uint8_t x)
   message[size++] = x;
 }
 
+static void add_host (int host)
+{
+  wire_put_host (message + size, host);
+  size += 3;
+}
+
+static int transport (void *data, int length, int size)
+{
+  if (send (fd, data, length, 0) != length)
+    return -1;
+  return recv (fd, data, size, 0);
+}
+
+int (*ncp_transport) (void *data, int length, int size) = transport;
+
 static int transact (void)
 {
   int type = message[0];
   ssize_t n;
   if (!wire_check (type, size))
     return -1;
-  if (send (fd, message, size, 0) != size)
+  n = ncp_transport (message, size, sizeof message);
+  if (n == -1)
     return -1;
-  n = recv (fd, message, sizeof message, 0);
   if (message[0] != type + 1)
     return -1;
   if (!wire_check (message[0], n))
@@ -95,17 +123,17 @@ static int transact (void)
 int ncp_echo (int host, int data, int *reply)
 {
   type (WIRE_ECHO);
-  add (host);
+  add_host (host);
   add (data);
   if (transact () == -1)
     return -1;
-  if (message[1] != host)
+  if (wire_get_host (message + 1) != host)
     return -1;
-  *reply = message[2];
-  if (message[3] == 0x10)
+  *reply = message[4];
+  if (message[5] == 0x10)
     return 0;
   else
-    return -message[3] - 2;
+    return -message[5] - 2;
 }
 
 static int u32 (uint8_t *data)
@@ -113,54 +141,69 @@ static int u32 (uint8_t *data)
   return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
 }
 
-int ncp_open (int host, unsigned socket, int *size, int *connection)
+static void open_request (int host, unsigned socket, int size)
 {
   type (WIRE_OPEN);
-  add (host);
+  add_host (host);
   add (socket >> 24);
   add (socket >> 16);
   add (socket >> 8);
   add (socket);
-  add (*size);
+  add (size);
+}
+
+int ncp_open (int host, unsigned socket, int *size, int *connection)
+{
+  open_request (host, socket, *size);
   if (transact () == -1)
     return -1;
-  if (message[1] != host)
+  if (wire_get_host (message + 1) != host)
     return -1;
-  if (u32 (message + 2) != socket)
+  if (u32 (message + 4) != socket)
     return -1;
-  if (message[8] == 255)
+  if (message[10] == 255)
     return -2;
-  *connection = message[6];
-  *size = message[7];
+  *connection = message[8];
+  *size = message[9];
   return 0;
 }
 
-int ncp_listen (unsigned socket, int *size, int *host, int *connection)
+static void listen_request (unsigned socket, int size)
 {
   type (WIRE_LISTEN);
   add (socket >> 24);
   add (socket >> 16);
   add (socket >> 8);
   add (socket);
-  add (*size);
+  add (size);
+}
+
+int ncp_listen (unsigned socket, int *size, int *host, int *connection)
+{
+  listen_request (socket, *size);
   if (transact () == -1)
     return -1;
-  if (message[1] == 0)
+  if (wire_get_host (message + 1) == 0)
     return -1;
-  if (u32 (message + 2) != socket)
+  if (u32 (message + 4) != socket)
     return -1;
-  *host = message[1];
-  *connection = message[6];
-  *size = message[7];
+  *host = wire_get_host (message + 1);
+  *connection = message[8];
+  *size = message[9];
   return 0;
 }
 
-int ncp_read (int connection, void *data, int *length)
+static void read_request (int connection, int length)
 {
-  ssize_t n;
   type (WIRE_READ);
   add (connection);
-  add (*length);
+  add (length);
+}
+
+int ncp_read (int connection, void *data, int *length)
+{
+  ssize_t n;
+  read_request (connection, *length);
   *length = 0;
   n = transact ();
   if (n == -1)
@@ -172,12 +215,17 @@ int ncp_read (int connection, void *data, int *length)
   return 0;
 }
 
-int ncp_write (int connection, void *data, int *length)
+static void write_request (int connection, const void *data, int length)
 {
   type (WIRE_WRITE);
   add (connection);
-  memcpy (message + size, data, *length);
-  size += *length;
+  memcpy (message + size, data, length);
+  size += length;
+}
+
+int ncp_write (int connection, void *data, int *length)
+{
+  write_request (connection, data, *length);
   *length = 0;
   if (transact () == -1)
     return -1;
@@ -198,13 +246,154 @@ int ncp_interrupt (int connection)
   return 0;
 }
 
-int ncp_close (int connection)
+static void close_request (int connection)
 {
   type (WIRE_CLOSE);
   add (connection);
+}
+
+int ncp_close (int connection)
+{
+  close_request (connection);
+  if (transact () == -1)
+    return -1;
+  if (message[1] != connection)
+    return -1;
+  return 0;
+}
+
+/* Let the NCP hold small writes for up to delay milliseconds while
+   the connection has a message outstanding, and send them together.
+   Writes then complete as soon as they are buffered.  A delay of zero
+   turns this off. */
+static void coalesce_request (int connection, int delay)
+{
+  type (WIRE_COALESCE);
+  add (connection);
+  add (delay >> 8);
+  add (delay);
+}
+
+int ncp_coalesce (int connection, int delay)
+{
+  coalesce_request (connection, delay);
   if (transact () == -1)
     return -1;
   if (message[1] != connection)
     return -1;
   return 0;
 }
+
+int ncp_metrics (char *text, int *length)
+{
+  ssize_t n;
+  type (WIRE_METRICS);
+  n = transact ();
+  if (n == -1)
+    return -1;
+  n--;
+  if (n > *length)
+    n = *length;
+  memcpy (text, message + 1, n);
+  *length = n;
+  return 0;
+}
+
+/* Requests which don't wait for the reply.  The replies are taken
+   by ncp_reply when the socket from ncp_fd is readable. */
+
+int ncp_fd (void)
+{
+  return fd;
+}
+
+static int post (void)
+{
+  if (!wire_check (message[0], size))
+    return -1;
+  if (send (fd, message, size, 0) != size)
+    return -1;
+  return 0;
+}
+
+int ncp_send_open (int host, unsigned socket, int size)
+{
+  open_request (host, socket, size);
+  return post ();
+}
+
+int ncp_send_listen (unsigned socket, int size)
+{
+  listen_request (socket, size);
+  return post ();
+}
+
+int ncp_send_read (int connection, int length)
+{
+  read_request (connection, length);
+  return post ();
+}
+
+int ncp_send_write (int connection, const void *data, int length)
+{
+  write_request (connection, data, length);
+  return post ();
+}
+
+int ncp_send_close (int connection)
+{
+  close_request (connection);
+  return post ();
+}
+
+int ncp_send_coalesce (int connection, int delay)
+{
+  coalesce_request (connection, delay);
+  return post ();
+}
+
+/* Take the next reply, if there is one.  Returns 1 with the reply
+   filled in, 0 if none is waiting, or -1 on error.  Read data is
+   only valid until the next call. */
+int ncp_reply (struct ncp_reply *reply)
+{
+  ssize_t n;
+
+  n = recv (fd, message, sizeof message, MSG_DONTWAIT);
+  if (n == -1)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  if (n == 0 || !wire_check (message[0], n))
+    return -1;
+
+  memset (reply, 0, sizeof *reply);
+  reply->type = message[0] - 1;
+  switch (reply->type) {
+  case WIRE_OPEN:
+    reply->host = wire_get_host (message + 1);
+    reply->socket = u32 (message + 4);
+    reply->connection = message[8];
+    reply->size = message[9];
+    reply->error = message[10] == 255 ? -2 : 0;
+    break;
+  case WIRE_LISTEN:
+    reply->host = wire_get_host (message + 1);
+    reply->socket = u32 (message + 4);
+    reply->connection = message[8];
+    reply->size = message[9];
+    reply->error = reply->host == 0 ? -1 : 0;
+    break;
+  case WIRE_READ:
+    reply->connection = message[1];
+    reply->data = message + 2;
+    reply->length = n - 2;
+    break;
+  case WIRE_WRITE:
+    reply->connection = message[1];
+    reply->length = message[2] << 8 | message[3];
+    break;
+  default:
+    reply->connection = message[1];
+    break;
+  }
+  return 1;
+}
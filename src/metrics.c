@@ -0,0 +1,300 @@
+/* Counters and histograms kept by the NCP daemon, and rendering them
+   as text in the Prometheus exposition format. */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "host.h"
+
+#define IMP_TYPES   16
+#define NCP_TYPES   14
+#define APP_TYPES    9
+#define BUCKETS     14
+#define HOST_SLOTS 1024
+
+/* Counters are bumped from several protocol engine threads. */
+#define ADD(X, N)   __atomic_fetch_add (&(X), (N), __ATOMIC_RELAXED)
+#define INC(X)      ADD (X, 1)
+
+/* Histogram bucket upper bounds, in microseconds. */
+static const uint64_t bound[BUCKETS - 1] =
+{
+  1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000,
+  500000, 1000000, 2000000, 5000000, 10000000
+};
+
+struct histogram
+{
+  unsigned long bucket[BUCKETS];
+  unsigned long count;
+  uint64_t sum;
+};
+
+static struct
+{
+  unsigned long imp_msgs[2][IMP_TYPES];
+  unsigned long imp_octets[2];
+  unsigned long ncp_msgs[2][NCP_TYPES];
+  unsigned long timeouts[METRICS_KINDS];
+  unsigned long ip_datagrams[2];
+  unsigned long ip_octets[2];
+  unsigned long ip_dropped;
+  struct histogram rfnm;
+  struct histogram app[APP_TYPES];
+  struct histogram event;
+} counters;
+
+/* Per host counters, in an open addressed table keyed by the host
+   address plus one.  Slots are claimed, never freed, so any thread
+   can find or take one without a lock.  When the table is full, the
+   rest share the last slot. */
+struct per_host
+{
+  int key;
+  unsigned long msgs[2];
+  unsigned long octets[2];
+  unsigned long ncp[2];
+  unsigned long stalls;
+  unsigned long rfnm_count;
+  uint64_t rfnm_sum;
+};
+static struct per_host per_host[HOST_SLOTS + 1];
+
+static const char *imp_name[] =
+{
+  "REGULAR", "ER_LEAD", "DOWN", "BLOCKED", "NOP", "RFNM", "FULL",
+  "DEAD", "ER_DATA", "INCOMPL", "RESET", "11", "12", "13", "14", "NEW"
+};
+
+static const char *ncp_name[] =
+{
+  "NOP", "RTS", "STR", "CLS", "ALL", "GVB", "RET",
+  "INR", "INS", "ECO", "ERP", "ERR", "RST", "RRP"
+};
+
+static const char *timeout_name[] =
+{
+  "rrp", "rfnm", "all", "rfc", "cls", "erp"
+};
+
+static const char *app_name[] =
+{
+  "ECHO", "OPEN", "LISTEN", "READ", "WRITE", "INTERRUPT", "CLOSE",
+  "METRICS", "COALESCE"
+};
+
+static const char *direction[] = { "in", "out" };
+
+uint64_t metrics_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct per_host *host_slot (int host)
+{
+  uint32_t i = (host * 2654435761u) % HOST_SLOTS;
+  int j, key, want = host + 1;
+
+  for (j = 0; j < HOST_SLOTS; j++, i = (i + 1) % HOST_SLOTS) {
+    key = __atomic_load_n (&per_host[i].key, __ATOMIC_ACQUIRE);
+    if (key == 0 &&
+        __atomic_compare_exchange_n (&per_host[i].key, &key, want, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return &per_host[i];
+    if (key == want)
+      return &per_host[i];
+  }
+  return &per_host[HOST_SLOTS];
+}
+
+static void observe (struct histogram *h, uint64_t usec)
+{
+  int i;
+  for (i = 0; i < BUCKETS - 1; i++) {
+    if (usec <= bound[i])
+      break;
+  }
+  INC (h->bucket[i]);
+  INC (h->count);
+  ADD (h->sum, usec);
+}
+
+void metrics_imp (int out, int type, int host, int octets)
+{
+  struct per_host *p = host_slot (host);
+  INC (counters.imp_msgs[out][type & 0x0F]);
+  ADD (counters.imp_octets[out], octets);
+  INC (p->msgs[out]);
+  ADD (p->octets[out], octets);
+}
+
+void metrics_ncp (int out, int type, int host)
+{
+  if (type < NCP_TYPES)
+    INC (counters.ncp_msgs[out][type]);
+  INC (host_slot (host)->ncp[out]);
+}
+
+void metrics_ip (int out, int octets)
+{
+  INC (counters.ip_datagrams[out]);
+  ADD (counters.ip_octets[out], octets);
+}
+
+void metrics_ip_dropped (void)
+{
+  INC (counters.ip_dropped);
+}
+
+void metrics_rfnm (int host, uint64_t usec)
+{
+  struct per_host *p = host_slot (host);
+  observe (&counters.rfnm, usec);
+  INC (p->rfnm_count);
+  ADD (p->rfnm_sum, usec);
+}
+
+void metrics_stall (int host)
+{
+  INC (host_slot (host)->stalls);
+}
+
+void metrics_timeout (int kind)
+{
+  INC (counters.timeouts[kind]);
+}
+
+/* Application requests have odd wire types, starting with 1. */
+void metrics_app (int type, uint64_t usec)
+{
+  if (type / 2 < APP_TYPES)
+    observe (&counters.app[type / 2], usec);
+}
+
+void metrics_event (uint64_t usec)
+{
+  observe (&counters.event, usec);
+}
+
+static int print (char *text, int size, int n, const char *format, ...)
+{
+  va_list ap;
+  int m;
+  if (n >= size)
+    return n;
+  va_start (ap, format);
+  m = vsnprintf (text + n, size - n, format, ap);
+  va_end (ap);
+  if (m < 0)
+    return n;
+  n += m;
+  return n < size ? n : size;
+}
+
+static int histogram (char *text, int size, int n, const char *name,
+                      const char *label, struct histogram *h)
+{
+  unsigned long cumulative = 0;
+  const char *comma = label[0] ? "," : "";
+  int i;
+  for (i = 0; i < BUCKETS - 1; i++) {
+    cumulative += h->bucket[i];
+    n = print (text, size, n, "%s_bucket{%s%sle=\"%g\"} %lu\n",
+               name, label, comma, bound[i] / 1e6, cumulative);
+  }
+  cumulative += h->bucket[i];
+  n = print (text, size, n, "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+             name, label, comma, cumulative);
+  n = print (text, size, n, "%s_sum{%s} %g\n", name, label, h->sum / 1e6);
+  n = print (text, size, n, "%s_count{%s} %lu\n", name, label, h->count);
+  return n;
+}
+
+int metrics_text (char *text, int size)
+{
+  struct per_host *p;
+  char label[40];
+  const char *name;
+  int i, j, k, n = 0;
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < IMP_TYPES; j++) {
+      if (counters.imp_msgs[i][j] == 0)
+        continue;
+      n = print (text, size, n,
+                 "ncp_imp_messages_total{direction=\"%s\",type=\"%s\"} %lu\n",
+                 direction[i], imp_name[j], counters.imp_msgs[i][j]);
+    }
+    n = print (text, size, n, "ncp_imp_octets_total{direction=\"%s\"} %lu\n",
+               direction[i], counters.imp_octets[i]);
+  }
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < NCP_TYPES; j++) {
+      if (counters.ncp_msgs[i][j] == 0)
+        continue;
+      n = print (text, size, n,
+                 "ncp_control_messages_total{direction=\"%s\",type=\"%s\"} %lu\n",
+                 direction[i], ncp_name[j], counters.ncp_msgs[i][j]);
+    }
+  }
+
+  for (i = 0; i < METRICS_KINDS; i++)
+    n = print (text, size, n, "ncp_timeouts_total{kind=\"%s\"} %lu\n",
+               timeout_name[i], counters.timeouts[i]);
+
+  if (counters.ip_datagrams[0] != 0 || counters.ip_datagrams[1] != 0 ||
+      counters.ip_dropped != 0) {
+    for (i = 0; i < 2; i++) {
+      n = print (text, size, n,
+                 "ncp_ip_datagrams_total{direction=\"%s\"} %lu\n",
+                 direction[i], counters.ip_datagrams[i]);
+      n = print (text, size, n, "ncp_ip_octets_total{direction=\"%s\"} %lu\n",
+                 direction[i], counters.ip_octets[i]);
+    }
+    n = print (text, size, n, "ncp_ip_dropped_total %lu\n",
+               counters.ip_dropped);
+  }
+
+  n = histogram (text, size, n, "ncp_rfnm_seconds", "", &counters.rfnm);
+  n = histogram (text, size, n, "ncp_event_seconds", "", &counters.event);
+  for (i = 0; i < APP_TYPES; i++) {
+    if (counters.app[i].count == 0)
+      continue;
+    snprintf (label, sizeof label, "request=\"%s\"", app_name[i]);
+    n = histogram (text, size, n, "ncp_app_request_seconds", label,
+                   &counters.app[i]);
+  }
+
+  for (k = 0; k < HOST_SLOTS; k++) {
+    p = &per_host[k];
+    if (p->key == 0)
+      continue;
+    name = host_name (p->key - 1);
+    for (j = 0; j < 2; j++) {
+      n = print (text, size, n,
+                 "ncp_host_messages_total{host=\"%s\",direction=\"%s\"} %lu\n",
+                 name, direction[j], p->msgs[j]);
+      n = print (text, size, n,
+                 "ncp_host_octets_total{host=\"%s\",direction=\"%s\"} %lu\n",
+                 name, direction[j], p->octets[j]);
+      n = print (text, size, n,
+                 "ncp_host_control_messages_total{host=\"%s\",direction=\"%s\"} %lu\n",
+                 name, direction[j], p->ncp[j]);
+    }
+    n = print (text, size, n, "ncp_host_allocation_stalls_total{host=\"%s\"} %lu\n",
+               name, p->stalls);
+    n = print (text, size, n, "ncp_host_rfnm_seconds_sum{host=\"%s\"} %g\n",
+               name, p->rfnm_sum / 1e6);
+    n = print (text, size, n, "ncp_host_rfnm_seconds_count{host=\"%s\"} %lu\n",
+               name, p->rfnm_count);
+  }
+
+  return n;
+}
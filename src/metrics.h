@@ -0,0 +1,21 @@
+/* Counters and histograms kept by the NCP daemon. */
+
+#define METRICS_RRP      0
+#define METRICS_RFNM     1
+#define METRICS_ALL      2
+#define METRICS_RFC      3
+#define METRICS_CLS      4
+#define METRICS_ERP      5
+#define METRICS_KINDS    6
+
+extern uint64_t metrics_now (void);
+extern void metrics_imp (int out, int type, int host, int octets);
+extern void metrics_ncp (int out, int type, int host);
+extern void metrics_ip (int out, int octets);
+extern void metrics_ip_dropped (void);
+extern void metrics_rfnm (int host, uint64_t usec);
+extern void metrics_stall (int host);
+extern void metrics_timeout (int kind);
+extern void metrics_app (int type, uint64_t usec);
+extern void metrics_event (uint64_t usec);
+extern int metrics_text (char *text, int size);
@@ -3,18 +3,33 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 
 #include "imp.h"
 #include "wire.h"
-
+#include "metrics.h"
+#include "io.h"
+#include "ring.h"
+#include "tun.h"
+#include "host.h"
+#include "engine.h"
+
+/* Timeouts in seconds, used until a host's round-trip time has been
+   measured.  After that, they are derived from the smoothed round-trip
+   time and its variation, within RTO_MIN and RTO_MAX milliseconds.
+   ALL, RFC and CLS wait on the remote application as well as its NCP,
+   so those are never shorter than given here. */
 #define RFNM_TIMEOUT   10
 #define RRP_TIMEOUT    20
 #define ERP_TIMEOUT    20
@@ -22,6 +37,9 @@
 #define RFC_TIMEOUT     3
 #define CLS_TIMEOUT     3
 
+#define RTO_MIN       500
+#define RTO_MAX    120000
+
 #define IMP_REGULAR       0
 #define IMP_LEADER_ERROR  1
 #define IMP_DOWN          2
@@ -39,6 +57,20 @@
 #define LINK_MAX    71
 #define LINK_IP    155
 
+/* The 32-bit leader has an 8-bit host number: two bits of host on the
+   IMP, and six of IMP number.  The 96-bit leader of 1822L, marked by
+   LEADER_NEW in the type field, has eight and sixteen.  Host
+   addresses are always the 24-bit form, host << 16 | IMP, and
+   messages from the IMP are widened to the long leader before they
+   are processed.  These are octet offsets into it. */
+#define LEADER_NEW   15
+#define LEADER_FLAGS  2
+#define LEADER_TYPE   3
+#define LEADER_HOST   5
+#define LEADER_LINK   8
+#define LEADER_SUB    9
+#define LEADER_SIZE  12
+
 #define NCP_NOP      0
 #define NCP_RTS      1
 #define NCP_STR      2
@@ -84,7 +116,57 @@
 #define CONN_SENT_RCV_CLS(CONN, OP) (connection[CONN].rcv.link OP -1)
 #define CONN_SENT_SND_CLS(CONN, OP) (connection[CONN].snd.link OP -1)
 
-#define CONNECTIONS 20
+/* The protocol engine runs in up to SHARDS_MAX threads.  A shard owns
+   the hosts whose number modulo the number of shards is its own, and
+   an equal block of CONNECTIONS entries in the connection table.  The
+   table of listening sockets is the only state shared between shards.
+   Connection numbers go to applications in an octet, and 255 means
+   none. */
+#define SHARDS_MAX  8
+#define TABLE       240
+#define CONNECTIONS (TABLE / shards)
+#define LISTENS     20
+#define FIRST       (shard->number * CONNECTIONS)
+#define LAST        (FIRST + CONNECTIONS)
+#define WORK_SLOTS  64
+#define HOST_TABLE  64  // Initial buckets in a shard's table of hosts.
+#define MESSAGE_MAX 200
+#define CONTROL_MAX 120 // Octets of control commands in one message.
+#define NAGLE_MAX   1000
+
+#define PENDING     64
+#define RFNM_RING   8   // Messages kept until the IMP has answered.
+#define RFNM_WINDOW 4   // Initial messages in flight to a host.
+#define RETRIES     3   // Times to resend a message the IMP didn't deliver.
+#define SEND_MAX    (16 + 1032)
+
+/* IPv4 datagrams are carried on LINK_IP, right after the leader, in
+   messages of at most 8063 bits.  Hosts have addresses 10.H.I.I, as
+   in RFC 796, for host H on the IMP numbered by the last two octets. */
+#define IP_MTU      1006
+#define TUN_BATCH   32  // Datagrams read from the tun device at a time.
+#define LOOP_SLOTS  16  // Messages to our own host not yet processed.
+#define WARM_MAX    32  // Hosts in NCP_WARM.
+#define WARM_REFRESH 60 // Seconds between checks of the warm hosts.
+#define HOST_IDLE   600 // Seconds before an unused host entry is reused.
+#define HOST_SWEEP  60  // Seconds between looks for idle hosts.
+
+/* Congestion control.  The window of messages in flight to a host,
+   and the number of bits of allocation granted it, are increased
+   additively while messages get through, and halved at most once per
+   round trip when the IMP says one didn't. */
+#define WINDOW_MAX  RFNM_RING
+#define GRANT_MIN   128
+#define GRANT_MAX   8000
+#define GRANT_STEP  256
+
+#define WAIT_RRP    0
+#define WAIT_RFNM   1
+#define WAIT_SEND   2   // Data ready for the transmit scheduler.
+
+#define QUANTUM     256 // Octets per connection per scheduling round.
+
+#define EXPIRED(T)  ((long)(time_tick - (T)) >= 0)
 
 static void send_socket (int i);
 static void just_drop (int i);
@@ -98,10 +180,16 @@ static void rfnm_timeout (int i);
 static void cls_timeout (int i);
 
 static int fd;
+static struct io *app_io;
 static struct sockaddr_un server;
-static struct sockaddr_un client;
-static socklen_t len;
-static unsigned long time_tick;
+static __thread struct sockaddr_un client;
+static __thread socklen_t len;
+static __thread unsigned long time_tick; // Milliseconds.
+static int metrics_fd = -1;
+static int tun_fd = -1;
+static int self = -1;           // Our own host number, if known.
+static int long_leaders = 0;    // Always send 96-bit leaders.
+static struct sockaddr_un metrics_addr;
 
 typedef struct
 { 
@@ -109,7 +197,7 @@ typedef struct
   socklen_t len;
 } client_t;
 
-struct
+static struct
 {
   client_t client, reader, writer;
   int host;
@@ -133,25 +221,251 @@ struct
   uint8_t buffer[1024];
   uint8_t *ptr;
   int length, remaining;
-} connection[CONNECTIONS];
+  unsigned long msgs_in, msgs_out, octets_in, octets_out;
+  // Place in the host's queues of connections waiting for RRP, RFNM,
+  // or a turn to send.
+  struct { int queued, prev, next; } wait[3];
+  int deficit;
+  struct bucket { long tokens; unsigned long time; } rate;
+  // Small writes held back while a message is outstanding.
+  int nagle_delay, nagle_length, nagle_unacked, nagle_close;
+  unsigned long nagle_time, nagle_rfnm_time;
+  int unanswered;               // Data messages waiting for RFNM.
+  uint8_t nagle[NAGLE_MAX];
+  uint8_t held[MESSAGE_MAX];
+  int held_length;
+} connection[TABLE];
 
-struct
+static struct
 {
   client_t client;
   uint32_t sock;
   uint8_t size;
-} listening[CONNECTIONS];
+} listening[LISTENS];
+static pthread_mutex_t listen_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Notes which hosts are considered alive.
-static struct
+// Work handed from the main thread to a shard.
+#define WORK_IMP  1
+#define WORK_APP  2
+#define WORK_IP   3
+
+struct work
 {
+  int type;
+  int length;                   // Words from IMP, otherwise octets.
+  struct sockaddr_un client;
+  socklen_t len;
+  uint8_t data[SEND_MAX];
+};
+
+static struct shard
+{
+  int number;
+  struct ring in;
+  int wake[2];
+  pthread_t thread;
+  struct host *flush;           // Hosts with control commands queued.
+  struct host **table;          // Hash table of the shard's hosts.
+  int size, count;
+  struct host *hosts;           // All of them, newest first.
+  struct host *spare;           // Entries given up, for reuse.
+  unsigned long sweep_time;     // Next look for idle hosts.
+  struct {
+    int words;
+    uint8_t data[SEND_MAX];
+  } loop[LOOP_SLOTS];           // Messages to our own host.
+  int loop_first, loops;
+  unsigned warm_epoch;          // Last warm_start seen.
+  unsigned long warm_time;      // Next check of the warm hosts.
+} shard_table[SHARDS_MAX];
+static int shards = 1;
+static __thread struct shard *shard;
+
+/* What is known about a host.  Each shard keeps a hash table of the
+   hosts it owns, with an entry made when there is state to keep.  An
+   entry idle for HOST_IDLE seconds is taken out of the table, but
+   stays on the list of all hosts with address -1 until reused. */
+struct host
+{
+  int address;
+  unsigned long used_time;
+  struct host *next;            // In the same hash bucket.
+  struct host *all;             // In the list of all the shard's hosts.
+  struct host *flush;           // In the list waiting for flush_control.
   unsigned flags;
 #define HOST_ALIVE   0001
 
   client_t echo;
   unsigned long erp_time;
   int outstanding_rfnm;
-} hosts[256];
+  // Copies of messages waiting for RFNM, to send again if needed.
+  struct
+  {
+    int used, link, words, tries;
+    uint64_t time;
+    uint8_t data[SEND_MAX];
+  } sent[RFNM_RING];
+  int window, window_acks, grant;
+  unsigned long cut_time;
+  // Send times of RST and ECO, for measuring the host round trip.
+  uint64_t rst_sent, eco_sent;
+  // Smoothed round-trip time and variation, in microseconds.  The
+  // rfnm estimate is for the IMP subnet, reply is for host to host.
+  struct { long srtt, rttvar; } rfnm, reply;
+  // Connections waiting for RRP, RFNM, or to send, in order.
+  struct { int first, last, count; } waiters[3];
+  struct bucket rate;
+  int send_retry;
+  unsigned long send_time;
+  // Control commands waiting to be sent, after room for the header.
+  uint8_t ctl[5 + CONTROL_MAX + 1];
+  int ctl_count, ctl_listed;
+};
+
+static struct shard *host_shard (int host)
+{
+  return &shard_table[host % shards];
+}
+
+static unsigned host_hash (int address)
+{
+  uint32_t x = address * 2654435761u;
+  return x ^ x >> 16;
+}
+
+static void host_clear (struct host *h)
+{
+  memset (&h->flags, 0, sizeof *h - offsetof (struct host, flags));
+  h->waiters[WAIT_RRP].first = h->waiters[WAIT_RRP].last = -1;
+  h->waiters[WAIT_RFNM].first = h->waiters[WAIT_RFNM].last = -1;
+  h->waiters[WAIT_SEND].first = h->waiters[WAIT_SEND].last = -1;
+  h->window = RFNM_WINDOW;
+  h->grant = GRANT_MAX;
+}
+
+// Double the hash table when there are as many hosts as buckets.
+static void host_grow (struct shard *s)
+{
+  int i, size = s->size ? 2 * s->size : HOST_TABLE;
+  struct host **table, *h, *next;
+  unsigned j;
+
+  table = calloc (size, sizeof *table);
+  if (table == NULL) {
+    fprintf (stderr, "NCP: Out of memory for hosts.\n");
+    exit (1);
+  }
+  for (i = 0; i < s->size; i++) {
+    for (h = s->table[i]; h != NULL; h = next) {
+      next = h->next;
+      j = host_hash (h->address) & (size - 1);
+      h->next = table[j];
+      table[j] = h;
+    }
+  }
+  free (s->table);
+  s->table = table;
+  s->size = size;
+}
+
+/* Find a host in the table of the shard owning it, or NULL if
+   nothing is known about it.  Only that shard may call this. */
+static struct host *host_find (int address)
+{
+  struct shard *s;
+  struct host *h;
+
+  if (address < 0)
+    return NULL;
+  s = host_shard (address);
+  if (s->size == 0)
+    return NULL;
+  h = s->table[host_hash (address) & (s->size - 1)];
+  for (; h != NULL; h = h->next) {
+    if (h->address == address)
+      return h;
+  }
+  return NULL;
+}
+
+/* Find a host, making an entry if it's new, for when there is state
+   to keep about it.  Only the shard owning it may call this. */
+static struct host *host_entry (int address)
+{
+  struct shard *s = host_shard (address);
+  struct host *h = host_find (address);
+
+  if (h != NULL) {
+    h->used_time = time_tick;
+    return h;
+  }
+
+  if (s->count >= s->size)
+    host_grow (s);
+  h = s->spare;
+  if (h != NULL) {
+    s->spare = h->next;
+    host_clear (h);
+    __atomic_store_n (&h->address, address, __ATOMIC_RELEASE);
+  } else {
+    h = calloc (1, sizeof *h);
+    if (h == NULL) {
+      fprintf (stderr, "NCP: Out of memory for hosts.\n");
+      exit (1);
+    }
+    h->address = address;
+    host_clear (h);
+    h->all = s->hosts;
+    // The main thread may be walking the list for the metrics.
+    __atomic_store_n (&s->hosts, h, __ATOMIC_RELEASE);
+  }
+  h->used_time = time_tick;
+  h->next = s->table[host_hash (address) & (s->size - 1)];
+  s->table[host_hash (address) & (s->size - 1)] = h;
+  s->count++;
+  return h;
+}
+
+/* Give up the entries of hosts not used for HOST_IDLE seconds and
+   with nothing in progress.  A connection keeps its host in use. */
+static void host_sweep (void)
+{
+  struct host *h, **p;
+  int i;
+
+  for (i = FIRST; i < LAST; i++) {
+    h = host_find (connection[i].host);
+    if (h != NULL)
+      h->used_time = time_tick;
+  }
+  for (h = shard->hosts; h != NULL; h = h->all) {
+    if (h->address == -1 || time_tick - h->used_time < 1000UL * HOST_IDLE)
+      continue;
+    if (h->echo.len > 0 || h->ctl_count > 0 || h->ctl_listed ||
+        h->send_retry)
+      continue;
+    p = &shard->table[host_hash (h->address) & (shard->size - 1)];
+    while (*p != h)
+      p = &(*p)->next;
+    *p = h->next;
+    __atomic_store_n (&h->address, -1, __ATOMIC_RELEASE);
+    h->next = shard->spare;
+    shard->spare = h;
+    shard->count--;
+  }
+}
+
+// Optional rate caps, octets per second.  Zero is unlimited.
+static long conn_rate, host_rate;
+
+// Application requests waiting for a reply, to measure latency.
+static struct
+{
+  struct sockaddr_un addr;
+  uint8_t type;
+  uint64_t time;
+} pending[PENDING];
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const char *type_name[] =
 {
@@ -171,29 +485,123 @@ static const char *type_name[] =
   "RRP"  // 13
 };
 
-static uint8_t packet[200];
-static uint8_t app[200];
+static __thread uint8_t packet[SEND_MAX];
+static __thread uint8_t app[MESSAGE_MAX];
+
+static void rtt_sample (long *srtt, long *rttvar, uint64_t usec)
+{
+  long error;
+  if (*srtt == 0) {
+    *srtt = usec;
+    *rttvar = usec / 2;
+    return;
+  }
+  error = (long)usec - *srtt;
+  *srtt += error / 8;
+  if (error < 0)
+    error = -error;
+  *rttvar += (error - *rttvar) / 4;
+}
+
+// Retransmission timeout style estimate, in milliseconds.
+static unsigned long rto (long srtt, long rttvar, int seconds)
+{
+  long ms;
+  if (srtt == 0)
+    return 1000 * seconds;
+  ms = (srtt + 4 * rttvar) / 1000;
+  if (ms < RTO_MIN)
+    ms = RTO_MIN;
+  else if (ms > RTO_MAX)
+    ms = RTO_MAX;
+  return ms;
+}
+
+static unsigned long rfnm_timeout_ms (int host)
+{
+  struct host *h = host_find (host);
+  if (h == NULL)
+    return 1000 * RFNM_TIMEOUT;
+  return rto (h->rfnm.srtt, h->rfnm.rttvar, RFNM_TIMEOUT);
+}
+
+static unsigned long reply_timeout_ms (int host, int seconds)
+{
+  // A connection the remote already closed has no host.
+  struct host *h = host_find (host);
+  if (h == NULL)
+    return 1000 * seconds;
+  return rto (h->reply.srtt, h->reply.rttvar, seconds);
+}
+
+/* Each host has a FIFO of connections waiting for RRP, and one for
+   RFNM, linked through the connection table. */
+static void enqueue (int kind, int i)
+{
+  struct host *h;
+  int last;
+  if (connection[i].wait[kind].queued)
+    return;
+  h = host_entry (connection[i].host);
+  last = h->waiters[kind].last;
+  connection[i].wait[kind].queued = 1;
+  connection[i].wait[kind].prev = last;
+  connection[i].wait[kind].next = -1;
+  if (last == -1)
+    h->waiters[kind].first = i;
+  else
+    connection[last].wait[kind].next = i;
+  h->waiters[kind].last = i;
+  h->waiters[kind].count++;
+}
+
+static void dequeue (int kind, int i)
+{
+  struct host *h;
+  int prev = connection[i].wait[kind].prev;
+  int next = connection[i].wait[kind].next;
+  if (!connection[i].wait[kind].queued)
+    return;
+  h = host_find (connection[i].host);
+  connection[i].wait[kind].queued = 0;
+  if (prev == -1)
+    h->waiters[kind].first = next;
+  else
+    connection[prev].wait[kind].next = next;
+  if (next == -1)
+    h->waiters[kind].last = prev;
+  else
+    connection[next].wait[kind].prev = prev;
+  h->waiters[kind].count--;
+}
 
 static void when_rrp (int i, void (*cb) (int), void (*to) (int))
 {
   connection[i].rrp_callback = cb;
   connection[i].rrp_timeout = to;
-  connection[i].rrp_time = time_tick + RRP_TIMEOUT;
+  connection[i].rrp_time =
+    time_tick + reply_timeout_ms (connection[i].host, RRP_TIMEOUT);
+  enqueue (WAIT_RRP, i);
 }
 
 static void check_rrp (int host)
 {
+  struct host *h = host_find (host);
   void (*cb) (int);
-  int i;
-  for (i = 0; i < CONNECTIONS; i++) {
-    if (connection[i].host != host)
-      continue;
+  int i, n;
+  if (h == NULL)
+    return;
+  // Only those waiting now; a callback may queue again.
+  for (n = h->waiters[WAIT_RRP].count; n > 0; n--) {
+    i = h->waiters[WAIT_RRP].first;
+    if (i == -1)
+      break;
+    dequeue (WAIT_RRP, i);
     cb = connection[i].rrp_callback;
-    if (cb == NULL)
-      continue;
     connection[i].rrp_callback = NULL;
     connection[i].rrp_timeout = NULL;
-    cb (i);
+    if (cb != NULL)
+      cb (i);
   }
 }
 
@@ -201,31 +609,56 @@ static void when_rfnm (int i, void (*cb) (int), void (*to) (int))
 {
   connection[i].rfnm_callback = cb;
   connection[i].rfnm_timeout = to;
-  connection[i].rfnm_time = time_tick + RFNM_TIMEOUT;
+  connection[i].rfnm_time = time_tick + rfnm_timeout_ms (connection[i].host);
+  enqueue (WAIT_RFNM, i);
 }
 
 static void check_rfnm (int host)
 {
+  struct host *h = host_find (host);
   void (*cb) (int);
-  int i;
-  for (i = 0; i < CONNECTIONS; i++) {
-    if (connection[i].host != host)
-      continue;
-    if (connection[i].rfnm_callback == NULL)
-      continue;
-    if (hosts[connection[i].host].outstanding_rfnm >= 4)
-      continue;
+  int i, n;
+  if (h == NULL)
+    return;
+  for (n = h->waiters[WAIT_RFNM].count; n > 0; n--) {
+    if (h->outstanding_rfnm >= h->window)
+      break;
+    i = h->waiters[WAIT_RFNM].first;
+    if (i == -1)
+      break;
+    dequeue (WAIT_RFNM, i);
     cb = connection[i].rfnm_callback;
     connection[i].rfnm_callback = NULL;
     connection[i].rfnm_timeout = NULL;
-    cb (i);
+    if (cb != NULL)
+      cb (i);
+  }
+}
+
+static int find_rcv_link (int host, int link)
+{
+  int i;
+  for (i = FIRST; i < LAST; i++) {
+    if (connection[i].host == host && connection[i].rcv.link == link)
+      return i;
+  }
+  return -1;
+}
+
+static int find_snd_link (int host, int link)
+{
+  int i;
+  for (i = FIRST; i < LAST; i++) {
+    if (connection[i].host == host && connection[i].snd.link == link)
+      return i;
   }
+  return -1;
 }
 
 static int find_link (int host, int link)
 {
   int i;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = FIRST; i < LAST; i++) {
     if (connection[i].host == host && connection[i].rcv.link == link)
       return i;
     if (connection[i].host == host && connection[i].snd.link == link)
@@ -234,10 +667,32 @@ static int find_link (int host, int link)
   return -1;
 }
 
+/* A receive link not used by any other connection to the host, or
+   -1 if all are.  There are fewer links than connections in a shard,
+   so a busy host can run out. */
+static int new_link (int host)
+{
+  int link;
+  for (link = LINK_MIN; link <= LINK_MAX; link++) {
+    if (find_rcv_link (host, link) == -1)
+      return link;
+  }
+  return -1;
+}
+
+/* Local sockets for a new connection: the returned even number and
+   the three after it.  Allocated from a counter shared by all
+   shards, so several connections to the same host don't mix. */
+static uint32_t new_sockets (void)
+{
+  static uint32_t next = 1002;
+  return __atomic_fetch_add (&next, 4, __ATOMIC_RELAXED);
+}
+
 static int find_sockets (int host, uint32_t lsock, uint32_t rsock)
 {
   int i;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = FIRST; i < LAST; i++) {
     if (connection[i].host == host && connection[i].rcv.lsock == lsock
         && connection[i].rcv.rsock == rsock)
       return i;
@@ -251,7 +706,7 @@ static int find_sockets (int host, uint32_t lsock, uint32_t rsock)
 static int find_rcv_sockets (int host, uint32_t lsock, uint32_t rsock)
 {
   int i;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = FIRST; i < LAST; i++) {
     if (connection[i].host == host && connection[i].rcv.lsock == lsock
         && connection[i].rcv.rsock == rsock)
       return i;
@@ -262,7 +717,7 @@ static int find_rcv_sockets (int host, uint32_t lsock, uint32_t rsock)
 static int find_snd_sockets (int host, uint32_t lsock, uint32_t rsock)
 {
   int i;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = FIRST; i < LAST; i++) {
     if (connection[i].host == host && connection[i].snd.lsock == lsock
         && connection[i].snd.rsock == rsock)
       return i;
@@ -273,7 +728,7 @@ static int find_snd_sockets (int host, uint32_t lsock, uint32_t rsock)
 static int find_listen (uint32_t socket)
 {
   int i;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = 0; i < LISTENS; i++) {
     if (listening[i].sock == socket)
       return i;
   }
@@ -283,6 +738,9 @@ static int find_listen (uint32_t socket)
 
 static void destroy (int i)
 {
+  dequeue (WAIT_RRP, i);
+  dequeue (WAIT_RFNM, i);
+  dequeue (WAIT_SEND, i);
   connection[i].host = connection[i].rcv.link = connection[i].snd.link =
     connection[i].snd.size = connection[i].rcv.size = -1;
   connection[i].rcv.lsock = connection[i].rcv.rsock =
@@ -293,19 +751,127 @@ static void destroy (int i)
   connection[i].rrp_timeout = NULL;
   connection[i].rfnm_callback = NULL;
   connection[i].rfnm_timeout = NULL;
+  connection[i].all_callback = NULL;
+  connection[i].all_timeout = NULL;
   connection[i].rfc_timeout = NULL;
   connection[i].cls_timeout = NULL;
+  connection[i].nagle_length = connection[i].nagle_unacked = 0;
+  connection[i].nagle_close = connection[i].held_length = 0;
+  connection[i].unanswered = 0;
+}
+
+// Keep a copy of a message until the IMP answers it.
+static void retain (int host, int link, uint8_t *data, int words)
+{
+  struct host *h = host_entry (host);
+  int i, j = 0;
+  for (i = 0; i < RFNM_RING; i++) {
+    if (!h->sent[i].used)
+      break;
+    if (h->sent[i].time < h->sent[j].time)
+      j = i;
+  }
+  // If all are taken, the oldest is forgotten.
+  if (i == RFNM_RING)
+    i = j;
+  h->sent[i].used = 1;
+  h->sent[i].link = link;
+  h->sent[i].words = words;
+  h->sent[i].tries = 0;
+  h->sent[i].time = metrics_now ();
+  memcpy (h->sent[i].data, data, 2 * words);
+}
+
+// The oldest retained message on a link.
+static int find_sent (int host, int link)
+{
+  struct host *h = host_find (host);
+  int i, j = -1;
+  if (h == NULL)
+    return -1;
+  for (i = 0; i < RFNM_RING; i++) {
+    if (!h->sent[i].used || h->sent[i].link != link)
+      continue;
+    if (j == -1 || h->sent[i].time < h->sent[j].time)
+      j = i;
+  }
+  return j;
+}
+
+// The host address in a leader of either size.
+static int leader_host (const uint8_t *leader)
+{
+  if ((leader[0] & 0x0F) == LEADER_NEW)
+    return leader[LEADER_HOST] << 16 |
+      leader[LEADER_HOST + 1] << 8 | leader[LEADER_HOST + 2];
+  return (leader[1] >> 6) << 16 | (leader[1] & 077);
+}
+
+// Copy a message, widening a short leader.  Returns the words copied.
+static int widen (uint8_t *to, const uint8_t *from, int words)
+{
+  if ((from[0] & 0x0F) == LEADER_NEW) {
+    memcpy (to, from, 2 * words);
+    return words;
+  }
+  memset (to, 0, LEADER_SIZE);
+  to[0] = LEADER_NEW;
+  to[LEADER_FLAGS] = from[0] >> 4;
+  to[LEADER_TYPE] = from[0] & 0x0F;
+  to[LEADER_HOST] = from[1] >> 6;
+  to[LEADER_HOST + 2] = from[1] & 077;
+  to[LEADER_LINK] = from[2];
+  to[LEADER_SUB] = from[3];
+  memcpy (to + LEADER_SIZE, from + 4, 2 * (words - 2));
+  return words + 4;
+}
+
+/* Messages to our own host don't go through the IMP.  They are kept
+   until the event in progress is done, and then processed as if they
+   had arrived, without waiting for any RFNM.  If there's no room, the
+   IMP will do it. */
+static int loop_back (uint8_t *data, int words)
+{
+  int i;
+  if (shard->loops == LOOP_SLOTS)
+    return 0;
+  i = (shard->loop_first + shard->loops++) % LOOP_SLOTS;
+  shard->loop[i].words = words;
+  memcpy (shard->loop[i].data, data, 2 * words);
+  return 1;
 }
 
+/* Send a message to the IMP.  The length in words is counted with a
+   short leader, which is used if the destination fits in one. */
 static void send_imp (int flags, int type, int destination, int link, int id,
                       int subtype, void *data, int words)
 {
-  packet[12] = flags << 4 | type;
-  packet[13] = destination;
-  packet[14] = link;
-  packet[15] = id << 4 | subtype;
+  static __thread uint8_t packet[SEND_MAX];
+  uint8_t *leader = packet + 12;
+  int octets = 2 * (words - 2);
+
+  if (long_leaders ||
+      (destination >> 16) > 3 || (destination & 0xFFFF) > 077) {
+    memset (leader, 0, LEADER_SIZE);
+    leader[0] = LEADER_NEW;
+    leader[LEADER_FLAGS] = flags;
+    leader[LEADER_TYPE] = type;
+    leader[LEADER_HOST] = destination >> 16;
+    leader[LEADER_HOST + 1] = destination >> 8;
+    leader[LEADER_HOST + 2] = destination;
+    leader[LEADER_LINK] = link;
+    leader[LEADER_SUB] = id << 4 | subtype;
+    leader += LEADER_SIZE;
+    words += 4;
+  } else {
+    leader[0] = flags << 4 | type;
+    leader[1] = (destination >> 16) << 6 | (destination & 077);
+    leader[2] = link;
+    leader[3] = id << 4 | subtype;
+    leader += 4;
+  }
   if (data != NULL)
-    memcpy (packet + 16, data, 2 * (words - 2));
+    memcpy (leader, data, octets);
 
 #if 0
   {
@@ -316,9 +882,16 @@ static void send_imp (int flags, int type, int destination, int link, int id,
   }
 #endif
 
-  if (type == IMP_REGULAR)
-    hosts[destination].outstanding_rfnm++;
+  if (type == IMP_REGULAR && destination == self &&
+      loop_back (packet + 12, words))
+    return;
+
+  if (type == IMP_REGULAR) {
+    host_entry (destination)->outstanding_rfnm++;
+    retain (destination, link, packet + 12, words);
+  }
 
+  metrics_imp (1, type, destination, 2 * words);
   imp_send_message (packet, words);
 }
 
@@ -337,18 +910,72 @@ static void send_reset (void)
   send_imp (0, IMP_RESET, 0, 0, 0, 0, NULL, 2);
 }
 
-static void send_ncp (uint8_t destination, uint8_t byte, uint16_t count,
-                      uint8_t type)
+/* Control commands for a host are collected during a pass of the
+   event loop, and sent together in as few messages as possible.  A
+   message being collected holds a place in the RFNM window, so data
+   sent meanwhile can't leave it no room. */
+static void send_control (int host)
+{
+  struct host *h = host_find (host);
+  uint8_t *ctl;
+  int count;
+  if (h == NULL || h->ctl_count == 0)
+    return;
+  ctl = h->ctl;
+  count = h->ctl_count;
+  ctl[0] = 0;
+  ctl[1] = 8;
+  ctl[2] = count >> 8;
+  ctl[3] = count;
+  ctl[4] = 0;
+  ctl[5 + count] = 0;
+  h->ctl_count = 0;
+  // Give back the place held, for send_imp to count the message.
+  h->outstanding_rfnm--;
+  send_imp (0, IMP_REGULAR, host, 0, 0, 0, ctl, (count + 9 + 1)/2);
+}
+
+static void flush_control (void)
+{
+  struct host *h;
+  while ((h = shard->flush) != NULL) {
+    shard->flush = h->flush;
+    h->ctl_listed = 0;
+    send_control (h->address);
+  }
+}
+
+static void send_ncp (int destination, uint8_t type, void *data, int length)
+{
+  struct host *h = host_entry (destination);
+  uint8_t *ctl = h->ctl + 5;
+  fprintf (stderr, "NCP: send to %s, type %d/%s.\n",
+           host_name (destination), type, type <= NCP_MAX ? type_name[type] : "???");
+  metrics_ncp (1, type, destination);
+  if (h->ctl_count + 1 + length > CONTROL_MAX)
+    send_control (destination);
+  if (h->ctl_count == 0)
+    h->outstanding_rfnm++;
+  if (!h->ctl_listed) {
+    h->ctl_listed = 1;
+    h->flush = shard->flush;
+    shard->flush = h;
+  }
+  ctl += h->ctl_count;
+  ctl[0] = type;
+  memcpy (ctl + 1, data, length);
+  h->ctl_count += 1 + length;
+}
+
+// Free entries in the shard's part of the connection table.
+static int free_entries (void)
 {
-  packet[16] = 0;
-  packet[17] = byte;
-  packet[18] = count >> 8;
-  packet[19] = count;
-  packet[20] = 0;
-  packet[21] = type;
-  fprintf (stderr, "NCP: send to %03o, type %d/%s.\n",
-           destination, type, type <= NCP_MAX ? type_name[type] : "???");
-  send_imp (0, IMP_REGULAR, destination, 0, 0, 0, NULL, (count + 9 + 1)/2);
+  int i, n = 0;
+  for (i = FIRST; i < LAST; i++) {
+    if (connection[i].host == -1)
+      n++;
+  }
+  return n;
 }
 
 static int make_open (int host,
@@ -367,166 +994,165 @@ static int make_open (int host,
   connection[i].snd.lsock = snd_lsock;
   connection[i].snd.rsock = snd_rsock;
   connection[i].flags = 0;
+  connection[i].msgs_in = connection[i].msgs_out = 0;
+  connection[i].octets_in = connection[i].octets_out = 0;
   connection[i].rrp_time = time_tick - 1;
   connection[i].rfnm_time = time_tick - 1;
+  connection[i].deficit = 0;
+  connection[i].rate.tokens = 0;
+  connection[i].rate.time = time_tick;
+  connection[i].nagle_delay = connection[i].nagle_length = 0;
+  connection[i].nagle_unacked = connection[i].nagle_close = 0;
+  connection[i].held_length = 0;
+  connection[i].unanswered = 0;
 
   return i;
 }
 
+static void put32 (uint8_t *data, uint32_t x)
+{
+  data[0] = x >> 24;
+  data[1] = x >> 16;
+  data[2] = x >> 8;
+  data[3] = x;
+}
+
 // Sender to receiver.
-void ncp_str (uint8_t destination, uint32_t lsock, uint32_t rsock, uint8_t size)
+void ncp_str (int destination, uint32_t lsock, uint32_t rsock, uint8_t size)
 {
-  packet[22] = lsock >> 24;
-  packet[23] = lsock >> 16;
-  packet[24] = lsock >> 8;
-  packet[25] = lsock;
-  packet[26] = rsock >> 24;
-  packet[27] = rsock >> 16;
-  packet[28] = rsock >> 8;
-  packet[29] = rsock;
-  packet[30] = size;
-  send_ncp (destination, 8, 10, NCP_STR);
+  uint8_t data[9];
+  put32 (data, lsock);
+  put32 (data + 4, rsock);
+  data[8] = size;
+  send_ncp (destination, NCP_STR, data, 9);
 }
 
 // Receiver to sender.
-void ncp_rts (uint8_t destination, uint32_t lsock, uint32_t rsock, uint8_t link)
+void ncp_rts (int destination, uint32_t lsock, uint32_t rsock, uint8_t link)
 {
-  packet[22] = lsock >> 24;
-  packet[23] = lsock >> 16;
-  packet[24] = lsock >> 8;
-  packet[25] = lsock;
-  packet[26] = rsock >> 24;
-  packet[27] = rsock >> 16;
-  packet[28] = rsock >> 8;
-  packet[29] = rsock;
-  packet[30] = link;
-  send_ncp (destination, 8, 10, NCP_RTS);
+  uint8_t data[9];
+  put32 (data, lsock);
+  put32 (data + 4, rsock);
+  data[8] = link;
+  send_ncp (destination, NCP_RTS, data, 9);
 }
 
 // Allocate.
-void ncp_all (uint8_t destination, uint8_t link, uint16_t msg_space, uint32_t bit_space)
+void ncp_all (int destination, uint8_t link, uint16_t msg_space, uint32_t bit_space)
 {
-  packet[22] = link;
-  packet[23] = msg_space >> 8;
-  packet[24] = msg_space;
-  packet[25] = bit_space >> 24;
-  packet[26] = bit_space >> 16;
-  packet[27] = bit_space >> 8;
-  packet[28] = bit_space;
-  send_ncp (destination, 8, 8, NCP_ALL);
+  uint8_t data[7];
+  data[0] = link;
+  data[1] = msg_space >> 8;
+  data[2] = msg_space;
+  put32 (data + 3, bit_space);
+  send_ncp (destination, NCP_ALL, data, 7);
 }
 
 // Return.
-void ncp_ret (uint8_t destination, uint8_t link, uint16_t msg_space, uint32_t bit_space)
+void ncp_ret (int destination, uint8_t link, uint16_t msg_space, uint32_t bit_space)
 {
-  packet[22] = link;
-  packet[23] = msg_space >> 16;
-  packet[24] = msg_space;
-  packet[25] = bit_space >> 24;
-  packet[26] = bit_space >> 16;
-  packet[27] = bit_space >> 8;
-  packet[28] = bit_space;
-  send_ncp (destination, 8, 8, NCP_RET);
+  uint8_t data[7];
+  data[0] = link;
+  data[1] = msg_space >> 8;
+  data[2] = msg_space;
+  put32 (data + 3, bit_space);
+  send_ncp (destination, NCP_RET, data, 7);
 }
 
 // Give back.
-void ncp_gvb (uint8_t destination, uint8_t link, uint8_t fm, uint8_t fb)
+void ncp_gvb (int destination, uint8_t link, uint8_t fm, uint8_t fb)
 {
-  packet[22] = link;
-  packet[23] = fm;
-  packet[24] = fb;
-  send_ncp (destination, 8, 4, NCP_GVB);
+  uint8_t data[3];
+  data[0] = link;
+  data[1] = fm;
+  data[2] = fb;
+  send_ncp (destination, NCP_GVB, data, 3);
 }
 
 // Interrupt by receiver.
-void ncp_inr (uint8_t destination, uint8_t link)
+void ncp_inr (int destination, uint8_t link)
 {
-  packet[22] = link;
-  send_ncp (destination, 8, 2, NCP_INR);
+  send_ncp (destination, NCP_INR, &link, 1);
 }
 
 // Interrupt by sender.
-void ncp_ins (uint8_t destination, uint8_t link)
+void ncp_ins (int destination, uint8_t link)
 {
-  packet[22] = link;
-  send_ncp (destination, 8, 2, NCP_INS);
+  send_ncp (destination, NCP_INS, &link, 1);
 }
 
 // Close.
-void ncp_cls (uint8_t destination, uint32_t lsock, uint32_t rsock)
+void ncp_cls (int destination, uint32_t lsock, uint32_t rsock)
 {
-  packet[22] = lsock >> 24;
-  packet[23] = lsock >> 16;
-  packet[24] = lsock >> 8;
-  packet[25] = lsock;
-  packet[26] = rsock >> 24;
-  packet[27] = rsock >> 16;
-  packet[28] = rsock >> 8;
-  packet[29] = rsock;
-  send_ncp (destination, 8, 9, NCP_CLS);
+  uint8_t data[8];
+  put32 (data, lsock);
+  put32 (data + 4, rsock);
+  send_ncp (destination, NCP_CLS, data, 8);
 }
 
 // Echo.
-void ncp_eco (uint8_t destination, uint8_t data)
+void ncp_eco (int destination, uint8_t data)
 {
-  memset (packet, 0, sizeof packet);
-  packet[22] = data;
-  send_ncp (destination, 8, 2, NCP_ECO);
+  host_entry (destination)->eco_sent = metrics_now ();
+  send_ncp (destination, NCP_ECO, &data, 1);
 }
 
 // Echo reply.
-void ncp_erp (uint8_t destination, uint8_t data)
+void ncp_erp (int destination, uint8_t data)
 {
-  packet[22] = data;
-  send_ncp (destination, 8, 2, NCP_ERP);
+  send_ncp (destination, NCP_ERP, &data, 1);
 }
 
 // Reset.
-void ncp_rst (uint8_t destination)
+void ncp_rst (int destination)
 {
-  send_ncp (destination, 8, 1, NCP_RST);
+  host_entry (destination)->rst_sent = metrics_now ();
+  send_ncp (destination, NCP_RST, NULL, 0);
 }
 
 // Reset reply.
-void ncp_rrp (uint8_t destination)
+void ncp_rrp (int destination)
 {
-  send_ncp (destination, 8, 1, NCP_RRP);
+  send_ncp (destination, NCP_RRP, NULL, 0);
 }
 
 // No operation.
-void ncp_nop (uint8_t destination)
+void ncp_nop (int destination)
 {
-  send_ncp (destination, 8, 1, NCP_NOP);
+  send_ncp (destination, NCP_NOP, NULL, 0);
 }
 
 // Error.
-void ncp_err (uint8_t destination, uint8_t code, void *data, int length)
+void ncp_err (int destination, uint8_t code, void *data, int length)
 {
-  packet[22] = code;
-  memcpy (packet + 23, data, length > 10 ? 10 : length);
+  uint8_t error[11];
+  error[0] = code;
+  memcpy (error + 1, data, length > 10 ? 10 : length);
   if (length < 10)
-    memset (packet + 23 + length, 0, 10 - length);
-  send_ncp (destination, 8, 12, NCP_ERR);
+    memset (error + 1 + length, 0, 10 - length);
+  send_ncp (destination, NCP_ERR, error, 11);
 }
 
-static int process_nop (uint8_t source, uint8_t *data)
+static int process_nop (int source, uint8_t *data)
 {
   return 0;
 }
 
-static void check_all (int i)
+static int send_length (int i)
 {
-  void (*cb) (int) = connection[i].all_callback;
-  int length, count;
-  if (cb == NULL)
-    return;
-  if (connection[i].all_msgs < 1)
-    return;
-  if (connection[i].all_bits < 8)
-    return;
-  length = connection[i].remaining;
+  int length = connection[i].remaining;
   if (8 * length > connection[i].all_bits)
     length = connection[i].all_bits / 8;
+  return length;
+}
+
+static void send_message (int i)
+{
+  void (*cb) (int) = connection[i].all_callback;
+  int length, count;
+  // Keep data behind control commands already queued for the host.
+  send_control (connection[i].host);
+  length = send_length (i);
   count = 8 * length / connection[i].snd.size;
   connection[i].ptr[-5] = 0;
   connection[i].ptr[-4] = connection[i].snd.size;
@@ -535,6 +1161,9 @@ static void check_all (int i)
   connection[i].ptr[-1] = 0;
   send_imp (0, IMP_REGULAR, connection[i].host, connection[i].snd.link,
             0, 0, connection[i].ptr - 5, 2 + (length + 6)/2);
+  connection[i].unanswered++;
+  connection[i].msgs_out++;
+  connection[i].octets_out += length;
   connection[i].all_msgs--;
   connection[i].all_bits -= connection[i].snd.size * count;
   connection[i].remaining -= length;
@@ -544,8 +1173,193 @@ static void check_all (int i)
     connection[i].all_callback = NULL;
     connection[i].all_timeout = NULL;
   } else {
-    connection[i].all_time = time_tick + ALL_TIMEOUT;
+    connection[i].all_time = time_tick + 1000 * ALL_TIMEOUT;
+  }
+}
+
+static int can_send (int i)
+{
+  return connection[i].all_callback != NULL &&
+    connection[i].all_msgs >= 1 && connection[i].all_bits >= 8;
+}
+
+/* Token bucket for a rate cap, holding up to a quarter second worth
+   of octets.  It may go into debt by one message. */
+static long refill (struct bucket *b, long rate)
+{
+  long burst = rate / 4 + 1;
+  b->tokens += rate * (long)(time_tick - b->time) / 1000;
+  if (b->tokens > burst)
+    b->tokens = burst;
+  b->time = time_tick;
+  return b->tokens;
+}
+
+// Milliseconds until a bucket is out of debt.
+static unsigned long refill_ms (struct bucket *b, long rate)
+{
+  return 1 - 1000 * b->tokens / rate;
+}
+
+static void retry_send (int host, unsigned long ms)
+{
+  struct host *h = host_entry (host);
+  unsigned long t = time_tick + ms;
+  if (!h->send_retry || (long)(t - h->send_time) < 0)
+    h->send_time = t;
+  h->send_retry = 1;
+}
+
+/* Send data messages to a host while it has room in its RFNM window.
+   Connections with data take turns by deficit round robin, so a bulk
+   transfer can't starve an interactive session.  Control messages on
+   link 0 don't wait here; they hold their place in the window from
+   when the first command is queued. */
+static void transmit (int host)
+{
+  struct host *h = host_find (host);
+  int i, length, skipped = 0;
+
+  if (h == NULL)
+    return;
+
+  while (h->outstanding_rfnm < h->window) {
+    i = h->waiters[WAIT_SEND].first;
+    if (i == -1)
+      return;
+    if (!can_send (i)) {
+      dequeue (WAIT_SEND, i);
+      connection[i].deficit = 0;
+      continue;
+    }
+    if (host_rate > 0 && refill (&h->rate, host_rate) < 0) {
+      retry_send (host, refill_ms (&h->rate, host_rate));
+      return;
+    }
+    if (conn_rate > 0 && refill (&connection[i].rate, conn_rate) < 0) {
+      retry_send (host, refill_ms (&connection[i].rate, conn_rate));
+      dequeue (WAIT_SEND, i);
+      enqueue (WAIT_SEND, i);
+      // Everyone is over the cap; wait for the timer.
+      if (++skipped >= h->waiters[WAIT_SEND].count)
+        return;
+      continue;
+    }
+    skipped = 0;
+    length = send_length (i);
+    if (connection[i].deficit < length) {
+      // End of this connection's turn.
+      connection[i].deficit += QUANTUM;
+      dequeue (WAIT_SEND, i);
+      enqueue (WAIT_SEND, i);
+      continue;
+    }
+    connection[i].deficit -= length;
+    if (host_rate > 0)
+      h->rate.tokens -= length;
+    if (conn_rate > 0)
+      connection[i].rate.tokens -= length;
+    send_message (i);
+  }
+}
+
+static void check_all (int i)
+{
+  if (connection[i].all_callback == NULL)
+    return;
+  if (!can_send (i)) {
+    metrics_stall (connection[i].host);
+    return;
+  }
+  enqueue (WAIT_SEND, i);
+  transmit (connection[i].host);
+}
+
+static void nagle_acked (int i);
+
+/* A data message on a connection's send link is through, or never
+   will be.  Coalesced data waits for the connection's own messages,
+   not for room in the window. */
+static void link_answered (int host, uint8_t link)
+{
+  int i = find_snd_link (host, link);
+  if (link == 0 || i == -1 || connection[i].unanswered == 0)
+    return;
+  if (--connection[i].unanswered == 0 && connection[i].nagle_unacked)
+    nagle_acked (i);
+}
+
+/* The IMP has answered a message to a host on a link, with an RFNM
+   if it was delivered.  Either way it no longer counts against the
+   window. */
+static void answered (int host, uint8_t link, int delivered)
+{
+  struct host *h = host_find (host);
+  int i = find_sent (host, link);
+  if (h == NULL)
+    return;
+  if (h->outstanding_rfnm > 0)
+    h->outstanding_rfnm--;
+  if (i != -1) {
+    h->sent[i].used = 0;
+    if (delivered && h->sent[i].tries == 0) {
+      uint64_t usec = metrics_now () - h->sent[i].time;
+      rtt_sample (&h->rfnm.srtt, &h->rfnm.rttvar, usec);
+      metrics_rfnm (host, usec);
+    }
+  }
+  link_answered (host, link);
+}
+
+static void congestion (int host)
+{
+  struct host *h = host_find (host);
+  if (h == NULL || !EXPIRED (h->cut_time))
+    return;
+  h->cut_time = time_tick + h->rfnm.srtt / 1000 + 1;
+  h->window_acks = 0;
+  h->window /= 2;
+  if (h->window < 1)
+    h->window = 1;
+  h->grant /= 2;
+  if (h->grant < GRANT_MIN)
+    h->grant = GRANT_MIN;
+  fprintf (stderr, "NCP: Congestion to host %s, window %d, allocation %d.\n",
+           host_name (host), h->window, h->grant);
+}
+
+/* The IMP couldn't deliver a message.  If it may get through later,
+   back off, and send the retained copy again, unless it has been
+   tried too many times. */
+static void undelivered (int host, uint8_t link, int transient)
+{
+  struct host *h = host_find (host);
+  int i = find_sent (host, link);
+  if (transient)
+    congestion (host);
+  if (transient && i != -1 && h->sent[i].tries < RETRIES) {
+    static __thread uint8_t packet[SEND_MAX];
+    int words = h->sent[i].words;
+    h->sent[i].tries++;
+    h->sent[i].time = metrics_now ();
+    memcpy (packet + 12, h->sent[i].data, 2 * words);
+    fprintf (stderr, "NCP: Resend message to host %s link %u, try %d.\n",
+             host_name (host), link, h->sent[i].tries);
+    metrics_imp (1, IMP_REGULAR, host, 2 * words);
+    imp_send_message (packet, words);
+    return;
   }
+  answered (host, link, 0);
+  check_rfnm (host);
+  transmit (host);
+}
+
+// Bits of allocation to grant a host, at most what was asked for.
+static uint32_t grant (int host, uint32_t bits)
+{
+  struct host *h = host_find (host);
+  uint32_t most = h != NULL ? h->grant : GRANT_MAX;
+  return bits < most ? bits : most;
 }
 
 static void when_all (int i, void *data, int length,
@@ -554,23 +1368,32 @@ static void when_all (int i, void *data, int length,
   int octets = (length + 7) / 8;
   connection[i].all_callback = cb;
   connection[i].all_timeout = to;
-  connection[i].all_time = time_tick + ALL_TIMEOUT;
+  connection[i].all_time = time_tick + 1000 * ALL_TIMEOUT;
   connection[i].length = connection[i].remaining = octets;
   connection[i].ptr = connection[i].buffer + 5;
   memcpy (connection[i].ptr, data, octets);
   check_all (i);
 }
 
+// A reply timeout, but at least the given number of seconds.
+static unsigned long app_timeout_ms (int host, int seconds)
+{
+  unsigned long ms = reply_timeout_ms (host, seconds);
+  return ms < 1000 * seconds ? 1000 * seconds : ms;
+}
+
 static void unless_rfc (int i, void (*to) (int))
 {
   connection[i].rfc_timeout = to;
-  connection[i].rfc_time = time_tick + RFC_TIMEOUT;
+  connection[i].rfc_time =
+    time_tick + app_timeout_ms (connection[i].host, RFC_TIMEOUT);
 }
 
 static void unless_cls (int i, void (*to) (int))
 {
   connection[i].cls_timeout = to;
-  connection[i].cls_time = time_tick + CLS_TIMEOUT;
+  connection[i].cls_time =
+    time_tick + app_timeout_ms (connection[i].host, CLS_TIMEOUT);
 }
 
 static uint32_t sock (uint8_t *data)
@@ -583,45 +1406,112 @@ static uint32_t sock (uint8_t *data)
   return x;
 }
 
-static void reply_open (uint8_t host, uint32_t socket, uint8_t i,
+static void pending_request (uint8_t type)
+{
+  int i, j = -1;
+  pthread_mutex_lock (&pending_lock);
+  for (i = 0; i < PENDING; i++) {
+    if (pending[i].type == 0)
+      j = i;
+    else if (pending[i].type == type &&
+             strcmp (pending[i].addr.sun_path, client.sun_path) == 0)
+      break;
+  }
+  if (i == PENDING)
+    i = j;
+  if (i != -1) {
+    memcpy (&pending[i].addr, &client, len);
+    pending[i].type = type;
+    pending[i].time = metrics_now ();
+  }
+  pthread_mutex_unlock (&pending_lock);
+}
+
+static void reply_socket (const void *data, int length,
+                          const struct sockaddr_un *client, socklen_t len)
+{
+  io_send (app_io, data, length, (struct sockaddr *)client, len);
+}
+
+void (*engine_reply) (const void *data, int length,
+                      const struct sockaddr_un *client, socklen_t len)
+  = reply_socket;
+
+/* An application which exits leaves its listening entries behind.
+   See if anything is still bound to the client address. */
+static int client_alive (client_t *c)
+{
+  int fd, alive;
+  if (engine_reply != reply_socket)
+    return 1;
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  if (fd == -1)
+    return 1;
+  alive = connect (fd, (struct sockaddr *)&c->addr, c->len) == 0;
+  close (fd);
+  return alive;
+}
+
+// Find a listening entry whose application has gone away.
+static int find_dead_listen (void)
+{
+  int i;
+  for (i = 0; i < LISTENS; i++) {
+    if (listening[i].sock != 0 && !client_alive (&listening[i].client))
+      return i;
+  }
+  return -1;
+}
+
+static void reply_app (void *reply, int n, struct sockaddr_un *addr,
+                       socklen_t addrlen)
+{
+  uint8_t type = *(uint8_t *)reply - 1;
+  int i;
+  pthread_mutex_lock (&pending_lock);
+  for (i = 0; i < PENDING; i++) {
+    if (pending[i].type == type &&
+        strcmp (pending[i].addr.sun_path, addr->sun_path) == 0) {
+      metrics_app (type, metrics_now () - pending[i].time);
+      pending[i].type = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&pending_lock);
+  engine_reply (reply, n, addr, addrlen);
+}
+
+static void reply_open (int host, uint32_t socket, uint8_t i,
                         uint8_t size, uint8_t e)
 {
-  uint8_t reply[9];
-  fprintf (stderr, "NCP: Application open reply socket %u on host %03o: "
-           "connection %u, error %u.\n", socket, host, i, e);
+  uint8_t reply[11];
+  fprintf (stderr, "NCP: Application open reply socket %u on host %s: "
+           "connection %u, error %u.\n", socket, host_name (host), i, e);
   connection[i].flags &= ~CONN_OPEN;
   reply[0] = WIRE_OPEN+1;
-  reply[1] = host;
-  reply[2] = socket >> 24;
-  reply[3] = socket >> 16;
-  reply[4] = socket >> 8;
-  reply[5] = socket;
-  reply[6] = i;
-  reply[7] = size;
-  reply[8] = e;
-  if (sendto (fd, reply, sizeof reply, 0, (struct sockaddr *)&client, len) == -1)
-    fprintf (stderr, "NCP: sendto %s error: %s.\n",
-             client.sun_path, strerror (errno));
-}
-
-static void reply_listen (uint8_t host, uint32_t socket, uint8_t i,
-                          uint8_t size)
-{
-  uint8_t reply[8];
-  fprintf (stderr, "NCP: Application listen reply socket %u on host %03o: "
-           "connection %u.\n", socket, host, i);
-  connection[i].flags &= ~CONN_LISTEN;
+  wire_put_host (reply + 1, host);
+  put32 (reply + 4, socket);
+  reply[8] = i;
+  reply[9] = size;
+  reply[10] = e;
+  reply_app (reply, sizeof reply,
+             &connection[i].client.addr, connection[i].client.len);
+}
+
+static void reply_listen (client_t *to, int host, uint32_t socket,
+                          int i, uint8_t size)
+{
+  uint8_t reply[10];
+  fprintf (stderr, "NCP: Application listen reply socket %u on host %s: "
+           "connection %d.\n", socket, host_name (host), i);
+  if (i >= 0)
+    connection[i].flags &= ~CONN_LISTEN;
   reply[0] = WIRE_LISTEN+1;
-  reply[1] = host;
-  reply[2] = socket >> 24;
-  reply[3] = socket >> 16;
-  reply[4] = socket >> 8;
-  reply[5] = socket;
-  reply[6] = i;
-  reply[7] = size;
-  if (sendto (fd, reply, sizeof reply, 0, (struct sockaddr *)&client, len) == -1)
-    fprintf (stderr, "NCP: sendto %s error: %s.\n",
-             client.sun_path, strerror (errno));
+  wire_put_host (reply + 1, host);
+  put32 (reply + 4, socket);
+  reply[8] = i;
+  reply[9] = size;
+  reply_app (reply, sizeof reply, &to->addr, to->len);
 }
 
 static void reply_close (uint8_t i)
@@ -631,11 +1521,8 @@ static void reply_close (uint8_t i)
   connection[i].flags &= ~CONN_CLOSE;
   reply[0] = WIRE_CLOSE+1;
   reply[1] = i;
-  if (sendto (fd, reply, sizeof reply, 0,
-              (struct sockaddr *)&connection[i].client.addr,
-              connection[i].client.len) == -1)
-    fprintf (stderr, "NCP: sendto %s error: %s.\n",
-             client.sun_path, strerror (errno));
+  reply_app (reply, sizeof reply,
+             &connection[i].client.addr, connection[i].client.len);
 }
 
 static void maybe_reply (int i)
@@ -643,7 +1530,8 @@ static void maybe_reply (int i)
   if ((connection[i].flags & CONN_GOT_BOTH) == CONN_GOT_BOTH) {
     fprintf (stderr, "NCP: Server got both RTS and STR from client.\n");
     connection[i].rfc_timeout = NULL;
-    reply_listen (connection[i].host, connection[i].listen, i,
+    reply_listen (&connection[i].client,
+                  connection[i].host, connection[i].listen, i,
                   connection[i].rcv.size);
   } else if ((connection[i].flags & CONN_GOT_ALL) == CONN_GOT_ALL) {
     fprintf (stderr, "NCP: Client got RTS, STR, and socket from server.\n");
@@ -666,7 +1554,7 @@ static void cls_timeout (int i)
 {
   fprintf (stderr, "NCP: Timeout waiting for CLS, connection %d.\n", i);
   if (connection[i].flags & CONN_OPEN)
-    reply_open (connection[i].host, connection[i].listen, 0, 0, 255);
+    reply_open (connection[i].host, connection[i].listen, i, 0, 255);
   else if (connection[i].flags & CONN_READ)
     reply_read (i, packet, 0);
   else if (connection[i].flags & CONN_WRITE)
@@ -696,32 +1584,58 @@ static void rfc_timeout (int i)
   }
 }
 
-static int process_rts (uint8_t source, uint8_t *data)
+// Refuse a request for connection.
+static void refuse (int host, uint32_t lsock, uint32_t rsock)
 {
-  int i, j;
+  int i = make_open (host, 0, 0, lsock, rsock);
+  if (i == -1)
+    return;
+  connection[i].snd.size = 0;
+  ncp_cls (host, lsock, rsock);
+  unless_cls (i, cls_timeout);
+}
+
+static int process_rts (int source, uint8_t *data)
+{
+  int i, j, size = 0;
   uint32_t lsock, rsock;
+  client_t listener;
   uint8_t link;
 
   rsock = sock (&data[0]);
   lsock = sock (&data[4]);
   link = data[8];
 
-  fprintf (stderr, "NCP: Received RTS sockets %u:%u link %u from %03o.\n",
-           rsock, lsock, link, source);
+  fprintf (stderr, "NCP: Received RTS sockets %u:%u link %u from %s.\n",
+           rsock, lsock, link, host_name (source));
 
   if (link < LINK_MIN || link > LINK_MAX) {
     ncp_err (source, ERR_PARAM, data - 1, 10);
     return 9;
   }
 
-  if ((i = find_listen (lsock)) != -1) {
+  pthread_mutex_lock (&listen_lock);
+  i = find_listen (lsock);
+  if (i != -1) {
+    size = listening[i].size;
+    listener = listening[i].client;
+  }
+  pthread_mutex_unlock (&listen_lock);
+
+  if (i != -1 && free_entries () < 2) {
+    // No room for ICP and the new connection; let the client time out.
+    fprintf (stderr, "NCP: Table full, ignoring RTS to %u.\n", lsock);
+  } else if (i != -1 && new_link (source) == -1) {
+    fprintf (stderr, "NCP: No link free to %s, refusing RTS to %u.\n",
+             host_name (source), lsock);
+    refuse (source, lsock, rsock);
+  } else if (i != -1) {
     /* A server is listening to this socket, and a client has sent the
        RTS to initiate a new connection.  Reply with an STR for the
        initial part of ICP, which is to send the server data
        connection socket. */
     uint8_t tmp[4];
-    uint32_t s = 0200;
-    int size = listening[i].size;
+    uint32_t s = new_sockets ();
     i = make_open (source, 0, 0, lsock, rsock);
     fprintf (stderr, "NCP: Listening to %u: new connection %d, link %u.\n",
              lsock, i, link);
@@ -747,8 +1661,9 @@ static int process_rts (uint8_t source, uint8_t *data)
                    s, connection[i].snd.rsock+3,
                    s+1, connection[i].snd.rsock+2);
     connection[j].flags |= CONN_LISTEN;
+    connection[j].client = listener;
     connection[j].snd.size = size;
-    connection[j].rcv.link = 46;
+    connection[j].rcv.link = new_link (source);
     connection[j].rcv.size = connection[j].snd.link = 0;
     connection[j].listen = lsock;
     fprintf (stderr, "NCP: New connection %d sockets %d:%d %d:%d link %d\n",
@@ -776,26 +1691,30 @@ static int process_rts (uint8_t source, uint8_t *data)
     }
     maybe_reply (i);
   } else {
-    for (i = 0; i < CONNECTIONS; i++) {
+    for (i = FIRST; i < LAST; i++) {
       if (connection[i].host == source &&
           connection[i].rcv.lsock+3 == lsock &&
           (connection[i].flags & CONN_CLIENT) != 0)
         break;
     }
 
-    if (i == CONNECTIONS) {
+    if (i == LAST) {
       fprintf (stderr, "NCP: Not listening to %u; refusing.\n", lsock);
-      i = make_open (source, 0, 0, lsock, rsock);
-      connection[i].snd.size = 0;
-      ncp_cls (source, lsock, rsock);
-      unless_cls (i, cls_timeout);
+      refuse (source, lsock, rsock);
+    } else if (new_link (source) == -1) {
+      fprintf (stderr, "NCP: No link free to %s, refusing RTS to %u.\n",
+               host_name (source), lsock);
+      refuse (source, lsock, rsock);
     } else {
       j = make_open (source, lsock-1, rsock+1, lsock, rsock);
+      if (j == -1)
+        return 9;
       connection[j].snd.size = connection[i].data_size;
       connection[j].snd.link = link;
-      connection[j].rcv.link = 49;
+      connection[j].rcv.link = new_link (source);
       connection[j].flags |= CONN_OPEN | CONN_GOT_RTS;
       connection[j].listen = connection[i].rcv.rsock;
+      connection[j].client = connection[i].client;
       fprintf (stderr, "NCP: New connection %d sockets %d:%d %d:%d link %u\n",
                j,
                connection[j].rcv.lsock, connection[j].rcv.rsock,
@@ -819,7 +1738,7 @@ There are two cases to consider:
 - Otherwise, it must be an RTS from a client or server wanting to
   complete ICP.
 */
-static int process_str (uint8_t source, uint8_t *data)
+static int process_str (int source, uint8_t *data)
 {
   int i, j;
   uint32_t lsock, rsock;
@@ -829,8 +1748,8 @@ static int process_str (uint8_t source, uint8_t *data)
   lsock = sock (&data[4]);
   size = data[8];
 
-  fprintf (stderr, "NCP: Received STR sockets %u:%u size %u from %03o.\n",
-           rsock, lsock, size, source);
+  fprintf (stderr, "NCP: Received STR sockets %u:%u size %u from %s.\n",
+           rsock, lsock, size, host_name (source));
 
   if ((i = find_rcv_sockets (source, lsock, rsock)) != -1) {
     /* There already exists a connection for this socket pair. */
@@ -839,7 +1758,7 @@ static int process_str (uint8_t source, uint8_t *data)
     if (connection[i].flags & CONN_SENT_RTS) {
       fprintf (stderr, "NCP: Confirmed RTS, connection %d.\n", i);
       if (connection[i].flags & CONN_CLIENT) {
-        ncp_all (source, connection[i].rcv.link, 1, 1000);
+        ncp_all (source, connection[i].rcv.link, 1, grant (source, 1000));
       } else {
         maybe_reply (i);
       }
@@ -855,26 +1774,30 @@ static int process_str (uint8_t source, uint8_t *data)
       maybe_reply (i);
     }
   } else {
-    for (i = 0; i < CONNECTIONS; i++) {
+    for (i = FIRST; i < LAST; i++) {
       if (connection[i].host == source &&
           connection[i].snd.lsock+2 == lsock &&
           (connection[i].flags & CONN_CLIENT) != 0)
         break;
     }
 
-    if (i == CONNECTIONS) {
+    if (i == LAST) {
       fprintf (stderr, "NCP: Refusing RFC to socket %d.\n", lsock);
-      i = make_open (source, 0, 0, lsock, rsock);
-      connection[i].snd.size = 0;
-      ncp_cls (source, lsock, rsock);
-      unless_cls (i, cls_timeout);
+      refuse (source, lsock, rsock);
+    } else if (new_link (source) == -1) {
+      fprintf (stderr, "NCP: No link free to %s, refusing STR to %u.\n",
+               host_name (source), lsock);
+      refuse (source, lsock, rsock);
     } else {
       j = make_open (source, lsock, rsock, lsock+1, rsock-1);
+      if (j == -1)
+        return 9;
       connection[j].rcv.size = size;
-      connection[j].rcv.link = 47;
+      connection[j].rcv.link = new_link (source);
       connection[j].snd.size = connection[i].data_size;
       connection[j].flags |= CONN_OPEN | CONN_GOT_STR;
       connection[j].listen = connection[i].rcv.rsock;
+      connection[j].client = connection[i].client;
       fprintf (stderr, "NCP: New connection %d sockets %d:%d %d:%d link %d\n",
                j,
                connection[j].rcv.lsock, connection[j].rcv.rsock,
@@ -899,15 +1822,15 @@ There are three cases to consider:
 - Or it would be a CLS in response to this host wanting to close a
   normal connection.
 */
-static int process_cls (uint8_t source, uint8_t *data)
+static int process_cls (int source, uint8_t *data)
 {
   int i;
   uint32_t lsock, rsock;
 
   rsock = sock (&data[0]);
   lsock = sock (&data[4]);
-  fprintf (stderr, "NCP: Received CLS sockets %u:%u from %03o.\n",
-           rsock, lsock, source);
+  fprintf (stderr, "NCP: Received CLS sockets %u:%u from %s.\n",
+           rsock, lsock, host_name (source));
 
   if ((i = find_rcv_sockets (source, lsock, rsock)) != -1) {
     connection[i].rcv.size = -1;
@@ -934,7 +1857,7 @@ static int process_cls (uint8_t source, uint8_t *data)
 
   if (connection[i].flags & CONN_OPEN) {
     fprintf (stderr, "NCP: Connection %u refused.\n", i);
-    reply_open (source, rsock, 0, 0, 255);
+    reply_open (source, rsock, i, 0, 255);
   } else if (connection[i].flags & CONN_READ) {
     reply_read (i, packet, 0);
   } else if (connection[i].flags & CONN_WRITE) {
@@ -955,7 +1878,7 @@ static void just_drop (int i)
 {
   fprintf (stderr, "NCP: RFNM timeout, drop connection %d.\n", i);
   if (connection[i].flags & CONN_OPEN)
-    reply_open (connection[i].host, connection[i].listen, 0, 0, 255);
+    reply_open (connection[i].host, connection[i].listen, i, 0, 255);
   else if (connection[i].flags & CONN_READ)
     reply_read (i, packet, 0);
   else if (connection[i].flags & CONN_WRITE)
@@ -1056,8 +1979,8 @@ static void send_socket (int i)
   int j;
   int s =
     connection[i].buffer[5] << 24 |
-    connection[i].buffer[6] << 24 |
-    connection[i].buffer[7] << 24 |
+    connection[i].buffer[6] << 16 |
+    connection[i].buffer[7] << 8 |
     connection[i].buffer[8];
   fprintf (stderr, "NCP: Send socket %u for ICP.\n", s);
   j = find_rcv_sockets (connection[i].host, s, connection[i].snd.rsock + 3);
@@ -1066,16 +1989,16 @@ static void send_socket (int i)
   check_rfnm (connection[i].host);
 }
 
-static int process_all (uint8_t source, uint8_t *data)
+static int process_all (int source, uint8_t *data)
 {
   int i;
   uint8_t link = data[0];
   uint16_t msgs = data[1] << 8 | data[2];
   uint32_t bits = data[3] << 24 | data[4] << 16 | data[5] << 8 | data[6];
 
-  fprintf (stderr, "NCP: Received ALL from %03o, link %u, msgs %u, bits %u.\n",
-           source, link, msgs, bits);
-  i = find_link (source, link);
+  fprintf (stderr, "NCP: Received ALL from %s, link %u, msgs %u, bits %u.\n",
+           host_name (source), link, msgs, bits);
+  i = find_snd_link (source, link);
   if (i == -1) {
     ncp_err (source, ERR_SOCKET, data - 1, 10);
     return 7;
@@ -1086,84 +2009,93 @@ static int process_all (uint8_t source, uint8_t *data)
   return 7;
 }
 
-static int process_gvb (uint8_t source, uint8_t *data)
+static int process_gvb (int source, uint8_t *data)
 {
   int i;
-  fprintf (stderr, "NCP: Received GBV from %03o, link %u.",
-           source, data[0]);
-  i = find_link (source, data[0]);
+  fprintf (stderr, "NCP: Received GBV from %s, link %u.",
+           host_name (source), data[0]);
+  i = find_snd_link (source, data[0]);
   if (i == -1)
     ncp_err (source, ERR_SOCKET, data - 1, 4);
   return 3;
 }
 
-static int process_ret (uint8_t source, uint8_t *data)
+static int process_ret (int source, uint8_t *data)
 {
   int i;
-  fprintf (stderr, "NCP: Received RET from %03o, link %u.",
-           source, data[0]);
-  i = find_link (source, data[0]);
+  fprintf (stderr, "NCP: Received RET from %s, link %u.",
+           host_name (source), data[0]);
+  i = find_snd_link (source, data[0]);
   if (i == -1)
     ncp_err (source, ERR_SOCKET, data - 1, 8);
   return 7;
 }
 
-static int process_inr (uint8_t source, uint8_t *data)
+static int process_inr (int source, uint8_t *data)
 {
   int i;
-  fprintf (stderr, "NCP: Received INR from %03o, link %u.",
-           source, data[0]);
-  i = find_link (source, data[0]);
+  fprintf (stderr, "NCP: Received INR from %s, link %u.",
+           host_name (source), data[0]);
+  i = find_snd_link (source, data[0]);
   if (i == -1)
     ncp_err (source, ERR_SOCKET, data - 1, 2);
   return 1;
 }
 
-static int process_ins (uint8_t source, uint8_t *data)
+static int process_ins (int source, uint8_t *data)
 {
   int i;
-  fprintf (stderr, "NCP: Received INS from %03o, link %u.",
-           source, data[0]);
-  i = find_link (source, data[0]);
+  fprintf (stderr, "NCP: Received INS from %s, link %u.",
+           host_name (source), data[0]);
+  i = find_rcv_link (source, data[0]);
   if (i == -1)
     ncp_err (source, ERR_SOCKET, data - 1, 2);
   return 1;
 }
 
-static int process_eco (uint8_t source, uint8_t *data)
+static int process_eco (int source, uint8_t *data)
 {
-  fprintf (stderr, "NCP: recieved ECO %03o from %03o, replying ERP %03o.\n",
-           *data, source, *data);
+  fprintf (stderr, "NCP: recieved ECO %03o from %s, replying ERP %03o.\n",
+           *data, host_name (source), *data);
   ncp_erp (source, *data);
   return 1;
 }
 
-static void reply_echo (uint8_t host, uint8_t data, uint8_t error)
+static void reply_echo (int host, uint8_t data, uint8_t error)
 {
-  uint8_t reply[4];
-  fprintf (stderr, "NCP: Application echo reply host %03o, data %u, error %u\n",
-           host, data, error);
+  struct host *h = host_find (host);
+  uint8_t reply[6];
+  fprintf (stderr, "NCP: Application echo reply host %s, data %u, error %u\n",
+           host_name (host), data, error);
   reply[0] = WIRE_ECHO+1;
-  reply[1] = host;
-  reply[2] = data;
-  reply[3] = error;
-  if (sendto (fd, reply, sizeof reply, 0,
-              (struct sockaddr *)&hosts[host].echo.addr,
-              hosts[host].echo.len) == -1)
-    fprintf (stderr, "NCP: sendto %s error: %s.\n",
-             hosts[host].echo.addr.sun_path, strerror (errno));
-}
-
-static int process_erp (uint8_t source, uint8_t *data)
-{
-  fprintf (stderr, "NCP: recieved ERP %03o from %03o.\n",
-           *data, source);
-  reply_echo (source, *data, 0x10);
-  hosts[source].echo.len = 0;
+  wire_put_host (reply + 1, host);
+  reply[4] = data;
+  reply[5] = error;
+  reply_app (reply, sizeof reply,
+             &h->echo.addr, h->echo.len);
+}
+
+static int process_erp (int source, uint8_t *data)
+{
+  struct host *h = host_find (source);
+  fprintf (stderr, "NCP: recieved ERP %03o from %s.\n",
+           *data, host_name (source));
+  if (h == NULL)
+    return 0;
+  if (h->eco_sent != 0) {
+    rtt_sample (&h->reply.srtt, &h->reply.rttvar,
+                metrics_now () - h->eco_sent);
+    h->eco_sent = 0;
+  }
+  h->flags |= HOST_ALIVE;
+  // The ECO may have come from warm_up rather than an application.
+  if (h->echo.len > 0)
+    reply_echo (source, *data, 0x10);
+  h->echo.len = 0;
   return 1;
 }
 
-static int process_err (uint8_t source, uint8_t *data)
+static int process_err (int source, uint8_t *data)
 {
   uint32_t rsock;
   int i;
@@ -1177,8 +2109,8 @@ static int process_err (uint8_t source, uint8_t *data)
   case ERR_CONNECT:   meaning = "Socket (link) not connected"; break;
   default: meaning = "Unknown"; break;
   }
-  fprintf (stderr, "NCP: recieved ERR code %03o from %03o: %s.\n",
-           *data, source, meaning);
+  fprintf (stderr, "NCP: recieved ERR code %03o from %s: %s.\n",
+           *data, host_name (source), meaning);
   fprintf (stderr, "NCP: error data:");
   for (i = 1; i < 11; i++)
     fprintf (stderr, " %03o", data[i]);
@@ -1191,7 +2123,7 @@ static int process_err (uint8_t source, uint8_t *data)
     if (i != -1) {
       if ((rsock & 1) == 0)
         rsock--;
-      reply_open (source, rsock, 0, 0, 255);
+      reply_open (source, rsock, i, 0, 255);
       destroy (i);
     }
   }
@@ -1201,32 +2133,40 @@ static int process_err (uint8_t source, uint8_t *data)
 
 static void reset (void)
 {
+  struct host *h;
   int i;
-  for (i = 0; i < CONNECTIONS; i ++) {
+  for (i = 0; i < TABLE; i ++)
     destroy (i);
+  pthread_mutex_lock (&listen_lock);
+  for (i = 0; i < LISTENS; i ++)
     listening[i].sock = 0;
+  pthread_mutex_unlock (&listen_lock);
+  for (i = 0; i < SHARDS_MAX; i++) {
+    for (h = shard_table[i].hosts; h != NULL; h = h->all)
+      host_clear (h);
+    shard_table[i].flush = NULL;
   }
-  memset (hosts, 0, sizeof hosts);
 }
 
 static void reset_host (int host)
 {
   int i;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = FIRST; i < LAST; i++) {
     if (connection[i].host != host)
       continue;
     destroy (i);
   }
 }
 
-static int process_rst (uint8_t source, uint8_t *data)
+static int process_rst (int source, uint8_t *data)
 {
-  fprintf (stderr, "NCP: recieved RST from %03o.\n", source);
-  hosts[source].flags |= HOST_ALIVE;
+  struct host *h = host_entry (source);
+  fprintf (stderr, "NCP: recieved RST from %s.\n", host_name (source));
+  h->flags |= HOST_ALIVE;
 
-  if (hosts[source].echo.len > 0) {
+  if (h->echo.len > 0) {
     reply_echo (source, 0, 0x10);
-    hosts[source].echo.len = 0;
+    h->echo.len = 0;
   }
 
   reset_host(source);
@@ -1234,15 +2174,21 @@ static int process_rst (uint8_t source, uint8_t *data)
   return 0;
 }
 
-static int process_rrp (uint8_t source, uint8_t *data)
+static int process_rrp (int source, uint8_t *data)
 {
-  fprintf (stderr, "NCP: recieved RRP from %03o.\n", source);
-  hosts[source].flags |= HOST_ALIVE;
+  struct host *h = host_entry (source);
+  fprintf (stderr, "NCP: recieved RRP from %s.\n", host_name (source));
+  if (h->rst_sent != 0) {
+    rtt_sample (&h->reply.srtt, &h->reply.rttvar,
+                metrics_now () - h->rst_sent);
+    h->rst_sent = 0;
+  }
+  h->flags |= HOST_ALIVE;
   check_rrp (source);
   return 0;
 }
 
-static int (*ncp_messages[]) (uint8_t source, uint8_t *data) =
+static int (*ncp_messages[]) (int source, uint8_t *data) =
 {
   process_nop,
   process_rts,
@@ -1260,7 +2206,7 @@ static int (*ncp_messages[]) (uint8_t source, uint8_t *data) =
   process_rrp
 };
 
-static void process_ncp (uint8_t source, uint8_t *data, uint16_t count)
+static void process_ncp (int source, uint8_t *data, uint16_t count)
 {
   int i = 0, n;
   while (i < count) {
@@ -1269,6 +2215,7 @@ static void process_ncp (uint8_t source, uint8_t *data, uint16_t count)
       ncp_err (source, ERR_OPCODE, data - 1, 10);
       return;
     }
+    metrics_ncp (0, type, source);
     n = ncp_messages[type] (source, &data[i]);
     if (i + n > count)
       ncp_err (source, ERR_SHORT, data - 1, count - i + 1);
@@ -1278,35 +2225,80 @@ static void process_ncp (uint8_t source, uint8_t *data, uint16_t count)
 
 static void reply_read (uint8_t i, uint8_t *data, int n)
 {
-  static uint8_t reply[1000];
+  static __thread uint8_t reply[1000];
   fprintf (stderr, "NCP: Application read reply connection %d, length %d.\n",
            i, n);
   connection[i].flags &= ~CONN_READ;
   reply[0] = WIRE_READ+1;
   reply[1] = i;
   memcpy (reply + 2, data, n);
-  if (sendto (fd, reply, n + 2, 0,
-              (struct sockaddr *)&connection[i].reader.addr,
-              connection[i].reader.len) == -1)
-    fprintf (stderr, "NCP: sendto %s error: %s.\n",
-             connection[i].reader.addr.sun_path, strerror (errno));
+  reply_app (reply, n + 2,
+             &connection[i].reader.addr, connection[i].reader.len);
+}
+
+/* Map an IPv4 address to a host number, or -1 if it's not on the
+   IMP network. */
+static int ip_host (const uint8_t *address)
+{
+  int imp = address[2] << 8 | address[3];
+  // IMP 0 doesn't exist, and all ones is broadcast.
+  if (address[0] != 10 || imp == 0 || imp == 0xFFFF)
+    return -1;
+  return address[1] << 16 | imp;
+}
+
+/* Send a datagram read from the tun device.  Like any other path
+   with no room, a full window to the host drops it. */
+static void ip_output (uint8_t *data, int n)
+{
+  int host = ip_host (data + 16);
+  struct host *h = host_find (host);
+  if (h != NULL && h->outstanding_rfnm >= h->window) {
+    metrics_ip_dropped ();
+    return;
+  }
+  metrics_ip (1, n);
+  send_imp (0, IMP_REGULAR, host, LINK_IP, 0, 0, data, 2 + (n + 1) / 2);
+}
+
+/* Pass a datagram from the IMP on to the tun device.  The message may
+   be padded, so the length is taken from the IP header. */
+static void ip_input (int source, uint8_t *data, int n)
+{
+  int total;
+  if (tun_fd == -1 || n < 20 || (data[0] >> 4) != 4) {
+    metrics_ip_dropped ();
+    return;
+  }
+  total = (data[2] << 8) | data[3];
+  if (total < 20 || total > n) {
+    fprintf (stderr, "NCP: Bad IP datagram from %s.\n", host_name (source));
+    metrics_ip_dropped ();
+    return;
+  }
+  metrics_ip (0, total);
+  if (write (tun_fd, data, total) == -1)
+    fprintf (stderr, "NCP: tun write error: %s.\n", strerror (errno));
 }
 
 static void process_regular (uint8_t *packet, int length)
 {
-  uint8_t source = packet[1];
-  uint8_t link = packet[2];
+  int source = leader_host (packet);
+  uint8_t link = packet[LEADER_LINK];
+  uint8_t *data = packet + LEADER_SIZE;
   int i, j;
 
-  uint8_t size = packet[5];
-  uint16_t count = (packet[6] << 8) | packet[7];
+  uint8_t size = data[1];
+  uint16_t count = (data[2] << 8) | data[3];
 
   if (link == 0) {
-    process_ncp (source, &packet[9], count);
+    process_ncp (source, &data[5], count);
+  } else if (link == LINK_IP) {
+    ip_input (source, data, 2 * length - LEADER_SIZE);
   } else {
-    fprintf (stderr, "NCP: process regular from %03o link %u.\n",
-             source, link);
-    i = find_link (source, link);
+    fprintf (stderr, "NCP: process regular from %s link %u.\n",
+             host_name (source), link);
+    i = find_rcv_link (source, link);
     if (i == -1) {
       fprintf (stderr, "NCP: Link not connected.\n");
       return;
@@ -1321,7 +2313,7 @@ static void process_regular (uint8_t *packet, int length)
     }
 
     if (connection[i].flags & CONN_CLIENT) {
-      uint32_t s = sock (&packet[9]);
+      uint32_t s = sock (&data[5]);
       fprintf (stderr, "NCP: ICP link %u socket %u.\n", link, s);
       when_rfnm (i, send_cls_rcv, just_drop);
       connection[i].rfc_timeout = NULL;
@@ -1331,15 +2323,25 @@ static void process_regular (uint8_t *packet, int length)
       if (j == -1)
         j = find_snd_sockets (source, connection[i].rcv.lsock+3, s);
       if (j == -1) {
+        if (new_link (source) == -1) {
+          fprintf (stderr, "NCP: No link free to %s.\n", host_name (source));
+          reply_open (source, connection[i].rcv.rsock, i, 0, 255);
+          return;
+        }
         j = make_open (source,
                        connection[i].rcv.lsock+2, s+1,
                        connection[i].rcv.lsock+3, s);
+        if (j == -1) {
+          reply_open (source, connection[i].rcv.rsock, i, 0, 255);
+          return;
+        }
         connection[j].snd.size = connection[i].data_size;
-        connection[j].rcv.link = 45;
+        connection[j].rcv.link = new_link (source);
         fprintf (stderr, "NCP: New connection %d.\n", j);
         when_rfnm (j, send_str_and_rts, rfnm_timeout);
       }
       connection[j].listen = connection[i].rcv.rsock;
+      connection[j].client = connection[i].client;
       connection[j].flags |= CONN_GOT_SOCKET | CONN_OPEN;
       check_rfnm (connection[j].host);
       maybe_reply (j);
@@ -1347,14 +2349,16 @@ static void process_regular (uint8_t *packet, int length)
       return;
     }
 
-    reply_read (i, packet + 9, count);
+    connection[i].msgs_in++;
+    connection[i].octets_in += count;
+    reply_read (i, &data[5], count);
   }
 }
 
 static void process_leader_error (uint8_t *packet, int length)
 {
   const char *reason;
-  switch (packet[3] & 0x0F) {
+  switch (packet[LEADER_SUB] & 0x0F) {
   case 0: reason = "IMP error during leader"; break;
   case 1: reason = "Message less than 32 bits"; break;
   case 2: reason = "Illegal type"; break;
@@ -1370,47 +2374,74 @@ static void process_imp_down (uint8_t *packet, int length)
 
 static void process_blocked (uint8_t *packet, int length)
 {
-  fprintf (stderr, "NCP: Blocked link.\n");
+  fprintf (stderr, "NCP: Blocked link %u to host %s.\n",
+           packet[LEADER_LINK], host_name (leader_host (packet)));
+  undelivered (leader_host (packet), packet[LEADER_LINK], 1);
 }
 
 static void process_imp_nop (uint8_t *packet, int length)
 {
   fprintf (stderr, "NCP: NOP.\n");
+  // The IMP may tell us our own address.
+  if (self == -1 && leader_host (packet) != 0) {
+    self = leader_host (packet);
+    fprintf (stderr, "NCP: This is host %s.\n", host_name (self));
+  }
 }
 
 static void process_rfnm (uint8_t *packet, int length)
 {
-  uint8_t host = packet[1];
-  fprintf (stderr, "NCP: Ready for next message to host %03o link %u.\n",
-           host, packet[2]);
-  hosts[host].outstanding_rfnm--;
+  int host = leader_host (packet);
+  struct host *h = host_find (host);
+  fprintf (stderr, "NCP: Ready for next message to host %s link %u.\n",
+           host_name (host), packet[LEADER_LINK]);
+  if (h == NULL)
+    return;
+  answered (host, packet[LEADER_LINK], 1);
+  // A window's worth of RFNMs grows the window by one.
+  if (++h->window_acks >= h->window) {
+    h->window_acks = 0;
+    if (h->window < WINDOW_MAX)
+      h->window++;
+    if (h->grant < GRANT_MAX)
+      h->grant += GRANT_STEP;
+    if (h->grant > GRANT_MAX)
+      h->grant = GRANT_MAX;
+  }
   check_rfnm (host);
+  transmit (host);
 }
 
 static void process_full (uint8_t *packet, int length)
 {
-  fprintf (stderr, "NCP: Link table full.\n");
+  fprintf (stderr, "NCP: Link table full, host %s.\n",
+           host_name (leader_host (packet)));
+  undelivered (leader_host (packet), packet[LEADER_LINK], 1);
 }
 
 static void process_host_dead (uint8_t *packet, int length)
 {
   const char *reason;
-  uint8_t host = packet[1];
+  int host = leader_host (packet);
+  struct host *h = host_find (host);
 
-  switch (packet[3] & 0x0F) {
+  switch (packet[LEADER_SUB] & 0x0F) {
   case 0: reason = "IMP cannot be reached"; break;
   case 1: reason = "is not up"; break;
   case 3: reason = "communication administratively prohibited"; break;
   default: reason = "dead, unknown reason"; break;
   }
-  fprintf (stderr, "NCP: Host %03o %s.\n", host, reason);
+  fprintf (stderr, "NCP: Host %s %s.\n", host_name (host), reason);
+  if (h == NULL)
+    return;
 
-  if (hosts[host].echo.len > 0) {
-    reply_echo (host, 0, packet[3] & 0x0F);
-    hosts[host].echo.len = 0;
+  if (h->echo.len > 0) {
+    reply_echo (host, 0, packet[LEADER_SUB] & 0x0F);
+    h->echo.len = 0;
   }
 
-  hosts[host].flags &= ~HOST_ALIVE;
+  answered (host, packet[LEADER_LINK], 0);
+  h->flags &= ~HOST_ALIVE;
   reset_host(host);
 }
 
@@ -1422,7 +2453,8 @@ static void process_data_error (uint8_t *packet, int length)
 static void process_incomplete (uint8_t *packet, int length)
 {
   const char *reason;
-  switch (packet[3] & 0x0F) {
+  int subtype = packet[LEADER_SUB] & 0x0F;
+  switch (subtype) {
   case 0: reason = "Host did not accept message quickly enough"; break;
   case 1: reason = "Message too long"; break;
   case 2: reason = "Message took too long in transmission"; break;
@@ -1431,8 +2463,11 @@ static void process_incomplete (uint8_t *packet, int length)
   case 5: reason = "I/O failure during reception"; break;
   default: reason = "Unknown reason"; break;
   }
-  fprintf (stderr, "NCP: Incomplete transmission from %03o: %s.\n",
-           packet[1], reason);
+  fprintf (stderr, "NCP: Incomplete transmission from %s: %s.\n",
+           host_name (leader_host (packet)), reason);
+  // A message too long, or failing for an unknown reason, is not retried.
+  undelivered (leader_host (packet), packet[LEADER_LINK],
+               subtype != 1 && subtype <= 5);
 }
 
 static void process_reset (uint8_t *packet, int length)
@@ -1455,7 +2490,7 @@ static void (*imp_messages[]) (uint8_t *packet, int length) =
   process_reset
 };
 
-static void process_imp (uint8_t *packet, int length)
+static void process_imp (uint8_t *data, int length)
 {
   int type;
 
@@ -1464,16 +2499,19 @@ static void process_imp (uint8_t *packet, int length)
     int i;
     for (i = 0; i < 2 * length; i+=2)
       fprintf (stderr, " >>> %06o (%03o %03o)\n",
-               (packet[i] << 8) | packet[i+1], packet[i], packet[i+1]);
+               (data[i] << 8) | data[i+1], data[i], data[i+1]);
   }
 #endif
 
-  if (length < 2) {
+  if (length < 2 || ((data[0] & 0x0F) == LEADER_NEW && length < 6)) {
     fprintf (stderr, "NCP: leader too short.\n");
     send_leader_error (1);
     return;
   }
-  type = packet[0] & 0x0F;
+  memset (packet, 0, sizeof packet);
+  length = widen (packet, data, length);
+  type = packet[LEADER_TYPE];
+  metrics_imp (0, type, leader_host (packet), 2 * length);
   if (type <= IMP_RESET)
     imp_messages[type] (packet, length);
   else {
@@ -1482,13 +2520,84 @@ static void process_imp (uint8_t *packet, int length)
   }
 }
 
+/* Three NOPs are sent to the IMP, one second apart.  They are paced
+   by tick, so the event loop keeps running in the meantime. */
+static int nops_left = 0;
+static unsigned long nop_time;
+
 static void send_nops (void)
 {
+  nops_left = 3;
+  nop_time = time_tick;
+}
+
+static int imp_ready = 0;
+static int notified = 0;
+
+/* Hosts from NCP_WARM are reset as soon as the IMP is ready, so the
+   first open to one doesn't have to wait for RRP. */
+static int warm[WARM_MAX];
+static int warm_hosts = 0;
+static unsigned warm_epoch = 0;
+
+// Have the shards (re)start warming up their hosts.
+static void warm_start (void)
+{
+  if (warm_hosts > 0)
+    __atomic_add_fetch (&warm_epoch, 1, __ATOMIC_RELEASE);
+}
+
+/* Tell a supervisor that the daemon is up, once the IMP is ready and
+   the NOPs have been sent.  Either by writing to a file descriptor
+   given in NCP_READY_FD, or with a systemd style message to the
+   datagram socket in NOTIFY_SOCKET. */
+static void notify_ready (void)
+{
+  struct sockaddr_un addr;
+  const char *x;
+  int s;
+
+  if (notified || !imp_ready || nops_left > 0)
+    return;
+  notified = 1;
+  fprintf (stderr, "NCP: Ready.\n");
+
+  x = getenv ("NCP_READY_FD");
+  if (x != NULL) {
+    s = atoi (x);
+    if (write (s, "READY\n", 6) == -1)
+      fprintf (stderr, "NCP: ready fd error: %s.\n", strerror (errno));
+    close (s);
+  }
+
+  x = getenv ("NOTIFY_SOCKET");
+  if (x != NULL && (x[0] == '/' || x[0] == '@')) {
+    memset (&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, x, sizeof addr.sun_path - 1);
+    if (x[0] == '@')
+      addr.sun_path[0] = 0;
+    s = socket (AF_UNIX, SOCK_DGRAM, 0);
+    if (s == -1 ||
+        sendto (s, "READY=1", 7, 0, (struct sockaddr *)&addr,
+                offsetof (struct sockaddr_un, sun_path) + strlen (x)) == -1)
+      fprintf (stderr, "NCP: notify error: %s.\n", strerror (errno));
+    if (s != -1)
+      close (s);
+  }
+}
+
+static void check_nops (void)
+{
+  if (nops_left == 0 || !EXPIRED (nop_time))
+    return;
   send_nop ();
-  sleep (1);
-  send_nop ();
-  sleep (1);
-  send_nop ();
+  nop_time += 1000;
+  if (--nops_left == 0) {
+    notify_ready ();
+    if (imp_ready)
+      warm_start ();
+  }
 }
 
 static void ncp_reset (int flap)
@@ -1505,40 +2614,42 @@ static void ncp_reset (int flap)
   send_nops ();
 }
 
-static int imp_ready = 0;
-
 static void ncp_imp_ready (int flag)
 {
   if (!imp_ready && flag) {
     fprintf (stderr, "NCP: IMP going up.\n");
     //ncp_reset (0);
+    if (nops_left == 0)
+      warm_start ();
   } else if (imp_ready && !flag) {
     fprintf (stderr, "NCP: IMP going down.\n");
   }
   imp_ready = flag;
+  notify_ready ();
 }
 
 static void app_echo (void)
 {
-  uint8_t host = app[1];
+  int host = wire_get_host (app + 1);
+  struct host *h = host_entry (host);
 
   fprintf (stderr, "NCP: Application echo.\n");
 
-  if (hosts[host].echo.len > 0) {
+  if (h->echo.len > 0) {
     reply_echo (host, 0, 0x20);
     return;
   }
 
-  memcpy (&hosts[host].echo.addr, &client, len);
-  hosts[host].echo.len = len;
-  hosts[host].erp_time = time_tick + ERP_TIMEOUT;
-  ncp_eco (host, app[2]);
+  memcpy (&h->echo.addr, &client, len);
+  h->echo.len = len;
+  h->erp_time = time_tick + reply_timeout_ms (host, ERP_TIMEOUT);
+  ncp_eco (host, app[4]);
 }
 
 static void app_open_rfc_failed (int i)
 {
   fprintf (stderr, "NCP: Timed out completing RFC for connection %d.\n", i);
-  reply_open (connection[i].host, connection[i].rcv.rsock, 0, 0, 255);
+  reply_open (connection[i].host, connection[i].rcv.rsock, i, 0, 255);
   when_rfnm (i, send_cls_rcv, just_drop);
 }
 
@@ -1554,30 +2665,45 @@ static void app_open_rts (int i)
 static void app_open_fail (int i)
 {
   fprintf (stderr, "NCP: Timed out waiting for RRP.\n");
-  reply_open (connection[i].host, connection[i].rcv.rsock, 0, 0, 255);
+  reply_open (connection[i].host, connection[i].rcv.rsock, i, 0, 255);
 }
 
 static void app_open (void)
 {
   uint32_t socket;
-  uint8_t host = app[1];
+  int host = wire_get_host (app + 1);
+  struct host *h;
   int i, size;
 
-  socket = app[2] << 24 | app[3] << 16 | app[4] << 8 | app[5];
-  size = app[6];
-  fprintf (stderr, "NCP: Application open socket %u, byte size %d, on host %03o.\n",
-           socket, size, host);
+  socket = sock (app + 4);
+  size = app[8];
+  fprintf (stderr, "NCP: Application open socket %u, byte size %d, on host %s.\n",
+           socket, size, host_name (host));
+
+  if (free_entries () < 2 || new_link (host) == -1) {
+    // No room for ICP and the new connection.
+    uint8_t reply[11];
+    fprintf (stderr, "NCP: Table or links full.\n");
+    memset (reply, 0, sizeof reply);
+    reply[0] = WIRE_OPEN+1;
+    wire_put_host (reply + 1, host);
+    put32 (reply + 4, socket);
+    reply[10] = 255;
+    reply_app (reply, sizeof reply, &client, len);
+    return;
+  }
 
   // Initiate a connection.
-  i = make_open (host, 1002, socket, 0, 0);
-  connection[i].rcv.link = 42; //Receive link.
+  i = make_open (host, new_sockets (), socket, 0, 0);
+  connection[i].rcv.link = new_link (host); //Receive link.
   connection[i].data_size = size; //Byte size for data connection.
   connection[i].flags |= CONN_CLIENT | CONN_OPEN;
   connection[i].listen = socket;
   memcpy (&connection[i].client.addr, &client, len);
   connection[i].client.len = len;
 
-  if ((hosts[host].flags & HOST_ALIVE) == 0) {
+  h = host_find (host);
+  if (host != self && (h == NULL || (h->flags & HOST_ALIVE) == 0)) {
     // We haven't communicated with this host yet, send reset and wait.
     ncp_rst (host);
     when_rrp (i, app_open_rts, app_open_fail);
@@ -1589,28 +2715,51 @@ static void app_open (void)
 
 static void app_listen (void)
 {
+  client_t current;
   uint32_t socket;
   int i, size;
 
+  memcpy (&current.addr, &client, len);
+  current.len = len;
+
   socket = app[1] << 24 | app[2] << 16 | app[3] << 8 | app[4];
   size = app[5];
   fprintf (stderr, "NCP: Application listen to socket %u, byte size %d.\n",
            socket, size);
-  if (find_listen (socket) != -1) {
+  pthread_mutex_lock (&listen_lock);
+  i = find_listen (socket);
+  if (i != -1 && client_alive (&listening[i].client)) {
+    pthread_mutex_unlock (&listen_lock);
     fprintf (stderr, "NCP: Alreay listening to %d.\n", socket);
-    reply_listen (0, socket, 0, 0);
+    reply_listen (&current, 0, socket, -1, 0);
     return;
   }
-  i = find_listen (0);
+  if (i == -1)
+    i = find_listen (0);
+  if (i == -1)
+    i = find_dead_listen ();
+  if (i != -1) {
+    listening[i].sock = socket;
+    listening[i].size = size;
+    listening[i].client = current;
+  }
+  pthread_mutex_unlock (&listen_lock);
   if (i == -1) {
     fprintf (stderr, "NCP: Table full.\n");
-    reply_listen (0, socket, 0, 0);
-    return;
+    reply_listen (&current, 0, socket, -1, 0);
   }
-  listening[i].sock = socket;
-  listening[i].size = size;
-  memcpy (&connection[i].client.addr, &client, len);
-  connection[i].client.len = len;
+}
+
+/* Answer a request on a connection which is gone, or never was:
+   nothing read, written, or interrupted. */
+static void reply_gone (uint8_t type, uint8_t i)
+{
+  uint8_t reply[4];
+  fprintf (stderr, "NCP: Connection %u is gone.\n", i);
+  memset (reply, 0, sizeof reply);
+  reply[0] = type + 1;
+  reply[1] = i;
+  reply_app (reply, type == WIRE_WRITE ? 4 : 2, &client, len);
 }
 
 static void app_read (void)
@@ -1619,10 +2768,15 @@ static void app_read (void)
   i = app[1];
   fprintf (stderr, "NCP: Application read %u octets from connection %u.\n",
            app[2], i);
+  if (connection[i].host == -1 || connection[i].rcv.link == -1) {
+    reply_gone (WIRE_READ, i);
+    return;
+  }
   connection[i].flags |= CONN_READ;
   memcpy (&connection[i].reader.addr, &client, len);
   connection[i].reader.len = len;
-  ncp_all (connection[i].host, connection[i].rcv.link, 1, 8 * app[2]);
+  ncp_all (connection[i].host, connection[i].rcv.link, 1,
+           grant (connection[i].host, 8 * app[2]));
 }
 
 static void reply_write (uint8_t i, uint16_t length)
@@ -1635,11 +2789,8 @@ static void reply_write (uint8_t i, uint16_t length)
   reply[1] = i;
   reply[2] = length >> 8;
   reply[3] = length;
-  if (sendto (fd, reply, sizeof reply, 0,
-              (struct sockaddr *)&connection[i].writer.addr,
-              connection[i].writer.len) == -1)
-    fprintf (stderr, "NCP: sendto %s error: %s.\n",
-             connection[i].writer.addr.sun_path, strerror (errno));
+  reply_app (reply, sizeof reply,
+             &connection[i].writer.addr, connection[i].writer.len);
 }
 
 static void send_data_timeout (int i)
@@ -1662,24 +2813,141 @@ static void send_data (int i)
   when_rfnm (i, send_data_now, send_data_timeout);
 }
 
+static void close_connection (int i);
+static void coalesce_flush (int i);
+
+static void nagle_acked (int i)
+{
+  connection[i].nagle_unacked = 0;
+  coalesce_flush (i);
+}
+
+// In case the IMP never answers, stop waiting after the RFNM timeout.
+static void nagle_sent (int i)
+{
+  connection[i].nagle_unacked = 1;
+  connection[i].nagle_rfnm_time =
+    time_tick + rfnm_timeout_ms (connection[i].host);
+}
+
+static void nagle_timeout (int i)
+{
+  fprintf (stderr, "NCP: Timeout sending coalesced data, connection %d.\n", i);
+  connection[i].nagle_unacked = 0;
+  connection[i].nagle_length = 0;
+  if (connection[i].flags & CONN_WRITE)
+    reply_write (i, 0);
+  if (connection[i].nagle_close) {
+    connection[i].nagle_close = 0;
+    close_connection (i);
+  }
+}
+
+/* Send the coalesced writes once the previous message has its RFNM,
+   or the delay is up.  A close waits for all of it to be sent. */
+static void coalesce_flush (int i)
+{
+  int n = connection[i].nagle_length;
+  if (connection[i].all_callback != NULL)
+    return;
+  if (n == 0) {
+    if (connection[i].nagle_close && !connection[i].nagle_unacked) {
+      connection[i].nagle_close = 0;
+      close_connection (i);
+    }
+    return;
+  }
+  if (connection[i].nagle_unacked && !connection[i].nagle_close &&
+      !EXPIRED (connection[i].nagle_time))
+    return;
+  fprintf (stderr, "NCP: Send coalesced data, connection %d, %d bytes.\n",
+           i, n);
+  connection[i].nagle_length = 0;
+  when_all (i, connection[i].nagle, 8 * n, nagle_sent, nagle_timeout);
+  n = connection[i].held_length;
+  if (n > 0) {
+    memcpy (connection[i].nagle, connection[i].held, n);
+    connection[i].nagle_length = n;
+    connection[i].nagle_time = time_tick + connection[i].nagle_delay;
+    connection[i].held_length = 0;
+    reply_write (i, n);
+  }
+}
+
+static void coalesce_write (int i, int n)
+{
+  if (connection[i].held_length > 0) {
+    // Only one write can wait for room.
+    fprintf (stderr, "NCP: Write refused, connection %d has one held.\n", i);
+    reply_write (i, 0);
+    connection[i].flags |= CONN_WRITE;
+    return;
+  }
+  if (connection[i].nagle_length + n > NAGLE_MAX) {
+    // No room; the writer waits until the buffer is sent.
+    memcpy (connection[i].held, app + 2, n);
+    connection[i].held_length = n;
+    coalesce_flush (i);
+    return;
+  }
+  if (connection[i].nagle_length == 0)
+    connection[i].nagle_time = time_tick + connection[i].nagle_delay;
+  memcpy (connection[i].nagle + connection[i].nagle_length, app + 2, n);
+  connection[i].nagle_length += n;
+  reply_write (i, n);
+  coalesce_flush (i);
+}
+
 static void app_write (int n)
 {
   int i = app[1];
   fprintf (stderr, "NCP: Application write, %u bytes to connection %u.\n",
            n, i);
+  if (connection[i].host == -1 || connection[i].snd.link == -1) {
+    reply_gone (WIRE_WRITE, i);
+    return;
+  }
   connection[i].flags |= CONN_WRITE;
   memcpy (&connection[i].writer.addr, &client, len);
   connection[i].writer.len = len;
   if (n > sizeof connection[i].buffer - 5)
     n = sizeof connection[i].buffer - 5;
-  when_all (i, app + 2, 8 * n, send_data, send_data_timeout);
+  if (connection[i].nagle_delay > 0)
+    coalesce_write (i, n);
+  else
+    when_all (i, app + 2, 8 * n, send_data, send_data_timeout);
+}
+
+static void app_coalesce (void)
+{
+  uint8_t reply[2];
+  int i = app[1];
+  connection[i].nagle_delay = app[2] << 8 | app[3];
+  fprintf (stderr, "NCP: Application coalesce, connection %u, delay %d ms.\n",
+           i, connection[i].nagle_delay);
+  reply[0] = WIRE_COALESCE+1;
+  reply[1] = i;
+  reply_app (reply, sizeof reply, &client, len);
+  if (connection[i].nagle_delay == 0) {
+    // Don't keep anything waiting.
+    connection[i].nagle_time = time_tick;
+    coalesce_flush (i);
+  }
 }
 
 static void app_interrupt (void)
 {
+  uint8_t reply[2];
   int i = app[1];
   fprintf (stderr, "NCP: Application interrupt, connection %u.\n", i);
+  if (connection[i].host == -1 || connection[i].snd.link == -1) {
+    reply_gone (WIRE_INTERRUPT, i);
+    return;
+  }
   ncp_ins (connection[i].host, connection[i].snd.link);
+  reply[0] = WIRE_INTERRUPT+1;
+  reply[1] = i;
+  reply_app (reply, sizeof reply, &client, len);
 }
 
 static void app_close (void)
@@ -1690,6 +2958,23 @@ static void app_close (void)
   connection[i].flags |= CONN_CLOSE;
   memcpy (&connection[i].client.addr, &client, len);
   connection[i].client.len = len;
+  if (connection[i].host == -1) {
+    // The remote end has already closed and the connection is gone.
+    reply_close (i);
+    return;
+  }
+  if (connection[i].nagle_delay > 0 &&
+      (connection[i].nagle_length > 0 || connection[i].nagle_unacked ||
+       connection[i].all_callback != NULL)) {
+    connection[i].nagle_close = 1;
+    coalesce_flush (i);
+    return;
+  }
+  close_connection (i);
+}
+
+static void close_connection (int i)
+{
   CONN_SENT_RCV_CLS(i, =);
   CONN_SENT_SND_CLS(i, =);
   ncp_cls (connection[i].host, connection[i].rcv.lsock, connection[i].rcv.rsock);
@@ -1697,25 +2982,154 @@ static void app_close (void)
   unless_cls (i, cls_timeout);
 }
 
-static void application (void)
+static int ncp_metrics (char *text, int size)
 {
-  ssize_t n;
+  static const char cut[] = "# Truncated.\n";
+  struct host *h;
+  const char *a;
+  int i, j, n, used = 0, listens = 0;
 
-  len = sizeof client;
-  n = recvfrom (fd, app, sizeof app, 0, (struct sockaddr *)&client, &len);
-  if (n == -1) {
-    fprintf (stderr, "NCP: recvfrom error.\n");
+  n = metrics_text (text, size);
+  for (i = 0; i < LISTENS; i++) {
+    if (listening[i].sock != 0)
+      listens++;
+  }
+  // Read without stopping the shards, so this is only a snapshot.
+  for (i = 0; i < shards * CONNECTIONS; i++) {
+    if (connection[i].host == -1)
+      continue;
+    used++;
+    if (n >= size)
+      continue;
+    a = host_name (connection[i].host);
+    n += snprintf (text + n, size - n,
+                   "ncp_connection_messages_total{connection=\"%d\",host=\"%s\",direction=\"in\"} %lu\n"
+                   "ncp_connection_messages_total{connection=\"%d\",host=\"%s\",direction=\"out\"} %lu\n"
+                   "ncp_connection_octets_total{connection=\"%d\",host=\"%s\",direction=\"in\"} %lu\n"
+                   "ncp_connection_octets_total{connection=\"%d\",host=\"%s\",direction=\"out\"} %lu\n",
+                   i, a, connection[i].msgs_in,
+                   i, a, connection[i].msgs_out,
+                   i, a, connection[i].octets_in,
+                   i, a, connection[i].octets_out);
+  }
+  for (j = 0; j < shards; j++) {
+    h = __atomic_load_n (&shard_table[j].hosts, __ATOMIC_ACQUIRE);
+    for (; h != NULL; h = h->all) {
+      if (__atomic_load_n (&h->address, __ATOMIC_ACQUIRE) == -1)
+        continue;
+      a = host_name (h->address);
+      if (h->outstanding_rfnm != 0 && n < size)
+        n += snprintf (text + n, size - n,
+                       "ncp_host_outstanding_rfnm{host=\"%s\"} %d\n",
+                       a, h->outstanding_rfnm);
+      if (h->rfnm.srtt != 0 && n < size)
+        n += snprintf (text + n, size - n,
+                       "ncp_host_srtt_seconds{host=\"%s\",path=\"rfnm\"} %g\n"
+                       "ncp_host_timeout_seconds{host=\"%s\",path=\"rfnm\"} %g\n",
+                       a, h->rfnm.srtt / 1e6,
+                       a, rto (h->rfnm.srtt, h->rfnm.rttvar,
+                               RFNM_TIMEOUT) / 1e3);
+      if (h->rfnm.srtt != 0 && n < size)
+        n += snprintf (text + n, size - n,
+                       "ncp_host_window{host=\"%s\"} %d\n"
+                       "ncp_host_allocation_bits{host=\"%s\"} %d\n",
+                       a, h->window, a, h->grant);
+      if (h->reply.srtt != 0 && n < size)
+        n += snprintf (text + n, size - n,
+                       "ncp_host_srtt_seconds{host=\"%s\",path=\"reply\"} %g\n"
+                       "ncp_host_timeout_seconds{host=\"%s\",path=\"reply\"} %g\n",
+                       a, h->reply.srtt / 1e6,
+                       a, rto (h->reply.srtt, h->reply.rttvar,
+                               RRP_TIMEOUT) / 1e3);
+    }
+  }
+  if (n < size)
+    n += snprintf (text + n, size - n,
+                   "ncp_connections %d\n"
+                   "ncp_connections_max %d\n"
+                   "ncp_listening %d\n"
+                   "ncp_listening_max %d\n",
+                   used, shards * CONNECTIONS, listens, LISTENS);
+  if (n < size)
+    return n;
+  // Truncated; drop the partial last line, and say so.
+  for (n = size - sizeof cut; n > 0 && text[n - 1] != '\n'; n--)
+    ;
+  memcpy (text + n, cut, sizeof cut - 1);
+  return n + sizeof cut - 1;
+}
+
+static void app_metrics (void)
+{
+  static uint8_t reply[WIRE_METRICS_MAX];
+  int n;
+  fprintf (stderr, "NCP: Application metrics.\n");
+  reply[0] = WIRE_METRICS+1;
+  n = ncp_metrics ((char *)reply + 1, sizeof reply - 1);
+  reply_app (reply, n + 1, &client, len);
+}
+
+/* This runs on the main thread, so a scraper which doesn't read
+   mustn't stall it.  The socket gets room for the whole text, and if
+   it still won't take it, the scrape is cut short. */
+static void scrape_metrics (void)
+{
+  static char text[65536];
+  int s, n, m;
+
+  s = accept (metrics_fd, NULL, NULL);
+  if (s == -1) {
+    fprintf (stderr, "NCP: metrics accept error: %s.\n", strerror (errno));
     return;
   }
+  n = ncp_metrics (text, sizeof text);
+  fcntl (s, F_SETFL, fcntl (s, F_GETFL) | O_NONBLOCK);
+  setsockopt (s, SOL_SOCKET, SO_SNDBUF, &n, sizeof n);
+  for (m = 0; m < n; ) {
+    ssize_t k = write (s, text + m, n - m);
+    if (k == -1 && errno == EINTR)
+      continue;
+    if (k <= 0) {
+      fprintf (stderr, "NCP: metrics scrape cut short.\n");
+      break;
+    }
+    m += k;
+  }
+  close (s);
+}
 
-  fprintf (stderr, "NCP: Received application request %u from %s.\n",
-           app[0], client.sun_path);
+static void wake (int fd)
+{
+  uint8_t x = 0;
+  if (write (fd, &x, 1) == -1 && errno != EAGAIN)
+    fprintf (stderr, "NCP: wake error: %s.\n", strerror (errno));
+}
 
-  if (!wire_check (app[0], n)) {
-    fprintf (stderr, "NCP: bad application request.\n");
+// Hand a message over to the shard which owns it.
+static void dispatch (struct shard *s, int type, void *data, int length,
+                      int octets)
+{
+  struct work *w;
+  if (octets > sizeof w->data) {
+    fprintf (stderr, "NCP: Work of %d octets too long, dropped.\n", octets);
     return;
   }
+  while ((w = ring_slot (&s->in)) == NULL)
+    sched_yield ();
+  w->type = type;
+  w->length = length;
+  memcpy (w->data, data, octets);
+  if (type == WORK_APP) {
+    memcpy (&w->client, &client, len);
+    w->len = len;
+  }
+  ring_push (&s->in);
+  wake (s->wake[1]);
+}
 
+// Perform an application request in its shard.
+static void request (int n)
+{
   switch (app[0]) {
   case WIRE_ECHO:       app_echo (); break;
   case WIRE_OPEN:       app_open (); break;
@@ -1724,63 +3138,213 @@ static void application (void)
   case WIRE_WRITE:      app_write (n - 2); break;
   case WIRE_INTERRUPT:  app_interrupt (); break;
   case WIRE_CLOSE:      app_close (); break;
+  case WIRE_COALESCE:   app_coalesce (); break;
   default:              fprintf (stderr, "NCP: bad application request.\n"); break;
   }
 }
 
-static void tick (void)
+/* Check the application request in app, and find the shard to
+   perform it.  Returns NULL if there is none to do. */
+static struct shard *route (int n)
+{
+  fprintf (stderr, "NCP: Received application request %u from %s.\n",
+           app[0], client.sun_path);
+
+  if (!wire_check (app[0], n)) {
+    fprintf (stderr, "NCP: bad application request.\n");
+    return NULL;
+  }
+
+  pending_request (app[0]);
+
+  switch (app[0]) {
+  case WIRE_ECHO:
+  case WIRE_OPEN:
+    return host_shard (wire_get_host (app + 1));
+  case WIRE_LISTEN:
+    return &shard_table[0];
+  case WIRE_METRICS:
+    app_metrics ();
+    return NULL;
+  default:
+    // The rest name a connection, which tells the shard.
+    if (app[1] >= shards * CONNECTIONS) {
+      fprintf (stderr, "NCP: bad connection %u.\n", app[1]);
+      reply_gone (app[0], app[1]);
+      return NULL;
+    }
+    return &shard_table[app[1] / CONNECTIONS];
+  }
+}
+
+// Route the next application request.  Returns 0 if there are none.
+static int application (void)
+{
+  struct shard *s;
+  ssize_t n;
+
+  memset (&client, 0, sizeof client);
+  len = sizeof client;
+  n = io_receive (app_io, app, sizeof app, (struct sockaddr *)&client, &len);
+  if (n == -1)
+    return 0;
+
+  s = route (n);
+  if (s != NULL)
+    dispatch (s, WORK_APP, app, n, n);
+  return 1;
+}
+
+// Earliest pending deadline, as milliseconds from now.
+static void deadline (long *wait, unsigned long t)
+{
+  long ms = (long)(t - time_tick);
+  if (ms < *wait)
+    *wait = ms < 0 ? 0 : ms;
+}
+
+/* Reset the shard's warm hosts when the IMP has come up, and check
+   on them every WARM_REFRESH seconds after that: RST to one not
+   known to be alive, otherwise ECO.  One whose ERP doesn't come in
+   time is no longer known to be alive. */
+static void warm_up (long *wait)
+{
+  unsigned epoch = __atomic_load_n (&warm_epoch, __ATOMIC_ACQUIRE);
+  struct host *h;
+  int i;
+
+  if (epoch == 0)
+    return;
+  if (epoch == shard->warm_epoch && !EXPIRED (shard->warm_time)) {
+    deadline (wait, shard->warm_time);
+    return;
+  }
+  shard->warm_epoch = epoch;
+  shard->warm_time = time_tick + 1000 * WARM_REFRESH;
+  deadline (wait, shard->warm_time);
+  for (i = 0; i < warm_hosts; i++) {
+    if (warm[i] == self || host_shard (warm[i]) != shard)
+      continue;
+    h = host_entry (warm[i]);
+    if ((h->flags & HOST_ALIVE) == 0)
+      ncp_rst (warm[i]);
+    else if (h->echo.len == 0) {
+      h->erp_time = time_tick + reply_timeout_ms (warm[i], ERP_TIMEOUT);
+      ncp_eco (warm[i], 0);
+    }
+  }
+}
+
+/* Run expired timers, and return the number of milliseconds until
+   the next one is due. */
+static long tick (void)
 {
+  struct host *h;
   void (*to) (int);
+  long wait = 1000;
   int i;
-  time_tick++;
-  for (i = 0; i < CONNECTIONS; i++) {
+  for (i = FIRST; i < LAST; i++) {
     to = connection[i].rrp_timeout;
-    if (to != NULL && connection[i].rrp_time == time_tick) {
+    if (to != NULL && EXPIRED (connection[i].rrp_time)) {
+      dequeue (WAIT_RRP, i);
       connection[i].rrp_callback = NULL;
       connection[i].rrp_timeout = NULL;
       connection[i].rrp_time = time_tick - 1;
+      metrics_timeout (METRICS_RRP);
       to (i);
     }
     to = connection[i].rfnm_timeout;
-    if (to != NULL && connection[i].rfnm_time == time_tick) {
+    if (to != NULL && EXPIRED (connection[i].rfnm_time)) {
+      dequeue (WAIT_RFNM, i);
       connection[i].rfnm_callback = NULL;
       connection[i].rfnm_timeout = NULL;
-      connection[i].rrp_time = time_tick - 1;
+      connection[i].rfnm_time = time_tick - 1;
+      metrics_timeout (METRICS_RFNM);
       to (i);
     }
     to = connection[i].all_timeout;
-    if (to != NULL && connection[i].all_time == time_tick) {
+    if (to != NULL && EXPIRED (connection[i].all_time)) {
+      dequeue (WAIT_SEND, i);
       connection[i].all_callback = NULL;
       connection[i].all_timeout = NULL;
       connection[i].all_time = time_tick - 1;
+      metrics_timeout (METRICS_ALL);
       to (i);
     }
     to = connection[i].rfc_timeout;
-    if (to != NULL && connection[i].rfc_time == time_tick) {
+    if (to != NULL && EXPIRED (connection[i].rfc_time)) {
       connection[i].rfc_timeout = NULL;
       connection[i].rfc_time = time_tick - 1;
+      metrics_timeout (METRICS_RFC);
       to (i);
     }
     to = connection[i].cls_timeout;
-    if (to != NULL && connection[i].cls_time == time_tick) {
+    if (to != NULL && EXPIRED (connection[i].cls_time)) {
       connection[i].cls_timeout = NULL;
       connection[i].cls_time = time_tick - 1;
+      metrics_timeout (METRICS_CLS);
       to (i);
     }
+    if (connection[i].nagle_unacked &&
+        EXPIRED (connection[i].nagle_rfnm_time)) {
+      metrics_timeout (METRICS_RFNM);
+      nagle_acked (i);
+    }
+    if (connection[i].nagle_length > 0 && EXPIRED (connection[i].nagle_time))
+      coalesce_flush (i);
   }
-  for (i = 0; i < 256; i++) {
-    if (hosts[i].echo.len == 0)
-      continue;
-    if (hosts[i].erp_time != time_tick)
+  for (h = shard->hosts; h != NULL; h = h->all) {
+    if (h->send_retry && EXPIRED (h->send_time)) {
+      h->send_retry = 0;
+      transmit (h->address);
+    }
+    if (h->address == -1 || h->eco_sent == 0 || !EXPIRED (h->erp_time))
       continue;
-    reply_echo (i, 0, 0x20);
-    hosts[i].echo.len = 0;
+    // No ERP, so the host gets an RST before it's used again.
+    metrics_timeout (METRICS_ERP);
+    h->flags &= ~HOST_ALIVE;
+    h->eco_sent = 0;
+    if (h->echo.len > 0)
+      reply_echo (h->address, 0, 0x20);
+    h->echo.len = 0;
+  }
+
+  // The timeouts above may have set new timers.
+  for (i = FIRST; i < LAST; i++) {
+    if (connection[i].rrp_timeout != NULL)
+      deadline (&wait, connection[i].rrp_time);
+    if (connection[i].rfnm_timeout != NULL)
+      deadline (&wait, connection[i].rfnm_time);
+    if (connection[i].all_timeout != NULL)
+      deadline (&wait, connection[i].all_time);
+    if (connection[i].rfc_timeout != NULL)
+      deadline (&wait, connection[i].rfc_time);
+    if (connection[i].cls_timeout != NULL)
+      deadline (&wait, connection[i].cls_time);
+    if (connection[i].nagle_length > 0 && connection[i].all_callback == NULL)
+      deadline (&wait, connection[i].nagle_time);
+    if (connection[i].nagle_unacked)
+      deadline (&wait, connection[i].nagle_rfnm_time);
+  }
+  for (h = shard->hosts; h != NULL; h = h->all) {
+    if (h->send_retry)
+      deadline (&wait, h->send_time);
+    if (h->eco_sent != 0)
+      deadline (&wait, h->erp_time);
   }
+  if (EXPIRED (shard->sweep_time)) {
+    host_sweep ();
+    shard->sweep_time = time_tick + 1000 * HOST_SWEEP;
+  }
+  warm_up (&wait);
+  return wait;
 }
 
 static void cleanup (void)
 {
   unlink (server.sun_path);
+  if (metrics_fd != -1)
+    unlink (metrics_addr.sun_path);
 }
 
 static void sigcleanup (int sig)
@@ -1789,7 +3353,44 @@ static void sigcleanup (int sig)
   exit (0);
 }
 
-void ncp_init (void)
+// Settings for the engine from the environment.
+static void configure (void)
+{
+  char *path;
+
+  // Optional caps on the data rate to a host, and per connection.
+  path = getenv ("NCP_HOST_RATE");
+  if (path != NULL)
+    host_rate = atol (path);
+  path = getenv ("NCP_CONN_RATE");
+  if (path != NULL)
+    conn_rate = atol (path);
+
+  // Our own host number, unless the IMP says.
+  path = getenv ("NCP_HOST");
+  if (path != NULL)
+    self = host_parse (path, NULL);
+
+  // NCP_LEADER=96 for an IMP speaking only the 1822L leader.
+  path = getenv ("NCP_LEADER");
+  if (path != NULL && atoi (path) == 96)
+    long_leaders = 1;
+
+  // Hosts to keep warm, separated by spaces or commas.
+  path = getenv ("NCP_WARM");
+  while (path != NULL && *path != 0 && warm_hosts < WARM_MAX) {
+    char *end;
+    int host = host_parse (path, &end);
+    if (host == -1) {
+      path++;
+      continue;
+    }
+    warm[warm_hosts++] = host;
+    path = end;
+  }
+}
+
+static void daemon_init (void)
 {
   char *path;
 
@@ -1802,46 +3403,337 @@ void ncp_init (void)
     fprintf (stderr, "NCP: bind error: %s.\n", strerror (errno));
     exit (1);
   }
+  app_io = io_start (fd, NULL, 0);
+
+  // Optional text scrape endpoint for the metrics.
+  path = getenv ("NCP_METRICS");
+  if (path != NULL) {
+    metrics_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    memset (&metrics_addr, 0, sizeof metrics_addr);
+    metrics_addr.sun_family = AF_UNIX;
+    strncpy (metrics_addr.sun_path, path, sizeof metrics_addr.sun_path - 1);
+    unlink (metrics_addr.sun_path);
+    if (bind (metrics_fd, (struct sockaddr *)&metrics_addr,
+              sizeof metrics_addr) == -1 ||
+        listen (metrics_fd, 5) == -1) {
+      fprintf (stderr, "NCP: metrics socket error: %s.\n", strerror (errno));
+      exit (1);
+    }
+  }
+
+  configure ();
+
+  // Optional tun interface for IPv4 on LINK_IP.
+  path = getenv ("NCP_TUN");
+  if (path != NULL) {
+    tun_fd = tun_open (path, IP_MTU);
+    if (tun_fd == -1)
+      exit (1);
+  }
+
   signal (SIGINT, sigcleanup);
   signal (SIGQUIT, sigcleanup);
   signal (SIGTERM, sigcleanup);
   atexit (cleanup);
-  time_tick = 0;
 }
 
-int main (int argc, char **argv)
+/* Process the messages looped back to our own host.  Each stands in
+   for its RFNM as well, so waiters are checked when they run out. */
+static void loopback (void)
+{
+  uint8_t link;
+  int i, n;
+
+  if (self == -1 || host_shard (self) != shard)
+    return;
+  for (;;) {
+    flush_control ();
+    if (shard->loops == 0) {
+      check_rfnm (self);
+      transmit (self);
+      flush_control ();
+      if (shard->loops == 0)
+        return;
+    }
+    i = shard->loop_first;
+    shard->loop_first = (i + 1) % LOOP_SLOTS;
+    shard->loops--;
+    memset (packet, 0, sizeof packet);
+    n = widen (packet, shard->loop[i].data, shard->loop[i].words);
+    link = packet[LEADER_LINK];
+    process_regular (packet, n);
+    // Standing in for the RFNM.
+    link_answered (self, link);
+  }
+}
+
+static void *shard_thread (void *arg)
+{
+  struct work *w;
+  uint8_t x[64];
+  shard = arg;
+
+  for (;;) {
+    int n;
+    long wait;
+    fd_set rfds;
+    struct timeval tv;
+    time_tick = metrics_now () / 1000;
+    wait = tick ();
+    flush_control ();
+    loopback ();
+    FD_ZERO (&rfds);
+    FD_SET (shard->wake[0], &rfds);
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = 1000 * (wait % 1000);
+    n = select (shard->wake[0] + 1, &rfds, NULL, NULL, &tv);
+    if (n == -1)
+      fprintf (stderr, "NCP: select error.\n");
+    if (n <= 0)
+      continue;
+    while (read (shard->wake[0], x, sizeof x) > 0)
+      ;
+    while ((w = ring_peek (&shard->in)) != NULL) {
+      uint64_t start = metrics_now ();
+      time_tick = start / 1000;
+      if (w->type == WORK_IMP) {
+        process_imp (w->data, w->length);
+      } else if (w->type == WORK_IP) {
+        ip_output (w->data, w->length);
+      } else {
+        memcpy (app, w->data, w->length);
+        memcpy (&client, &w->client, w->len);
+        len = w->len;
+        request (w->length);
+      }
+      ring_pop (&shard->in);
+      metrics_event (metrics_now () - start);
+    }
+  }
+
+  return NULL;
+}
+
+/* Read a batch of datagrams from the tun device and hand each to the
+   shard owning the destination host. */
+static void tun_input (void)
+{
+  static uint8_t data[SEND_MAX];
+  int i, n, host;
+
+  for (i = 0; i < TUN_BATCH; i++) {
+    n = read (tun_fd, data, IP_MTU + 1);
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf (stderr, "NCP: tun read error: %s.\n", strerror (errno));
+      return;
+    }
+    if (n < 20 || n > IP_MTU || (data[0] >> 4) != 4 ||
+        (host = ip_host (data + 16)) == -1) {
+      metrics_ip_dropped ();
+      continue;
+    }
+    dispatch (host_shard (host), WORK_IP, data, n, n);
+  }
+}
+
+static void start_shards (void)
+{
+  char *x = getenv ("NCP_SHARDS");
+  int i;
+
+  if (x != NULL)
+    shards = atoi (x);
+  if (shards < 1)
+    shards = 1;
+  else if (shards > SHARDS_MAX)
+    shards = SHARDS_MAX;
+  fprintf (stderr, "NCP: %d protocol engine thread%s.\n",
+           shards, shards == 1 ? "" : "s");
+
+  for (i = 0; i < shards; i++) {
+    shard_table[i].number = i;
+    ring_init (&shard_table[i].in, WORK_SLOTS, sizeof (struct work));
+    if (pipe (shard_table[i].wake) == -1) {
+      fprintf (stderr, "NCP: pipe error: %s.\n", strerror (errno));
+      exit (1);
+    }
+    fcntl (shard_table[i].wake[0], F_SETFL, O_NONBLOCK);
+    fcntl (shard_table[i].wake[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create (&shard_table[i].thread, NULL,
+                        shard_thread, &shard_table[i]) != 0) {
+      fprintf (stderr, "NCP: pthread_create error.\n");
+      exit (1);
+    }
+  }
+}
+
+/* The main thread takes messages from the IMP and applications, and
+   hands them to the shards, as well as datagrams from the tun device.
+   It also paces the startup NOPs, and serves the metrics. */
+void engine_daemon (int argc, char **argv)
 {
   imp_init (argc, argv);
-  ncp_init ();
+  daemon_init ();
+  time_tick = metrics_now () / 1000;
   imp_imp_ready = ncp_imp_ready;
   imp_host_ready (1);
   ncp_reset (0);
+  start_shards ();
   for (;;) {
     int n;
+    long wait = 1000;
     fd_set rfds;
     struct timeval tv;
+    time_tick = metrics_now () / 1000;
+    check_nops ();
+    if (nops_left > 0)
+      deadline (&wait, nop_time);
     FD_ZERO (&rfds);
-    FD_SET (fd, &rfds);
+    FD_SET (io_fd (app_io), &rfds);
+    if (metrics_fd != -1)
+      FD_SET (metrics_fd, &rfds);
     imp_fd_set (&rfds);
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    n = select (33, &rfds, NULL, NULL, &tv);
+    if (tun_fd != -1)
+      FD_SET (tun_fd, &rfds);
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = 1000 * (wait % 1000);
+    n = select (FD_SETSIZE, &rfds, NULL, NULL, &tv);
     if (n == -1)
       fprintf (stderr, "NCP: select error.\n");
-    else if (n == 0) {
-      tick ();
-      tv.tv_sec = 1;
-      tv.tv_usec = 0;
-    } else {
+    else if (n > 0) {
+      time_tick = metrics_now () / 1000;
       if (imp_fd_isset (&rfds)) {
-        memset (packet, 0, sizeof packet);
-        imp_receive_message (packet, &n);
-        if (n > 0)
-          process_imp (packet, n);
+        for (;;) {
+          memset (packet, 0, sizeof packet);
+          if (!imp_receive_message (packet, sizeof packet, &n))
+            break;
+          if (n > 0)
+            dispatch (host_shard (leader_host (packet)), WORK_IMP,
+                      packet, n, 2 * n);
+        }
       }
-      if (FD_ISSET (fd, &rfds)) {
-        application ();
+      if (io_ready (app_io, &rfds)) {
+        while (application ())
+          ;
       }
+      if (metrics_fd != -1 && FD_ISSET (metrics_fd, &rfds)) {
+        scrape_metrics ();
+      }
+      if (tun_fd != -1 && FD_ISSET (tun_fd, &rfds))
+        tun_input ();
+    }
+  }
+}
+
+/* The engine run by an application.  It has a single shard, which
+   is the thread calling engine_init. */
+void engine_init (int argc, char **argv)
+{
+  imp_init (argc, argv);
+  configure ();
+  time_tick = metrics_now () / 1000;
+  imp_imp_ready = ncp_imp_ready;
+  imp_host_ready (1);
+  shards = 1;
+  shard = &shard_table[0];
+  shard->number = 0;
+  ncp_reset (0);
+}
+
+void engine_imp (uint8_t *data, int length)
+{
+  uint64_t start = metrics_now ();
+  time_tick = start / 1000;
+  process_imp (data, length);
+  metrics_event (metrics_now () - start);
+}
+
+void engine_request (const void *data, int length,
+                     const struct sockaddr_un *from, socklen_t from_len)
+{
+  if (length > sizeof app) {
+    fprintf (stderr, "NCP: application request too long.\n");
+    return;
+  }
+  time_tick = metrics_now () / 1000;
+  memcpy (app, data, length);
+  memset (&client, 0, sizeof client);
+  memcpy (&client, from, from_len);
+  len = from_len;
+  if (route (length) != NULL)
+    request (length);
+}
+
+void engine_fd_set (fd_set *fdset)
+{
+  imp_fd_set (fdset);
+}
+
+long engine_poll (fd_set *fdset)
+{
+  static uint8_t data[SEND_MAX];
+  long wait;
+  int n;
+
+  if (fdset != NULL && imp_fd_isset (fdset)) {
+    for (;;) {
+      memset (data, 0, sizeof data);
+      if (!imp_receive_message (data, sizeof data, &n))
+        break;
+      if (n > 0)
+        engine_imp (data, n);
+    }
+  }
+  time_tick = metrics_now () / 1000;
+  check_nops ();
+  wait = tick ();
+  flush_control ();
+  loopback ();
+  if (nops_left > 0)
+    deadline (&wait, nop_time);
+  return wait;
+}
+
+static uint8_t *transact_data;
+static int transact_size, transact_length;
+
+static void reply_transact (const void *data, int length,
+                            const struct sockaddr_un *client, socklen_t len)
+{
+  if (length > transact_size)
+    length = transact_size;
+  memcpy (transact_data, data, length);
+  transact_length = length;
+}
+
+int engine_transact (void *data, int length, int size)
+{
+  struct sockaddr_un addr;
+  struct timeval tv;
+  fd_set rfds;
+  long wait;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, "engine");
+  engine_reply = reply_transact;
+  transact_data = data;
+  transact_size = size;
+  transact_length = -1;
+  engine_request (data, length, &addr, sizeof addr);
+  wait = engine_poll (NULL);
+  while (transact_length == -1) {
+    FD_ZERO (&rfds);
+    engine_fd_set (&rfds);
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = 1000 * (wait % 1000);
+    if (select (FD_SETSIZE, &rfds, NULL, NULL, &tv) == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
     }
+    wait = engine_poll (&rfds);
   }
+  return transact_length;
 }
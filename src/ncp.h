@@ -1,5 +1,12 @@
 /* Library for applications. */
 
+/* Hosts are addresses, host << 16 | IMP.  ncp_host reads one the way
+   people write it: a classic 8-bit host number, or H/I for any 1822L
+   host, in decimal.  It returns -1 if the text isn't a host.
+   ncp_host_name shows one, the classic number in octal if it has one. */
+extern int ncp_host (const char *text);
+extern const char *ncp_host_name (int host);
+
 extern int ncp_init (const char *path);
 extern int ncp_echo (int host, int data, int *reply);
 extern int ncp_open (int host, unsigned socket, int *size, int *connection);
@@ -8,3 +15,37 @@ extern int ncp_read (int connection, void *data, int *length);
 extern int ncp_write (int connection, void *data, int *length);
 extern int ncp_interrupt (int connection);
 extern int ncp_close (int connection);
+extern int ncp_metrics (char *text, int *length);
+extern int ncp_coalesce (int connection, int delay);
+
+/* Requests go to ncpd through the socket opened by ncp_init, unless
+   this is set to engine_transact to run the engine in process. */
+extern int (*ncp_transport) (void *data, int length, int size);
+
+/* Asynchronous requests.  Each returns once the request is sent, and
+   the reply comes from ncp_reply when ncp_fd is readable.  Don't mix
+   with the calls above while any replies are outstanding. */
+#define NCP_REPLY_OPEN      3
+#define NCP_REPLY_LISTEN    5
+#define NCP_REPLY_READ      7
+#define NCP_REPLY_WRITE     9
+#define NCP_REPLY_CLOSE    13
+#define NCP_REPLY_COALESCE 17
+
+struct ncp_reply
+{
+  int type;
+  int connection, host, size, error;
+  unsigned socket;
+  void *data;
+  int length;
+};
+
+extern int ncp_fd (void);
+extern int ncp_send_open (int host, unsigned socket, int size);
+extern int ncp_send_listen (unsigned socket, int size);
+extern int ncp_send_read (int connection, int length);
+extern int ncp_send_write (int connection, const void *data, int length);
+extern int ncp_send_close (int connection);
+extern int ncp_send_coalesce (int connection, int delay);
+extern int ncp_reply (struct ncp_reply *reply);
@@ -0,0 +1,14 @@
+/* NCP daemon, serving applications through a socket. */
+
+#include <stdint.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#include "engine.h"
+
+int main (int argc, char **argv)
+{
+  engine_daemon (argc, argv);
+  return 0;
+}
@@ -0,0 +1,56 @@
+/* Lock-free ring buffer with one producer and one consumer thread.
+
+   The producer owns head and the consumer owns tail.  Each side reads
+   the other's index with acquire semantics, and publishes its own
+   with release semantics, so slot contents are visible before the
+   index that hands them over. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+
+void ring_init (struct ring *r, unsigned slots, unsigned size)
+{
+  r->slots = slots;
+  r->size = size;
+  r->data = malloc (slots * size);
+  if (r->data == NULL) {
+    fprintf (stderr, "Fatal error: ring allocation.\n");
+    exit (1);
+  }
+  atomic_init (&r->head, 0);
+  atomic_init (&r->tail, 0);
+}
+
+void *ring_slot (struct ring *r)
+{
+  unsigned head = atomic_load_explicit (&r->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+  if (head - tail == r->slots)
+    return NULL;
+  return r->data + (head & (r->slots - 1)) * r->size;
+}
+
+void ring_push (struct ring *r)
+{
+  unsigned head = atomic_load_explicit (&r->head, memory_order_relaxed);
+  atomic_store_explicit (&r->head, head + 1, memory_order_release);
+}
+
+void *ring_peek (struct ring *r)
+{
+  unsigned tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit (&r->head, memory_order_acquire);
+  if (head == tail)
+    return NULL;
+  return r->data + (tail & (r->slots - 1)) * r->size;
+}
+
+void ring_pop (struct ring *r)
+{
+  unsigned tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  atomic_store_explicit (&r->tail, tail + 1, memory_order_release);
+}
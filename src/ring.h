@@ -0,0 +1,16 @@
+/* Lock-free ring buffer with one producer and one consumer thread. */
+
+struct ring
+{
+  _Atomic unsigned head;   // Next slot to fill, written by producer.
+  _Atomic unsigned tail;   // Next slot to empty, written by consumer.
+  unsigned slots;          // Power of two.
+  unsigned size;           // Octets per slot.
+  uint8_t *data;
+};
+
+extern void ring_init (struct ring *r, unsigned slots, unsigned size);
+extern void *ring_slot (struct ring *r);   // Producer: free slot, or NULL.
+extern void ring_push (struct ring *r);    // Producer: publish the slot.
+extern void *ring_peek (struct ring *r);   // Consumer: oldest slot, or NULL.
+extern void ring_pop (struct ring *r);     // Consumer: release the slot.
@@ -0,0 +1,66 @@
+/* Linux tun device carrying IPv4 datagrams.  The interface address
+   and routes are left to the administrator; only the MTU is set
+   here, since it's imposed by the size of an IMP message. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tun.h"
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+/* Attach to the tun interface with the given name, creating it if
+   necessary.  Returns a non-blocking file descriptor reading and
+   writing one datagram at a time, or -1 on error. */
+int tun_open (const char *name, int mtu)
+{
+  struct ifreq ifr;
+  int fd, s;
+
+  fd = open ("/dev/net/tun", O_RDWR);
+  if (fd == -1) {
+    fprintf (stderr, "TUN: open error: %s.\n", strerror (errno));
+    return -1;
+  }
+
+  memset (&ifr, 0, sizeof ifr);
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  strncpy (ifr.ifr_name, name, IFNAMSIZ - 1);
+  if (ioctl (fd, TUNSETIFF, &ifr) == -1) {
+    fprintf (stderr, "TUN: %s: %s.\n", name, strerror (errno));
+    close (fd);
+    return -1;
+  }
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+  s = socket (AF_INET, SOCK_DGRAM, 0);
+  ifr.ifr_mtu = mtu;
+  if (s == -1 || ioctl (s, SIOCSIFMTU, &ifr) == -1)
+    fprintf (stderr, "TUN: Can't set MTU of %s: %s.\n",
+             ifr.ifr_name, strerror (errno));
+  if (s != -1)
+    close (s);
+
+  fprintf (stderr, "TUN: Interface %s, MTU %d.\n", ifr.ifr_name, mtu);
+  return fd;
+}
+
+#else
+
+// Other systems have no tun device like Linux's.
+int tun_open (const char *name, int mtu)
+{
+  errno = ENOSYS;
+  fprintf (stderr, "TUN: %s: %s.\n", name, strerror (errno));
+  return -1;
+}
+
+#endif
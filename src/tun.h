@@ -0,0 +1,3 @@
+/* Linux tun device carrying IPv4 datagrams. */
+
+extern int tun_open (const char *name, int mtu);
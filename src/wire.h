@@ -7,16 +7,33 @@
 #define WIRE_WRITE       9
 #define WIRE_INTERRUPT  11
 #define WIRE_CLOSE      13
+#define WIRE_METRICS    15
+#define WIRE_COALESCE   17
+
+#define WIRE_METRICS_MAX  8192
+
+/* Host addresses take three octets, for 24-bit 1822L addresses. */
+static void wire_put_host (uint8_t *data, int host)
+{
+  data[0] = host >> 16;
+  data[1] = host >> 8;
+  data[2] = host;
+}
+
+static int wire_get_host (const uint8_t *data)
+{
+  return data[0] << 16 | data[1] << 8 | data[2];
+}
 
 static int wire_check (int type, int size)
 {
   switch (type) {
-  case WIRE_ECHO:        return size == 3;
-  case WIRE_ECHO+1:      return size == 4;
-  case WIRE_OPEN:        return size == 7;
-  case WIRE_OPEN+1:      return size == 9;
+  case WIRE_ECHO:        return size == 5;
+  case WIRE_ECHO+1:      return size == 6;
+  case WIRE_OPEN:        return size == 9;
+  case WIRE_OPEN+1:      return size == 11;
   case WIRE_LISTEN:      return size == 6;
-  case WIRE_LISTEN+1:    return size == 8;
+  case WIRE_LISTEN+1:    return size == 10;
   case WIRE_READ:        return size == 3;
   case WIRE_READ+1:      return 1;
   case WIRE_WRITE:       return 1;
@@ -25,6 +42,10 @@ static int wire_check (int type, int size)
   case WIRE_INTERRUPT+1: return size == 2;
   case WIRE_CLOSE:       return size == 2;
   case WIRE_CLOSE+1:     return size == 2;
+  case WIRE_METRICS:     return size == 1;
+  case WIRE_METRICS+1:   return 1;
+  case WIRE_COALESCE:    return size == 4;
+  case WIRE_COALESCE+1:  return size == 2;
   default:               return 0;
   }
 }